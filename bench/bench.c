@@ -0,0 +1,303 @@
+/**
+ * Microbenchmarks of the storage engine, linked against the engine's objects directly.
+ *
+ * Each benchmark prints one JSON object per line on stdout: operations, ops/sec, latency
+ * percentiles in nanoseconds and buffer pool pages touched per operation, so runs can be
+ * diffed across builds. A readable table goes to stderr. `--pool-frames` sizes the pool of
+ * the inserts; lookups and scans get one that holds the whole table, so their warm pass
+ * runs on hits alone.
+ *
+ * usage: bench [--rows=<n>] [--db=<file>] [--pool-frames=<n>] [--wal-sync=<full|normal>]
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "db.h"
+#include "log.h"
+#include "search.h"
+
+#define BENCH_DEFAULT_ROWS 100000
+
+typedef struct {
+        const char* path;
+        uint32_t rows;
+        PagerConfig config;
+} BenchConfig;
+
+/** @brief Latencies and pool counters of the benchmark being run. */
+typedef struct {
+        const char* name;
+        uint64_t* latencies;
+        uint32_t ops;
+        uint64_t started;
+        uint64_t elapsed;
+        uint64_t pages;
+        PagerStats stats;
+        Table* table;
+} Bench;
+
+static uint64_t
+bench_now(void) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/** @brief xorshift64*, the benchmarks need the same sequence on every run. */
+static uint64_t
+bench_random(uint64_t* state) {
+        *state ^= *state >> 12;
+        *state ^= *state << 25;
+        *state ^= *state >> 27;
+        return *state * 2685821657736338717ULL;
+}
+
+/** @brief Ids 1..n in a fixed random order. */
+static uint32_t*
+bench_shuffled(uint32_t n, uint64_t seed) {
+        uint32_t* ids = malloc(n * sizeof(uint32_t));
+        for (uint32_t i = 0; i < n; i++) ids[i] = i + 1;
+        for (uint32_t i = n - 1; i > 0; i--) {
+                uint32_t j = bench_random(&seed) % (i + 1);
+                uint32_t tmp = ids[i];
+                ids[i] = ids[j];
+                ids[j] = tmp;
+        }
+        return ids;
+}
+
+static void
+bench_row(Row* row, uint32_t id, bool wide) {
+        row->id = id;
+        if (wide) {
+                // Columns at their full width, 13 records fill a leaf
+                snprintf(row->username, sizeof(row->username), "%-*u", COL_SIZE_USERNAME, id);
+                snprintf(row->email, sizeof(row->email), "%-*u", COL_SIZE_EMAIL, id);
+        } else {
+                snprintf(row->username, sizeof(row->username), "user%u", id);
+                snprintf(row->email, sizeof(row->email), "person%u@example.com", id);
+        }
+}
+
+/** @brief Open the benchmark database, emptied first when `fresh`. */
+static Table*
+bench_open(const BenchConfig* config, bool fresh) {
+        if (fresh) {
+                char wal[1024];
+                snprintf(wal, sizeof(wal), "%s-wal", config->path);
+                remove(config->path);
+                remove(wal);
+        }
+        Table* table = new_table(config->path, &config->config);
+        if (!table) {
+                printf("Unable to open %s\n", config->path);
+                exit(EXIT_FAILURE);
+        }
+        return table;
+}
+
+/** @brief Reopen the benchmark database with a pool that holds every page of it. */
+static Table*
+bench_open_cached(const BenchConfig* config) {
+        Table* table = bench_open(config, false);
+        uint32_t pages = table->pager->num_pages;
+        free_table(table);
+
+        BenchConfig cached = *config;
+        uint32_t frames = cached.config.pool_frames ? cached.config.pool_frames : PAGER_DEFAULT_FRAMES;
+        if (pages > frames) {
+                cached.config.pool_frames = pages;
+                fprintf(stderr, "pool frames %u for lookups and scans, one per page\n", pages);
+        }
+        return bench_open(&cached, false);
+}
+
+static void
+bench_start(Bench* bench, const char* name, Table* table, uint32_t ops) {
+        bench->name = name;
+        bench->table = table;
+        bench->ops = ops;
+        bench->latencies = malloc(ops * sizeof(uint64_t));
+        bench->stats = table->pager->stats;
+        bench->started = bench_now();
+}
+
+static int
+compare_u64(const void* a, const void* b) {
+        uint64_t x = *(const uint64_t*)a;
+        uint64_t y = *(const uint64_t*)b;
+        return (x > y) - (x < y);
+}
+
+static uint64_t
+bench_percentile(const Bench* bench, double q) {
+        return bench->latencies[(size_t)(q * (bench->ops - 1))];
+}
+
+/** @brief Report the benchmark and release its latencies. */
+static void
+bench_finish(Bench* bench) {
+        bench->elapsed = bench_now() - bench->started;
+        PagerStats* now = &bench->table->pager->stats;
+        bench->pages = (now->hits - bench->stats.hits) + (now->misses - bench->stats.misses);
+        uint64_t misses = now->misses - bench->stats.misses;
+        qsort(bench->latencies, bench->ops, sizeof(uint64_t), compare_u64);
+
+        double seconds = bench->elapsed / 1e9;
+        double ops_per_sec = bench->ops / seconds;
+        double pages_per_op = (double)bench->pages / bench->ops;
+        printf("{\"bench\":\"%s\",\"ops\":%u,\"seconds\":%.6f,\"ops_per_sec\":%.0f,\"p50_ns\":%" PRIu64
+               ",\"p99_ns\":%" PRIu64 ",\"p999_ns\":%" PRIu64 ",\"pages_per_op\":%.3f,\"misses\":%" PRIu64 "}\n",
+               bench->name, bench->ops, seconds, ops_per_sec, bench_percentile(bench, 0.50),
+               bench_percentile(bench, 0.99), bench_percentile(bench, 0.999), pages_per_op, misses);
+        fprintf(stderr, "%-14s %9u ops %12.0f ops/s  p50 %8" PRIu64 " ns  p99 %8" PRIu64 " ns  p999 %8" PRIu64
+                " ns  %6.2f pages/op\n",
+                bench->name, bench->ops, ops_per_sec, bench_percentile(bench, 0.50), bench_percentile(bench, 0.99),
+                bench_percentile(bench, 0.999), pages_per_op);
+        fflush(stdout);
+        free(bench->latencies);
+}
+
+/** @brief Insert `ids` one statement each, as the REPL would. */
+static void
+bench_insert(const char* name, Table* table, const uint32_t* ids, uint32_t n, bool wide) {
+        Bench bench;
+        Row row;
+        bench_start(&bench, name, table, n);
+        for (uint32_t i = 0; i < n; i++) {
+                bench_row(&row, ids[i], wide);
+                uint64_t t = bench_now();
+                table_insert_rows(table, &row, 1);
+                bench.latencies[i] = bench_now() - t;
+        }
+        bench_finish(&bench);
+}
+
+static void
+bench_lookup(const char* name, Table* table, const uint32_t* ids, uint32_t n) {
+        Bench bench;
+        Cursor cursor;
+        Row row;
+        uint64_t found = 0;
+        bench_start(&bench, name, table, n);
+        cursor_open(table, &cursor);
+        for (uint32_t i = 0; i < n; i++) {
+                uint64_t t = bench_now();
+                table_find(table, ids[i], &cursor);
+                cursor_value(&cursor, &row);
+                bench.latencies[i] = bench_now() - t;
+                found += row.id == ids[i];
+        }
+        cursor_close(&cursor);
+        bench_finish(&bench);
+        if (found != n) {
+                printf("%s: found %" PRIu64 " of %u rows\n", name, found, n);
+                exit(EXIT_FAILURE);
+        }
+}
+
+static void
+bench_scan(const char* name, Table* table, uint32_t n) {
+        Bench bench;
+        Cursor cursor;
+        Row row;
+        uint32_t rows = 0;
+        bench_start(&bench, name, table, n);
+        uint64_t t = bench_now();
+        cursor_open(table, &cursor);
+        table_start(table, &cursor);
+        while (!cursor.table_end && rows < n) {
+                cursor_value(&cursor, &row);
+                cursor_advance(&cursor);
+                uint64_t now = bench_now();
+                bench.latencies[rows++] = now - t;
+                t = now;
+        }
+        cursor_close(&cursor);
+        bench.ops = rows;
+        bench_finish(&bench);
+}
+
+static void
+bench_parse_args(int argc, char** argv, BenchConfig* config) {
+        memset(config, 0, sizeof(BenchConfig));
+        config->path = "bench.db";
+        config->rows = BENCH_DEFAULT_ROWS;
+        config->config.wal_sync = WAL_SYNC_NORMAL;
+
+        for (int i = 1; i < argc; i++) {
+                if (strncmp(argv[i], "--rows=", 7) == 0) {
+                        config->rows = atoi(argv[i] + 7);
+                } else if (strncmp(argv[i], "--db=", 5) == 0) {
+                        config->path = argv[i] + 5;
+                } else if (strncmp(argv[i], "--pool-frames=", 14) == 0) {
+                        config->config.pool_frames = atoi(argv[i] + 14);
+                } else if (strcmp(argv[i], "--wal-sync=full") == 0) {
+                        config->config.wal_sync = WAL_SYNC_FULL;
+                } else if (strcmp(argv[i], "--wal-sync=normal") == 0) {
+                        config->config.wal_sync = WAL_SYNC_NORMAL;
+                } else {
+                        printf("usage: %s [--rows=<n>] [--db=<file>] [--pool-frames=<n>] [--wal-sync=<full|normal>]\n",
+                               argv[0]);
+                        exit(EXIT_FAILURE);
+                }
+        }
+        if (config->rows < 2) {
+                printf("--rows must be at least 2\n");
+                exit(EXIT_FAILURE);
+        }
+}
+
+int
+main(int argc, char** argv) {
+        BenchConfig config;
+        bench_parse_args(argc, argv, &config);
+        log_set_level(LogLevel_OFF);
+
+        uint32_t n = config.rows;
+        uint32_t* sequential = malloc(n * sizeof(uint32_t));
+        for (uint32_t i = 0; i < n; i++) sequential[i] = i + 1;
+        uint32_t* shuffled = bench_shuffled(n, 0x9e3779b97f4a7c15ULL);
+        uint32_t* probes = bench_shuffled(n, 0xd1b54a32d192ed03ULL);
+
+        fprintf(stderr, "rows %u, pool frames %u, key search %s\n", n,
+                config.config.pool_frames ? config.config.pool_frames : PAGER_DEFAULT_FRAMES, keys_search_isa());
+
+        Table* table = bench_open(&config, true);
+        bench_insert("insert_seq", table, sequential, n, false);
+        free_table(table);
+
+        table = bench_open(&config, true);
+        bench_insert("insert_rand", table, shuffled, n, false);
+        bench_insert("insert_dup", table, probes, n, false);
+        free_table(table);
+
+        // Reopened, the pool starts empty: the first pass reads every page it needs
+        table = bench_open_cached(&config);
+        bench_lookup("lookup_cold", table, probes, n);
+        bench_lookup("lookup_warm", table, probes, n);
+        free_table(table);
+
+        table = bench_open_cached(&config);
+        bench_scan("scan_cold", table, n);
+        bench_scan("scan_warm", table, n);
+        free_table(table);
+
+        // Wide rows in random order split a leaf every few inserts
+        table = bench_open(&config, true);
+        bench_insert("insert_split", table, shuffled, n, true);
+        free_table(table);
+
+        char wal[1024];
+        snprintf(wal, sizeof(wal), "%s-wal", config.path);
+        remove(config.path);
+        remove(wal);
+        free(sequential);
+        free(shuffled);
+        free(probes);
+        return EXIT_SUCCESS;
+}
@@ -0,0 +1,100 @@
+#ifndef AIO_H
+#define AIO_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/** Async I/O attributes */
+#define AIO_DEPTH   32 // Reads in flight at once
+#define AIO_THREADS 4  // Workers of the thread pool backend
+
+/**
+ * @brief How reads are issued in the background.
+ * AUTO tries io_uring and falls back to the thread pool when the kernel refuses it.
+ * OFF disables read-ahead entirely.
+ */
+typedef enum {
+        AIO_BACKEND_AUTO,
+        AIO_BACKEND_URING,
+        AIO_BACKEND_THREADS,
+        AIO_BACKEND_OFF,
+} AioBackend;
+
+/** @brief A finished read, `result` is the byte count or a negated errno. */
+typedef struct {
+        uint64_t tag;
+        ssize_t result;
+} AioCompletion;
+
+typedef struct {
+        struct iovec* iov;
+        int iovcnt;
+        off_t offset;
+        uint64_t tag;
+        ssize_t result;
+} AioRequest;
+
+/** @brief io_uring rings mapped from the kernel. */
+typedef struct {
+        int fd;
+        void* sq_ring;
+        void* cq_ring;
+        void* sqes;
+        size_t sq_ring_len;
+        size_t cq_ring_len;
+        size_t sqes_len;
+        uint32_t* sq_head;
+        uint32_t* sq_tail;
+        uint32_t* sq_mask;
+        uint32_t* sq_array;
+        uint32_t* cq_head;
+        uint32_t* cq_tail;
+        uint32_t* cq_mask;
+        void* cqes;
+} AioUring;
+
+/**
+ * @brief Thread pool standing in for io_uring.
+ * Submitted requests wait in `pending`, workers move them to `done` once read.
+ * Both are rings of AIO_DEPTH requests.
+ */
+typedef struct {
+        pthread_t threads[AIO_THREADS];
+        pthread_mutex_t lock;
+        pthread_cond_t work_cond;
+        pthread_cond_t done_cond;
+        AioRequest pending[AIO_DEPTH];
+        AioRequest done[AIO_DEPTH];
+        uint32_t pending_head, pending_len;
+        uint32_t done_head, done_len;
+        bool stop;
+} AioPool;
+
+typedef struct {
+        int fd;
+        AioBackend backend; // URING or THREADS once opened
+        uint32_t in_flight;
+        AioUring uring;
+        AioPool pool;
+} Aio;
+
+/**
+ * Functions
+ */
+Aio* aio_open(int fd, AioBackend backend);
+void aio_close(Aio* aio);
+
+/**
+ * @brief Queue a vectored read of `fd` at `offset`.
+ * `iov` must stay valid until the completion carrying `tag` is reaped.
+ * Returns false when AIO_DEPTH reads are already in flight.
+ */
+bool aio_submit_read(Aio* aio, struct iovec* iov, int iovcnt, off_t offset, uint64_t tag);
+
+/** @brief Collect up to `max` finished reads, blocking for at least one if `wait` is set. */
+uint32_t aio_reap(Aio* aio, AioCompletion* completions, uint32_t max, bool wait);
+const char* aio_backend_name(Aio* aio);
+#endif // AIO_H
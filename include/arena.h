@@ -0,0 +1,40 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** Default bytes in each chunk an arena takes from the heap, larger requests get a chunk of their own */
+#define ARENA_CHUNK_SIZE (64 * 1024)
+
+typedef struct ArenaChunk {
+        struct ArenaChunk* next;
+        size_t size;
+        size_t used;
+        char data[];
+} ArenaChunk;
+
+/**
+ * @brief Bump allocator for memory that lives as long as one statement.
+ * Allocations are never freed one by one; arena_reset() releases them all at once and
+ * keeps the chunks, so once the arena has grown to fit the largest statement seen,
+ * parsing and executing statements no longer touches the heap.
+ */
+typedef struct {
+        ArenaChunk* head;
+        ArenaChunk* current; // Chunk allocations are served from, later chunks are unused
+        size_t allocated;    // Bytes handed out since the last reset
+        size_t reserved;     // Bytes held in chunks
+        size_t chunk_size;
+} Arena;
+
+/**
+ * Functions
+ */
+void arena_init(Arena* arena, size_t chunk_size); // 0 for ARENA_CHUNK_SIZE
+
+/** @brief `size` bytes aligned for any scalar type, valid until the next arena_reset(). */
+void* arena_alloc(Arena* arena, size_t size);
+void arena_reset(Arena* arena);
+void arena_free(Arena* arena);
+#endif // ARENA_H
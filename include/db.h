@@ -8,6 +8,8 @@
 #include <unistd.h>
 
 #include "log.h"
+#include "pager.h"
+#include "search.h"
 // include fcntl for open() function and O_RDWR, O_CREAT flags
 #include <fcntl.h>
 // include fcntl for open() function
@@ -23,7 +25,7 @@
 
 /**
  * @brief Represents a single row in the database.
- * Implemented within repl.Command object
+ * Carried by the statements of vm.h
  */
 typedef struct {
         uint32_t id;
@@ -37,15 +39,28 @@ typedef enum {
         COMMAND_INSERT,
         COMMAND_UPDATE,
         COMMAND_DELETE,
+        COMMAND_BEGIN,
+        COMMAND_COMMIT,
+        COMMAND_ROLLBACK,
         COMMAND_UNKNOWN,
         COMMAND_SYNTAX_ERR,
         COMMAND_SIZING_ERR,
 } CommandType;
 
+/**
+ * @brief Rows a select returns.
+ * The id range bounds the scan itself; the username and email tests run against each
+ * record in its leaf, only matching rows are copied out.
+ */
 typedef struct {
-        CommandType type;
-        Row row;
-} Command;
+        uint32_t min_id; // Inclusive, an empty range has min_id > max_id
+        uint32_t max_id;
+        uint32_t limit; // UINT32_MAX for no limit
+        bool match_username;
+        bool match_email;
+        char username[COL_SIZE_USERNAME + 1];
+        char email[COL_SIZE_EMAIL + 1];
+} Filter;
 
 #define ATTR_SIZE(Struct, Attribute) sizeof(((Struct*)0)->Attribute)
 
@@ -62,42 +77,187 @@ typedef struct {
 #define OFS_UN (OFS_ID + SIZE_ID)
 #define OFS_EM (OFS_UN + SIZE_UN)
 
-/** Table attributes */
-#define PAGE_SIZE       4096
-#define TABLE_MAX_PAGES 100
-#define ROWS_PER_PAGE   (PAGE_SIZE / SIZE_ROW)
-#define TABLE_MAX_ROWS  (TABLE_MAX_PAGES * ROWS_PER_PAGE)
+/** Largest leaf record of a row: length-prefixed username and email, see serialize_row() */
+#define ROW_MAX_RECORD_SIZE (2 + COL_SIZE_USERNAME + COL_SIZE_EMAIL)
 
-typedef struct {
-        int fd;
-        uint32_t file_len;
-        uint32_t num_pages;
-        void* pages[TABLE_MAX_PAGES];
-} Pager;
+/** Leaves a scanning cursor reads ahead of the one it is on */
+#define TABLE_READ_AHEAD 16
 
-typedef struct {
+/** Deepest tree a cursor can descend, ample for 32-bit keys with page-sized internal nodes */
+#define BTREE_MAX_DEPTH 16
+
+/** Columns a secondary index can be created on */
+typedef enum {
+        INDEX_USERNAME,
+        INDEX_EMAIL,
+        INDEX_COLUMNS
+} IndexColumn;
+
+/**
+ * @brief Page 0 holds the free list head and the roots of the secondary indexes, the
+ * table's own tree is rooted on page 1.
+ */
+#define META_PAGE_NUM       0
+#define TABLE_ROOT_PAGE_NUM 1
+
+/**
+ * @brief A B-tree keyed by 32-bit ids on the table's pager.
+ * The table itself is one; each secondary index is another sharing its pager and free
+ * list, keyed by a hash of the column and holding the ids of the rows with that value.
+ */
+typedef struct Table {
         uint32_t num_rows;
         uint32_t root_page;
         Pager* pager;
+        uint32_t right_leaf;                 // Rightmost leaf as last seen by an insert, INVALID_PAGE_NUM if unknown
+        uint32_t right_max;                  // Largest key in `right_leaf`, and so in the table
+        struct Table* index[INDEX_COLUMNS]; // Secondary indexes, NULL until created
 } Table;
 
+/** Most ids an index entry lists, a longer entry only records that the value is common */
+#define INDEX_MAX_IDS ((ROW_MAX_RECORD_SIZE - 1) / sizeof(uint32_t))
+
 typedef struct {
         Table* table;
         uint32_t page_num;
         uint32_t cell_num;
         bool table_end;
+        uint32_t read_ahead;                  // Leaves until the next read ahead, 0 unless the cursor scans
+        uint32_t end_key;                     // Largest id the cursor stops at, see table_seek()
+        uint32_t depth;                       // Internal nodes above the leaf
+        uint32_t path[BTREE_MAX_DEPTH];       // Internal nodes from the root down to the leaf's parent
+        uint32_t path_child[BTREE_MAX_DEPTH]; // Index of the child taken in each node of `path`
+        bool append;                          // Inserting past the largest key, splits keep left nodes full
+        uint64_t snapshot;                    // Commit the cursor reads the tree as of, see cursor_open()
 } Cursor;
 
 typedef enum {
         NODE_INTERNAL,
-        NODE_LEAF
+        NODE_LEAF,
+        NODE_FREE, // On the free list, waiting for get_unused_page_num()
+        NODE_META  // META_PAGE_NUM
 } NodeType;
 
+/** Default fill factor of a bulk load, in percent of a full node */
+#define BULK_DEFAULT_FILL 100
+
+/**
+ * @brief State of a sorted bulk load, see table_bulk_begin().
+ * Only the right edge of the tree is open: the leaf being filled and one internal node
+ * per level above it. `level_page_num[0]` is the internal node right above the leaves.
+ */
+typedef struct {
+        Table* table;
+        uint32_t leaf_space;    // Slot and record bytes per leaf at the requested fill factor
+        uint32_t internal_keys; // Keys per internal node at the requested fill factor
+        uint32_t leaf_page_num; // Leaf being filled, INVALID_PAGE_NUM before the first row
+        uint32_t first_leaf;    // Head of the chain of every leaf written so far
+        bool committed;         // A batch of pages went out to keep the dirty ones within the pool
+        uint32_t leaf_used;     // Slot and record bytes in the leaf being filled
+        uint32_t last_key;
+        uint64_t rows;
+        uint32_t height; // Internal levels opened so far
+        uint32_t level_page_num[BTREE_MAX_DEPTH];
+        uint32_t level_max[BTREE_MAX_DEPTH]; // Largest key under the node's right child
+} BulkLoad;
+
+/** @brief Size and fill of a tree, see table_shape(). */
+typedef struct {
+        uint32_t height; // Levels, a lone leaf is 1
+        uint32_t leaves;
+        uint32_t internal_nodes;
+        uint64_t cells;        // Rows in the leaves
+        double leaf_fill;      // Share of the leaves' cell space in use
+        double internal_fill;  // Share of the internal nodes' key slots in use
+} TreeShape;
+
 /**
  * Functions
  */
-void exec_command(Command* cmd, Table* table);
-Table* new_table(const char* filename);
+void filter_init(Filter* filter); // Every row, no limit
+Table* new_table(const char* filename, const PagerConfig* config);
 void free_table(Table* table);
 void print_tree(Pager* pager, uint32_t page_num, uint32_t indentation_level);
+
+/**
+ * @brief Measure the tree under `root_page`. Only the height is filled in unless `walk`,
+ * which visits every node.
+ */
+void table_shape(Pager* pager, uint32_t root_page, bool walk, TreeShape* shape);
+
+/**
+ * @brief Index `column` of every row, false if the index already exists.
+ * From then on inserts, updates and deletes keep it in step within their own commit,
+ * and a select matching the column on equality looks the rows up through it.
+ */
+bool table_create_index(Table* table, IndexColumn column);
+
+/**
+ * Cursors
+ * A cursor is plain data the caller owns, usually on its stack; it holds no pins between calls.
+ * cursor_open() pins a snapshot of the pager and every placement reads the tree as of it,
+ * so a scan sees none of the commits made while it runs, in any number of threads
+ * alongside the one writing. The cursor may be placed again on any tree of the same pager
+ * until cursor_close() releases the snapshot; an open cursor keeps the page images it
+ * could read from being reclaimed.
+ */
+void cursor_open(Table* table, Cursor* cursor);
+void cursor_close(Cursor* cursor);
+void table_find(Table* table, uint32_t key, Cursor* cursor);
+bool btree_find_exact(Table* table, uint32_t key, Cursor* cursor); // False if the tree has no row `key`
+void table_seek(Table* table, uint32_t start_key, uint32_t end_key, Cursor* cursor);
+void table_start(Table* table, Cursor* cursor);
+void cursor_value(Cursor* cursor, Row* row);
+void cursor_advance(Cursor* cursor);
+
+/** @brief Copy the row under the cursor into `row` if it passes the filter's column tests. */
+bool cursor_filter(Cursor* cursor, const Filter* filter, Row* row);
+
+/**
+ * @brief Ids of the rows a filter's username or email test selects, in ascending order.
+ * Read as of the snapshot of `cursor`, open on the table, which is left where it was.
+ * `ids` holds INDEX_MAX_IDS entries. False when no index applies or the value is too
+ * common to be listed in one; the caller then scans.
+ */
+bool table_index_lookup(Cursor* cursor, const Filter* filter, uint32_t* ids, uint32_t* num_ids);
+
+/**
+ * Writes
+ * Each runs in a commit of its own, or joins the transaction table_begin() opened. One
+ * that fails writes nothing; when the transaction it joined holds half the buffer pool in
+ * dirty pages, that whole transaction is rolled back as well.
+ */
+typedef enum {
+        WRITE_OK,
+        WRITE_FAILED,          // A key was taken or missing
+        WRITE_TXN_ROLLED_BACK, // The transaction outgrew the buffer pool and was rolled back
+} WriteResult;
+
+WriteResult table_insert_rows(Table* table, Row* rows, uint32_t num_rows); // All rows or none, `rows` gets sorted by id
+WriteResult table_update_row(Table* table, Row* row);
+WriteResult table_delete_row(Table* table, uint32_t id);
+
+/**
+ * @brief Explicit transactions.
+ * Writes between table_begin() and table_commit() reach the WAL as a single commit;
+ * table_rollback(), or closing the table, discards them. A transaction belongs to the thread
+ * that began it: table_begin() waits while another thread has one open, and the commit and
+ * rollback of a thread without one fail.
+ */
+bool table_begin(Table* table);
+bool table_commit(Table* table);
+bool table_rollback(Table* table);
+
+/**
+ * @brief Build the tree of an empty table bottom-up from rows sorted by id.
+ * Leaves are packed to `fill_percent` and linked as they are written, internal levels
+ * are appended to along the right edge, and the root is installed by table_bulk_finish()
+ * in the final commit, so an abandoned load leaves the table empty. table_bulk_abort()
+ * rolls back a load that committed nothing yet and otherwise frees the pages it wrote.
+ * Returns NULL if the table already holds rows.
+ */
+BulkLoad* table_bulk_begin(Table* table, uint32_t fill_percent);
+bool table_bulk_add(BulkLoad* load, Row* row); // False unless the id is above the previous one
+uint64_t table_bulk_finish(BulkLoad* load);
+void table_bulk_abort(BulkLoad* load);
 #endif // DB_H
\ No newline at end of file
@@ -0,0 +1,75 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "db.h"
+#include "vm.h"
+
+/** Prepared statements a database keeps for statements that are run again */
+#define DB_STMT_CACHE 16
+
+typedef struct {
+        uint64_t hash; // Of the statement text
+        Statement* stmt;
+} CachedStatement;
+
+typedef struct {
+        CachedStatement entries[DB_STMT_CACHE];
+        uint32_t next; // Entry the next new statement replaces
+} StatementCache;
+
+/**
+ * @brief An open database file, the entry point for programs linking libsqlite-engine.
+ * Statements run in-process: rows reach the caller as Row structs, never as text.
+ * Any number of threads may read while one writes; each prepares and runs its own
+ * statements, the cache behind db_statement() and db_exec() is not shared between threads.
+ */
+typedef struct {
+        Table* table;
+        StatementCache cache;
+} Database;
+
+typedef enum {
+        DB_OK,              // The statement ran to completion
+        DB_ABORTED,         // The row callback stopped the statement early
+        DB_PREPARE_ERROR,   // The statement did not compile, nothing ran
+        DB_STEP_ERROR,      // The statement stopped, having written nothing
+        DB_TXN_ROLLED_BACK, // A write outgrew the buffer pool, its whole transaction was rolled back
+} DbResult;
+
+/** @brief Called with each row a statement returns; returning false stops the statement. */
+typedef bool (*RowCallback)(const Row* row, void* arg);
+
+/**
+ * Functions
+ */
+
+/** @brief Open or create the database in `filename`, NULL `config` for the defaults. */
+Database* db_open(const char* filename, const PagerConfig* config);
+
+/** @brief Roll back an open transaction, finalize cached statements and close the file. */
+void db_close(Database* db);
+
+/**
+ * @brief Compile `sql` into a statement the caller binds, steps and finalizes with
+ * the functions of vm.h.
+ */
+PrepareResult db_prepare(Database* db, const char* sql, Statement** stmt);
+
+/**
+ * @brief Prepared statement for `sql` from the database's cache, compiled on first use.
+ * The statement stays owned by the database and is only valid until the next call.
+ */
+Statement* db_statement(Database* db, const char* sql, PrepareResult* result);
+
+/**
+ * @brief Step `stmt` to the end, handing each row to `callback` (which may be NULL).
+ * A callback that stops early resets the statement, releasing its snapshot.
+ */
+DbResult db_run(Statement* stmt, RowCallback callback, void* arg);
+
+/** @brief Run one statement through the cache, see db_statement() and db_run(). */
+DbResult db_exec(Database* db, const char* sql, RowCallback callback, void* arg);
+#endif // ENGINE_H
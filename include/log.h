@@ -71,23 +71,85 @@
  * void error(const char* format, ...);
  */
 
-#define info(fmt, ...)    log_wrap(LogLevel_INFO, __FILE__, __LINE__, fmt, ##__VA_ARGS__)
-#define debug(fmt, ...)   log_wrap(LogLevel_DEBUG, __FILE__, __LINE__, fmt, ##__VA_ARGS__)
-#define warning(fmt, ...) log_wrap(LogLevel_WARN, __FILE__, __LINE__, fmt, ##__VA_ARGS__)
-#define error(fmt, ...)   log_wrap(LogLevel_ERROR, __FILE__, __LINE__, fmt, ##__VA_ARGS__)
-#define fatal(fmt, ...)   log_wrap(LogLevel_FATAL, __FILE__, __LINE__, fmt, ##__VA_ARGS__)
-#define dblog(fmt, ...)   logdb(LogLevel_DEBUG, __FILE__, __LINE__, fmt, ##__VA_ARGS__)
-#define replog(fmt, ...)  logrepl(LogLevel_DEBUG, __FILE__, __LINE__, fmt, ##__VA_ARGS__)
+#include <stdbool.h>
+
+/** Levels as plain numbers, so LOG_MIN_LEVEL can be compared by the preprocessor */
+#define LOG_LEVEL_DEV   0
+#define LOG_LEVEL_DEBUG 1
+#define LOG_LEVEL_INFO  2
+#define LOG_LEVEL_WARN  3
+#define LOG_LEVEL_ERROR 4
+#define LOG_LEVEL_FATAL 5
+#define LOG_LEVEL_OFF   6
+
+/**
+ * Messages below LOG_MIN_LEVEL are not compiled in: the macro expands to nothing and its
+ * arguments are never evaluated. Messages at or above it are still checked against the
+ * runtime level, see log_set_level(). ex. make EXTRA_C_DEFINES=-DLOG_MIN_LEVEL=LOG_LEVEL_WARN
+ */
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_LEVEL_DEV
+#endif
 
 typedef enum {
-        LogLevel_INFO,
-        LogLevel_DEBUG,
-        LogLevel_DEV,
-        LogLevel_WARN,
-        LogLevel_ERROR,
-        LogLevel_FATAL,
+        LogLevel_DEV = LOG_LEVEL_DEV,
+        LogLevel_DEBUG = LOG_LEVEL_DEBUG,
+        LogLevel_INFO = LOG_LEVEL_INFO,
+        LogLevel_WARN = LOG_LEVEL_WARN,
+        LogLevel_ERROR = LOG_LEVEL_ERROR,
+        LogLevel_FATAL = LOG_LEVEL_FATAL,
+        LogLevel_OFF = LOG_LEVEL_OFF,
 } LogLevel;
 
+/** Messages below this level are dropped at runtime, everything is logged by default */
+extern LogLevel log_level;
+
+/** @brief Call `fn` if `level` passes the runtime level; an expression, like the call it guards. */
+#define LOG_IF(level, fn, fmt, ...) ((level) >= log_level ? fn(level, __FILE__, __LINE__, fmt, ##__VA_ARGS__) : (void)0)
+
+#if LOG_MIN_LEVEL <= LOG_LEVEL_INFO
+#define info(fmt, ...) LOG_IF(LogLevel_INFO, log_wrap, fmt, ##__VA_ARGS__)
+#else
+#define info(fmt, ...) ((void)0)
+#endif
+
+#if LOG_MIN_LEVEL <= LOG_LEVEL_DEBUG
+#define debug(fmt, ...)  LOG_IF(LogLevel_DEBUG, log_wrap, fmt, ##__VA_ARGS__)
+#define dblog(fmt, ...)  LOG_IF(LogLevel_DEBUG, logdb, fmt, ##__VA_ARGS__)
+#define replog(fmt, ...) LOG_IF(LogLevel_DEBUG, logrepl, fmt, ##__VA_ARGS__)
+#else
+#define debug(fmt, ...)  ((void)0)
+#define dblog(fmt, ...)  ((void)0)
+#define replog(fmt, ...) ((void)0)
+#endif
+
+#if LOG_MIN_LEVEL <= LOG_LEVEL_WARN
+#define warning(fmt, ...) LOG_IF(LogLevel_WARN, log_wrap, fmt, ##__VA_ARGS__)
+#else
+#define warning(fmt, ...) ((void)0)
+#endif
+
+#if LOG_MIN_LEVEL <= LOG_LEVEL_ERROR
+#define error(fmt, ...) LOG_IF(LogLevel_ERROR, log_wrap, fmt, ##__VA_ARGS__)
+#else
+#define error(fmt, ...) ((void)0)
+#endif
+
+#if LOG_MIN_LEVEL <= LOG_LEVEL_FATAL
+#define fatal(fmt, ...) LOG_IF(LogLevel_FATAL, log_wrap, fmt, ##__VA_ARGS__)
+#else
+#define fatal(fmt, ...) ((void)0)
+#endif
+
+/** Bytes of log lines the asynchronous mode holds while the writer catches up */
+#define LOG_RING_SIZE (1 << 20)
+
+/** Milliseconds the asynchronous writer lets lines gather before writing them out */
+#define LOG_FLUSH_INTERVAL_MS 10
+
+/** Longest line a message is formatted into, longer ones are cut */
+#define LOG_LINE_MAX 2048
+
 /*
 * Var. log wrapper to accept/reject log requests given the global log level
 * called by the macros defined above. DO NOT CALL THIS DIRECTLY
@@ -95,4 +157,20 @@ typedef enum {
 void log_wrap(LogLevel level, const char* file, int line, const char* message, ...);
 void logdb(LogLevel level, const char* file, int line, const char* message, ...);
 void logrepl(LogLevel level, const char* file, int line, const char* message, ...);
+
+void log_set_level(LogLevel level);
+
+/** @brief Level named `name` ("dev", "debug", "info", "warn", "error" or "off"); false if there is none. */
+bool log_level_parse(const char* name, LogLevel* level);
+
+/**
+ * @brief Hand formatted lines to a background thread instead of writing them in place.
+ * Lines are copied into a ring of LOG_RING_SIZE bytes, a caller only waits when it is
+ * full, and the thread writes out all that has queued up at once. Lines still queued
+ * are written at exit, but may land after output the program printed itself.
+ */
+void log_async_start(void);
+
+/** @brief Write out the queued lines and go back to writing in place. */
+void log_async_stop(void);
 #endif // LOG_H
@@ -0,0 +1,71 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "db.h"
+
+/** Latency histogram buckets, bucket i counts statements that took [2^i, 2^(i+1)) ns */
+#define METRICS_LATENCY_BUCKETS 40
+
+/** Seconds between JSON dumps unless --stats-interval says otherwise */
+#define METRICS_DEFAULT_INTERVAL 10
+
+typedef struct {
+        uint64_t count;
+        uint64_t total_ns;
+        uint64_t max_ns;
+        uint64_t buckets[METRICS_LATENCY_BUCKETS];
+} LatencyHistogram;
+
+/**
+ * @brief Counters the engine keeps about itself, one registry per process.
+ * Counting is a relaxed atomic increment on paths that already touch pages, so it is
+ * always on and readers in several threads can count at once.
+ * Page reads, writes, hits and misses are the pager's and the log's own counters and
+ * are read from them when the metrics are reported.
+ */
+typedef struct {
+        uint64_t leaf_splits;
+        uint64_t internal_splits;
+        uint64_t rows_scanned;  // Rows a select read and checked against its filter
+        uint64_t rows_returned; // Rows a select handed out
+        LatencyHistogram latency[COMMAND_SIZING_ERR + 1]; // By CommandType
+
+        /** Periodic dump, see metrics_dump_start() */
+        char* dump_path;
+        uint32_t dump_interval;
+        uint64_t next_dump_ns;
+} Metrics;
+
+extern Metrics metrics;
+
+#define METRIC_INC(name)     __atomic_fetch_add(&metrics.name, 1, __ATOMIC_RELAXED)
+#define METRIC_ADD(name, n)  __atomic_fetch_add(&metrics.name, (n), __ATOMIC_RELAXED)
+
+/**
+ * Functions
+ */
+uint64_t metrics_now(void);
+
+/** @brief Count a statement of `type` that ran for `ns` nanoseconds. */
+void metrics_record_latency(CommandType type, uint64_t ns);
+
+/** @brief Print every metric, walking the tree for its shape. */
+void metrics_print(Table* table);
+
+/** @brief Write the metrics to `out` as a single JSON object. */
+void metrics_write_json(Table* table, FILE* out);
+
+/**
+ * @brief Rewrite `path` with the metrics as JSON every `interval` seconds.
+ * The dump happens after a statement once the interval has passed, so an idle engine
+ * does not write. The file is replaced whole, readers never see half a dump.
+ */
+void metrics_dump_start(const char* path, uint32_t interval);
+
+/** @brief Dump the metrics if one is due; called after each statement. */
+void metrics_tick(Table* table);
+#endif // METRICS_H
@@ -0,0 +1,250 @@
+#ifndef PAGER_H
+#define PAGER_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "aio.h"
+#include "wal.h"
+
+/** Page attributes */
+#define PAGE_SIZE        4096
+#define INVALID_PAGE_NUM UINT32_MAX
+
+/** Buffer pool attributes */
+#define PAGER_DEFAULT_FRAMES 1024
+#define PAGER_MIN_FRAMES     16
+#define PAGER_READ_RUN       32 // Most adjacent pages read ahead with one preadv()
+#define PAGER_SHARDS         64 // Locks over the hash buckets, bucket b is guarded by b % PAGER_SHARDS
+
+/** Smallest mapping created in PAGER_MODE_MMAP, the file may grow into it without a remap */
+#define PAGER_MMAP_MIN_LEN (64 * 1024 * 1024)
+#define PAGER_MAX_MAPS     32 // Mappings a pager may outgrow, each twice the size of the last
+
+/**
+ * @brief How pages are brought into the buffer pool.
+ * READ copies every page into a pool frame with read(). MMAP maps the database file and
+ * points frames straight into the mapping when the file holds the newest image of the
+ * page, leaving the kernel to fault it in. The mapping is private: a page the writer
+ * dirties gets its own copy there first, so older snapshots keep reading the image in
+ * place while the checkpointer rewrites the page in the file.
+ */
+typedef enum {
+        PAGER_MODE_READ,
+        PAGER_MODE_MMAP,
+} PagerMode;
+
+/**
+ * @brief A single buffer pool slot holding one cached page.
+ * Frames are chained into hash buckets through `next` so a page lookup never
+ * scans the whole pool. `data` is the newest committed image of the page and is never
+ * written in place; the write transaction changes `shadow`, its own copy made when it
+ * marks the page dirty, which replaces `data` when it commits. The fields change under
+ * the lock of the frame's shard.
+ */
+typedef struct {
+        uint32_t page_num;  // Page held by this frame, INVALID_PAGE_NUM when free
+        uint32_t pin_count; // Number of outstanding get_page() references
+        uint32_t next;      // Next frame index in the same hash bucket
+        bool referenced;    // CLOCK reference bit, set on every access
+        bool dirty;         // Modified by the open write transaction, not evictable until commit
+        bool loading;       // Page still being read in, pinned until it is
+        void* data;   // The frame's buffer, or its page of the mapping
+        void* buffer; // Owned by the frame, `data` unless the page is served from the mapping
+        void* shadow; // The write transaction's copy, NULL unless the frame is dirty
+} Frame;
+
+/**
+ * @brief An image a commit replaced, kept for the snapshots taken before it.
+ * A snapshot `s` reads the version of the page with the smallest `end` above `s`, or the
+ * frame if there is none. The image was committed at `start`, 0 when that is not known.
+ */
+typedef struct PageVersion {
+        uint32_t page_num;
+        uint64_t start;
+        uint64_t end; // Commit that replaced the image
+        void* data;
+        bool mapped; // `data` is the page's private copy in the mapping, not a buffer
+        struct PageVersion* next;      // Next version in the same hash bucket, newer ones first
+        struct PageVersion* next_kept; // Next version waiting to be reclaimed
+} PageVersion;
+
+/** @brief Counters used to size the buffer pool. */
+typedef struct {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+        uint64_t pages_dirtied;
+        uint64_t mapped;
+        uint64_t remaps;
+        uint64_t reads;      // Synchronous preadv() calls against the database file
+        uint64_t prefetched; // Pages loaded by pager_read_ahead()
+        uint64_t async_reads;
+        uint64_t waits; // get_page() calls that blocked on a read ahead
+        uint64_t rollbacks;
+        uint64_t versions;  // Page images a commit replaced and kept for older snapshots
+        uint64_t reclaimed; // Versions freed once no snapshot could read them
+} PagerStats;
+
+/**
+ * @brief Options used when opening a pager.
+ * Zeroed fields select the defaults.
+ */
+typedef struct {
+        uint32_t pool_frames;
+        WalSyncMode wal_sync;
+        PagerMode mode;
+        AioBackend aio;
+} PagerConfig;
+
+/** @brief One read ahead in flight, covering adjacent pages in their own frames. */
+typedef struct {
+        bool busy;
+        uint32_t len;
+        off_t offset;
+        uint32_t frame_idxs[PAGER_READ_RUN];
+        struct iovec iov[PAGER_READ_RUN];
+} PagerRead;
+
+/**
+ * @brief The buffer pool and write transaction of one database file.
+ * Any number of threads may read through one pager while a single thread writes. A
+ * cache hit locks only the shard of the page's bucket; anything that moves frames between
+ * pages also holds `pool_lock`, taken first. Pages are read in with neither held.
+ * Readers see the tree as of a snapshot and the writer works on copies of the pages, so
+ * neither ever waits for the other.
+ */
+typedef struct {
+        int fd;
+        off_t file_len;
+        uint32_t num_pages;
+
+        /** Locking, see above */
+        pthread_mutex_t pool_lock;
+        pthread_mutex_t shards[PAGER_SHARDS];
+        pthread_cond_t loaded; // Broadcast under `pool_lock` as a miss finishes reading its page
+
+        /** Buffer pool */
+        Frame* frames;
+        uint32_t num_frames;
+        uint32_t used_frames;
+        uint32_t clock_hand;
+        uint32_t* buckets;
+        uint32_t bucket_mask;
+
+        /** Snapshots, see pager_snapshot() */
+        pthread_mutex_t snapshot_lock;
+        uint64_t commit_seq;  // Transactions committed, a snapshot is the count when it was taken
+        uint64_t* snapshots;  // Held snapshots in ascending order, one entry per holder
+        uint32_t num_snapshots;
+        uint32_t snapshots_cap;
+        PageVersion** versions; // Bucket -> versions of its pages, under the bucket's shard lock
+        PageVersion* kept;      // Every version, checked by each commit
+
+        /** Memory mapped file, PAGER_MODE_MMAP only */
+        PagerMode mode;
+        char* map;
+        size_t map_len;
+        struct {
+                char* addr;
+                size_t len;
+        } old_maps[PAGER_MAX_MAPS]; // Outgrown mappings, a load may still be copying from one
+        uint32_t num_old_maps;
+
+        /** Read ahead, PAGER_MODE_READ only */
+        Aio* aio;
+        PagerRead reads[AIO_DEPTH];
+        uint32_t reading; // Frames pinned by reads in flight
+
+        /** Write transaction, its dirty pages are committed to the WAL as one group of frames */
+        Wal* wal;
+        pthread_mutex_t writer; // Held for the whole write transaction
+        void* writer_thread;    // Token of the thread in the write transaction, NULL outside one
+        uint32_t txn_depth;     // pager_begin() calls not yet matched by pager_commit()
+        uint32_t txn_num_pages; // Pages in the database when the transaction began
+        uint32_t num_dirty;
+        uint32_t* dirty_frames;
+        uint32_t* txn_page_nums;
+        void** txn_pages;
+        void* spare_pages;           // Buffers for shadows, chained through their first bytes
+        PageVersion* spare_versions; // Versions to reuse, chained through `next`
+
+        PagerStats stats;
+} Pager;
+
+/**
+ * Functions
+ */
+Pager* new_pager(const char* filename, const PagerConfig* config);
+void free_pager(Pager* pager);
+
+/**
+ * @brief Fetch a page through the buffer pool and pin it.
+ * Every call must be matched by a pager_unpin() once the caller no longer
+ * dereferences the returned pointer; pinned frames are never evicted. This is the newest
+ * committed image, or for the thread in the write transaction its own copy of a page it
+ * marked dirty.
+ */
+void* get_page(Pager* pager, uint32_t page_num);
+void pager_unpin(Pager* pager, uint32_t page_num);
+
+/**
+ * @brief Pin the newest commit as a snapshot, returning it.
+ * Pages read at the snapshot stay as they were at that commit however many commits
+ * follow; the images they replace are kept until every snapshot that could read them is
+ * released, and freed by the next commit after that.
+ */
+uint64_t pager_snapshot(Pager* pager);
+void pager_snapshot_release(Pager* pager, uint64_t snapshot);
+
+/**
+ * @brief Fetch a page as of `snapshot` and pin it, released with pager_unpin().
+ * Never waits for the writer. The thread in the write transaction reads its own copies,
+ * as get_page() returns them.
+ */
+void* pager_read(Pager* pager, uint32_t page_num, uint64_t snapshot);
+
+/**
+ * @brief Start reading pages the caller expects to fetch soon, without waiting.
+ * Pages that are cached, newer in the WAL or not in the file yet are skipped and runs
+ * of adjacent pages share one vectored read. Each page is published in the pool at
+ * once; get_page() on it waits for its read instead of issuing another.
+ */
+void pager_read_ahead(Pager* pager, const uint32_t* page_nums, uint32_t count);
+
+/**
+ * @brief Bracket a mutation of the tree.
+ * Pages marked dirty between pager_begin() and pager_commit() stay resident and are
+ * appended to the WAL as one atomic commit. Pages that were only read are never written.
+ * Transactions nest: only the outermost pager_commit() writes, so statements run inside
+ * an explicit transaction join it. One thread writes at a time, pager_begin() waits for
+ * the transaction of another to end.
+ */
+void pager_begin(Pager* pager);
+
+/**
+ * @brief Whether the calling thread has the write transaction open.
+ * Another thread's transaction does not count: pager_begin() would wait for it.
+ */
+bool pager_writing(Pager* pager);
+
+/**
+ * @brief Mark a page the writer has pinned as changed, returning the copy to change.
+ * The first call in a transaction copies the committed image; a pointer to the page taken
+ * before it still shows that image and must not be written through.
+ */
+void* pager_mark_dirty(Pager* pager, uint32_t page_num);
+void pager_commit(Pager* pager);
+
+/**
+ * @brief Abandon the calling thread's transaction at every level, restoring the pages it
+ * dirtied. Does nothing if the thread has none open.
+ */
+void pager_rollback(Pager* pager);
+void pager_print_stats(Pager* pager);
+#endif // PAGER_H
@@ -1,6 +1,7 @@
 #ifndef REPL_H
 #define REPL_H
 
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,8 +9,10 @@
 
 #include "buf.h"
 #include "db.h"
+#include "engine.h"
 #include "log.h"
-#include "repl.h"
+#include "metrics.h"
+#include "sink.h"
 
 typedef enum {
         METACMD_OK,
@@ -17,14 +20,6 @@ typedef enum {
         METACMD_ERR
 } MetaCmdResult;
 
-typedef enum {
-        PREPARE_SUCCESS,
-        PREPARE_SYNTAX_ERROR,
-        PREPARE_UNRECOGNIZED_STATEMENT,
-        PREPARE_NEGATIVE_ID,
-        PREPARE_STRING_TOO_LONG
-} PrepareResult;
-
 void repl_prompt();
 void repl_loop();
 
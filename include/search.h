@@ -0,0 +1,19 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <stdint.h>
+
+/** Keys left to a vector scan once a binary search has narrowed the range down */
+#define SEARCH_SCAN_KEYS 32
+
+/**
+ * @brief Index of the first of `num_keys` sorted keys that is at least `key`.
+ * A binary search narrows the range to SEARCH_SCAN_KEYS keys, which are then compared
+ * at once with AVX2 or SSE2 as the CPU allows, a cache line of keys per step. Build with
+ * -DNO_SIMD for the plain scalar search.
+ */
+uint32_t keys_lower_bound(const uint32_t* keys, uint32_t num_keys, uint32_t key);
+
+/** @brief Instruction set keys_lower_bound() runs with: "avx2", "sse2" or "scalar". */
+const char* keys_search_isa(void);
+#endif // SEARCH_H
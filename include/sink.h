@@ -0,0 +1,56 @@
+#ifndef SINK_H
+#define SINK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "db.h"
+
+/** Bytes of formatted rows held before they are written out in one call */
+#define SINK_BUFFER_SIZE (256 * 1024)
+
+/** Longest row any mode formats: a quoted CSV row whose every character is a doubled quote */
+#define SINK_ROW_MAX (16 + 2 * (COL_SIZE_USERNAME + COL_SIZE_EMAIL) + 8)
+
+typedef enum {
+        SINK_TEXT,   // (1, foo, foo@x)
+        SINK_CSV,    // 1,foo,foo@x with RFC 4180 quoting
+        SINK_BINARY, // Length-prefixed rows, see sink_row()
+} SinkMode;
+
+/**
+ * @brief Destination of the rows a statement returns.
+ * Rows are formatted by hand into one large buffer, which reaches the stream only when
+ * it fills or on sink_flush(), so a large result costs a write per buffer rather than a
+ * printf per row.
+ */
+typedef struct {
+        FILE* out;
+        SinkMode mode;
+        uint32_t len;
+        uint64_t rows; // Rows written since sink_init()
+        char buf[SINK_BUFFER_SIZE];
+} ResultSink;
+
+/**
+ * Functions
+ */
+void sink_init(ResultSink* sink, FILE* out, SinkMode mode);
+
+/**
+ * @brief Append a row in the sink's mode.
+ * A binary row is a native-endian uint32_t byte count of what follows, the uint32_t id,
+ * then the username and the email, each as one length byte and that many bytes.
+ */
+void sink_row(ResultSink* sink, const Row* row);
+
+/** @brief Write out the buffered rows. */
+void sink_flush(ResultSink* sink);
+
+/** @brief RowCallback (engine.h) writing to the sink passed as `arg`. */
+bool sink_callback(const Row* row, void* arg);
+
+/** @brief Mode named `name` ("text", "csv" or "binary"); false if there is none. */
+bool sink_mode_parse(const char* name, SinkMode* mode);
+#endif // SINK_H
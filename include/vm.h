@@ -0,0 +1,154 @@
+#ifndef VM_H
+#define VM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "arena.h"
+#include "db.h"
+
+/** Bytes in each chunk of a statement's arena, enough for the program of a short statement */
+#define STMT_ARENA_CHUNK 4096
+
+typedef enum {
+        PREPARE_SUCCESS,
+        PREPARE_SYNTAX_ERROR,
+        PREPARE_UNRECOGNIZED_STATEMENT,
+        PREPARE_NEGATIVE_ID,
+        PREPARE_STRING_TOO_LONG,
+        PREPARE_MISSING_ARGUMENTS,
+} PrepareResult;
+
+typedef enum {
+        STEP_ROW,             // A result row is ready, see stmt_row()
+        STEP_DONE,            // The statement ran to completion
+        STEP_ERROR,           // The statement stopped, having written nothing
+        STEP_TXN_ROLLED_BACK, // A write outgrew the buffer pool, its whole transaction was rolled back
+} StepResult;
+
+/**
+ * @brief Instructions of a compiled statement.
+ * Registers hold the literals and bound parameters a statement was written with; the
+ * remaining instructions drive the table's cursors and writes directly. Jumps go to p2.
+ */
+typedef enum {
+        OP_INTEGER,     // r[p1] = p3
+        OP_STRING,      // r[p1] = p4
+        OP_VARIABLE,    // r[p1] = parameter p3
+        OP_MAKE_ROW,    // rows[p3] = (r[p1], r[p1 + 1], r[p1 + 2])
+        OP_INSERT,      // Insert rows[0..p3), all or none
+        OP_UPDATE,      // Replace rows[0]
+        OP_DELETE,      // Delete the row with id r[p1]
+        OP_TRANSACTION, // Begin, commit or roll back, p3 is the CommandType
+        OP_FILTER_ID,   // Narrow the id range with `id <p3> r[p1]`, see FilterOp
+        OP_FILTER_TEXT, // Require column p3 to equal r[p1]
+        OP_LIMIT,       // Stop after r[p1] rows
+        OP_INDEX_SEEK,  // List the ids the filter selects through an index, jump if none applies
+        OP_INDEX_NEXT,  // Cursor on the next listed row in the id range, jump when the list is done
+        OP_SEEK,        // Cursor on the first row of the id range, jump if there is none
+        OP_CHECK,       // Copy the row under the cursor out, jump if the filter rejects it
+        OP_RESULT,      // Yield the row copied out, jump instead once the limit is reached
+        OP_NEXT,        // Advance the cursor, jump back while rows remain
+        OP_GOTO,
+        OP_HALT,
+} OpCode;
+
+/** @brief Comparisons OP_FILTER_ID applies, `between` compiles to a pair of them. */
+typedef enum {
+        FILTER_EQ,
+        FILTER_GE,
+        FILTER_GT,
+        FILTER_LE,
+        FILTER_LT,
+} FilterOp;
+
+typedef struct {
+        OpCode code;
+        uint32_t p1;
+        uint32_t p2;
+        uint32_t p3;
+        const char* p4;
+} Op;
+
+/** @brief Contents of a register. */
+typedef struct {
+        bool is_text;
+        uint32_t integer;
+        const char* text;
+} Value;
+
+/** @brief A bound parameter; text is copied in so the statement keeps no pointer to the caller's. */
+typedef struct {
+        bool bound;
+        Value value;
+        char text[COL_SIZE_EMAIL + 1];
+} Param;
+
+/**
+ * @brief A statement compiled once and run any number of times.
+ * The program, its constants and registers live in the statement's arena, so stepping
+ * and rebinding allocate nothing; the arena is released by stmt_finalize(), or reset and
+ * kept by stmt_reprepare().
+ */
+typedef struct {
+        Table* table;
+        CommandType type;
+        const char* sql;
+        Arena arena;
+
+        Op* ops;
+        uint32_t num_ops;
+        Value* regs;
+        uint32_t num_regs;
+        Param* params;
+        uint32_t num_params;
+        Row* rows;
+        uint32_t num_rows;
+
+        /** Execution state, rewound by stmt_reset() */
+        uint32_t pc;
+        Filter filter;
+        Cursor cursor;
+        bool reading; // The cursor holds a snapshot until the statement halts
+        uint32_t ids[INDEX_MAX_IDS];
+        uint32_t num_ids;
+        uint32_t next_id;
+        uint32_t count; // Rows returned so far
+        Row row;        // Row returned by the last STEP_ROW
+} Statement;
+
+/**
+ * Functions
+ */
+
+/**
+ * @brief Compile `sql` into a statement on `table`.
+ * Any value may be written as `?` and bound before the first step; parameters are
+ * numbered from 1 in the order they appear. On failure `*stmt` is NULL.
+ */
+PrepareResult stmt_prepare(Table* table, const char* sql, Statement** stmt);
+
+/**
+ * @brief Compile `sql` into a statement that is no longer needed, in place of a new one.
+ * On failure `stmt` runs nothing and matches no text, it may be prepared again or finalized.
+ */
+PrepareResult stmt_reprepare(Statement* stmt, Table* table, const char* sql);
+
+/** @brief Parse a non-negative id, false if `token` is missing or not a number below 2^32. */
+bool parse_id(const char* token, uint32_t* id);
+
+/** @brief Bind parameter `index`; false if there is no such parameter or the value cannot be stored. */
+bool stmt_bind_int(Statement* stmt, uint32_t index, int64_t value);
+bool stmt_bind_text(Statement* stmt, uint32_t index, const char* text);
+
+/** @brief Run the statement until it yields a row or ends. */
+StepResult stmt_step(Statement* stmt);
+const Row* stmt_row(Statement* stmt);
+
+/** @brief Rewind the statement to run again, keeping its bindings. */
+void stmt_reset(Statement* stmt);
+void stmt_finalize(Statement* stmt);
+
+/** @brief Print the program, one instruction per line. */
+void stmt_explain(Statement* stmt);
+#endif // VM_H
@@ -0,0 +1,93 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/** WAL file attributes */
+#define WAL_SUFFIX       "-wal"
+#define WAL_MAGIC        0x57414c31 // "WAL1"
+#define WAL_VERSION      1
+#define WAL_HEADER_SIZE  32
+#define WAL_FRAME_HEADER 24
+
+/** Checkpointer attributes */
+#define WAL_CHECKPOINT_FRAMES   1000 // Checkpoint once this many frames are waiting
+#define WAL_CHECKPOINT_INTERVAL 100  // Milliseconds between checkpointer wake ups
+#define WAL_CHECKPOINT_BATCH    64   // Frames per read and pages per pwritev() while checkpointing
+
+/**
+ * @brief When a commit is considered durable.
+ * FULL waits for the fdatasync covering the commit; concurrent committers share it.
+ * NORMAL returns once the frames are written and lets the checkpointer thread sync
+ * them in the background, so back-to-back commits share one fdatasync.
+ */
+typedef enum {
+        WAL_SYNC_FULL,
+        WAL_SYNC_NORMAL,
+} WalSyncMode;
+
+typedef struct {
+        uint64_t commits;
+        uint64_t frames;
+        uint64_t syncs;
+        uint64_t checkpoints;
+        uint64_t frames_checkpointed;
+        uint64_t pages_checkpointed;
+        uint64_t checkpoint_writes;
+} WalStats;
+
+/**
+ * @brief Append-only log of page images stored next to the database file.
+ * A commit appends one frame per changed page, the last frame carrying the database
+ * size in pages. Readers consult `index` for the newest committed image of a page
+ * before falling back to the database file. The checkpointer copies synced frames
+ * into the database file; once everything is copied the next commit restarts the log.
+ */
+typedef struct {
+        int fd;
+        int db_fd;
+        char* path;
+        WalSyncMode sync_mode;
+
+        uint32_t salt[2];
+        uint32_t checksum; // Running checksum of the last frame written
+
+        /** Page number -> offset of its newest frame, 0 when the page is not in the log */
+        off_t* index;
+        uint32_t index_len;
+
+        /** Commit scratch, sized for the largest commit so far and reused under `lock` */
+        struct WalFrameHeader* headers;
+        struct iovec* iov;
+        uint32_t scratch_len;
+
+        off_t written;      // End of the last committed frame
+        off_t synced;       // End of the last frame covered by fdatasync
+        off_t checkpointed; // End of the last frame copied into the database file
+
+        bool syncing;
+        bool checkpointing;
+        bool stop;
+
+        pthread_mutex_t lock;
+        pthread_cond_t synced_cond;
+        pthread_cond_t wake_cond;
+        pthread_t checkpointer;
+
+        WalStats stats;
+} Wal;
+
+/**
+ * Functions
+ */
+Wal* wal_open(const char* db_filename, int db_fd, WalSyncMode sync_mode);
+void wal_close(Wal* wal);
+void wal_commit(Wal* wal, uint32_t num_frames, const uint32_t* page_nums, void* const* pages, uint32_t db_size);
+bool wal_has_page(Wal* wal, uint32_t page_num);
+bool wal_read_page(Wal* wal, uint32_t page_num, void* buffer);
+void wal_checkpoint(Wal* wal);
+void wal_print_stats(Wal* wal);
+#endif // WAL_H
@@ -1,3 +1,5 @@
+require 'tmpdir'
+
 def print_result(result, label: nil)
   puts "\n--- #{label} ---" if label
   puts "#{result}"
@@ -12,9 +14,12 @@ def print_result(result, label: nil)
   end
 end
 
-def run_script(commands)
+def run_script(commands, flags: nil)
   raw_output = nil
-  IO.popen("make run", "r+") do |pipe|
+  cmd = flags ? "make run DB_FLAGS='#{flags}'" : "make run"
+  IO.popen(cmd, "r+") do |pipe|
+    # Drain the output while writing, a long script would otherwise fill both pipes
+    reader = Thread.new { pipe.read }
     commands.each do |command|
       pipe.puts command
     end
@@ -22,12 +27,18 @@ def run_script(commands)
     pipe.close_write
 
     # Read entire output
-    raw_output = pipe.gets(nil)
+    raw_output = reader.value
   end
   raw_output.split("\n")
 end
 
 
+# Username and email padded to their column widths: every record takes 297 bytes with
+# its slot, so 13 rows fill a leaf.
+def wide_insert(i)
+  "insert #{i} #{"user#{i}".ljust(32, "_")} #{"person#{i}@example.com".ljust(255, "_")}"
+end
+
 def contains(result, text)
   match = result.any? { |line| line.include?(text) }
   expect(match).to be true
@@ -69,11 +80,23 @@ describe 'Simple sanity tests' do
     contains(result, "COMMAND_SYNTAX_ERR")
   end
 
+  it 'rejects ids that are not whole numbers' do
+    result = run_script(["insert 0 zero zero@x", "insert 12x foo bar", "delete abc", "select", ".exit"])
+    expect(result.count { |line| line.include?("COMMAND_SYNTAX_ERR") }).to eq(2)
+    contains(result, "(0, zero, zero@x)")
+    expect(result.any? { |line| line.include?("(12, foo") }).to be false
+  end
+
   it 'prints command unknown error for invalid command' do
     result = run_script(["unknown 1", ".exit"])
     contains(result, "COMMAND_UNKNOWN")
   end
 
+  it 'rejects a keyword run into the next word' do
+    result = run_script(["insertx 1 a b", "selectfoo", "select", ".exit"])
+    expect(result.count { |line| line.include?("COMMAND_UNKNOWN") }).to eq 2
+  end
+
   it 'prints ok for select' do
     result = run_script(["select", ".exit"])
     contains(result, "handling command")
@@ -85,12 +108,12 @@ describe 'Simple sanity tests' do
   end
 
   it 'prints ok for update' do
-    result = run_script(["update", ".exit"])
+    result = run_script(["update 1 foo bar", ".exit"])
     contains(result, "handling command")
   end
 
   it 'prints ok for delete' do
-    result = run_script(["delete", ".exit"])
+    result = run_script(["delete 1", ".exit"])
     contains(result, "handling command")
   end
 end
@@ -166,8 +189,8 @@ describe 'Btree operations' do
       ".exit",
     ]
     result = run_script(script)
-    contains(result, "leaf (size 7)")
-    contains(result, "leaf (size 9)")
+    # Short rows are stored without padding, all of them share the root leaf
+    contains(result, "- leaf (size 16)")
     contains(result, "(1, foo, bar)") 
     contains(result, "(2, bar, foo)")
     contains(result, "(3, baz, qux)")
@@ -185,6 +208,679 @@ describe 'Btree operations' do
     contains(result, "(15, baz2, qux2)")
     contains(result, "(16, quux2, corge2)")
   end
+
+  it 'keeps dozens of leaves under a single internal root' do
+    script = (1..500).map { |i| wide_insert(i) }
+    result = run_script(script + [".btree", ".exit"])
+    expect(result.count { |line| line.include?("- internal") }).to eq 1
+    expect(result.count { |line| line.include?("- leaf") } > 30).to be true
+  end
+
+  it 'finds every row of a shuffled table by id' do
+    system("make clean")
+    ids = (1..2000).to_a.shuffle(random: Random.new(15))
+    probes = [1, 2, 33, 1000, 1999, 2000, 2001]
+    script = ids.map { |i| "insert #{i} u#{i} e#{i}" } + probes.map { |i| "select where id = #{i}" }
+    result = run_script(script + [".exit"])
+    rows = result.select { |line| line.start_with?("(") }
+    expect(rows).to eq probes.take(6).map { |i| "(#{i}, u#{i}, e#{i})" }
+  end
+
+  it 'packs leaves full when ids increase' do
+    system("make clean")
+    script = (1..500).map { |i| wide_insert(i) }
+    result = run_script(script + [".btree", ".exit"])
+    expect(result.count { |line| line.include?("- leaf (size 13)") }).to eq 38
+    expect(result.count { |line| line.include?("- leaf") }).to eq 39
+  end
+
+  it 'stores short rows without padding' do
+    system("make clean")
+    script = (1..500).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    result = run_script(script + ["select", ".btree", ".exit"])
+    contains(result, "(500, user500, person500@example.com)")
+    expect(result.count { |line| line.include?("- leaf") }).to eq 5
+  end
+
+  it 'bulk loads a sorted file into packed leaves' do
+    system("make clean")
+    path = File.join(Dir.tmpdir, "tp_spec_import.csv")
+    File.write(path, (1..500).map { |i| wide_insert(i).split(" ", 2)[1].tr(" ", ",") + "\n" }.join)
+    result = run_script([".import #{path}", ".exit"])
+    contains(result, "Imported 500 rows")
+    result = run_script(["insert 501 a b", "select", ".btree", ".exit"])
+    rows = result.select { |line| line.start_with?("(") && line.include?("@example.com") }
+    expect(rows.length).to eq 500
+    contains(result, "(500, user500_")
+    contains(result, "(501, a, b)")
+    # 13 rows per full leaf
+    expect(result.count { |line| line.include?("- leaf") }).to eq 39
+    File.delete(path)
+  end
+
+  it 'leaves the file as it was when an import fails' do
+    system("make clean")
+    path = File.join(Dir.tmpdir, "tp_spec_import_bad.csv")
+    rows = (1..500).map { |i| wide_insert(i).split(" ", 2)[1].tr(" ", ",") + "\n" }
+    File.write(path, rows.join + "abc,x,y\n")
+    pages = ->(result) { result.find { |line| line.start_with?("pages:") } }
+
+    # Nothing reached the log yet: the load is rolled back
+    before = pages.call(run_script([".pool", ".exit"]))
+    size = File.size("mydb.db")
+    result = run_script([".import #{path}", ".pool", ".exit"])
+    contains(result, "Import failed at #{path}:501")
+    expect(pages.call(result)).to eq before
+    expect(File.size("mydb.db")).to eq size
+
+    # A small pool commits the load in batches, its pages go back on the free list
+    first = pages.call(run_script([".import #{path}", ".pool", ".exit"], flags: "--pool-frames=16"))
+    result = run_script([".import #{path}", ".pool", "select", ".exit"], flags: "--pool-frames=16")
+    expect(pages.call(result)).to eq first
+    expect(result.any? { |line| line.start_with?("(") }).to be false
+    File.delete(path)
+  end
+end
+
+describe 'Updates and deletes' do
+  before(:each) do
+    # Ensure the database is clean before running tests
+    system("make clean")
+  end
+  it 'updates a row in place and grows it' do
+    result = run_script(["insert 1 foo bar", "insert 2 baz qux", "update 1 a b", "update 2 #{"x" * 32} #{"y" * 255}",
+                         "update 3 no row", "select", ".exit"])
+    contains(result, "(1, a, b)")
+    contains(result, "(2, #{"x" * 32}, #{"y" * 255})")
+    contains(result, "No row with id 3")
+  end
+
+  it 'merges leaves as rows are deleted' do
+    script = (1..500).map { |i| wide_insert(i) }
+    script += (1..500).reject { |i| i % 50 == 0 }.map { |i| "delete #{i}" }
+    result = run_script(script + ["select", ".btree", ".exit"])
+    rows = result.select { |line| line.start_with?("(") && line.include?("@example.com") }
+    expect(rows.length).to eq 10
+    contains(result, "(500, user500_")
+    # 39 leaves merge down to two, each above a third full
+    expect(result.count { |line| line.include?("- leaf (size 5)") }).to eq 2
+    expect(result.count { |line| line.include?("- leaf") }).to eq 2
+  end
+
+  it 'reuses freed pages instead of growing the file' do
+    script = (1..500).map { |i| wide_insert(i) }
+    run_script(script + [".exit"])
+    run_script((1..500).map { |i| "delete #{i}" } + [".exit"])
+    result = run_script(script + [".pool", ".exit"])
+    contains(result, "pages: 41")
+  end
+end
+
+describe 'Range scans' do
+  before(:all) do
+    # Ensure the database is clean before running tests
+    system("make clean")
+    run_script((1..500).map { |i| wide_insert(i) } + [".exit"])
+  end
+  it 'returns only the rows in an id range' do
+    result = run_script(["select where id between 10 and 12", "select where id > 498", "select where id < 0", ".exit"])
+    rows = result.select { |line| line.start_with?("(") && line.include?("@example.com") }
+    expect(rows.map { |line| line[/^\((\d+),/, 1].to_i }).to eq [10, 11, 12, 499, 500]
+  end
+
+  it 'reads one path for a point lookup' do
+    result = run_script(["select where id = 250", ".pool", ".exit"])
+    contains(result, "(250, user250_")
+    # The meta page, then the root and the leaf
+    contains(result, "misses: 3")
+    expect(result.any? { |line| line =~ /^read ahead: \w+, 0 pages/ }).to be true
+  end
+
+  it 'stops at the limit and filters on columns' do
+    result = run_script(["select where id >= 100 limit 3", "select where username = #{"user77".ljust(32, "_")}",
+                         ".exit"])
+    rows = result.select { |line| line.start_with?("(") && line.include?("@example.com") }
+    expect(rows.map { |line| line[/^\((\d+),/, 1].to_i }).to eq [100, 101, 102, 77]
+  end
+end
+
+describe 'Secondary indexes' do
+  before(:each) do
+    # Ensure the database is clean before running tests
+    system("make clean")
+  end
+  it 'looks rows up by username through the index' do
+    run_script((1..500).map { |i| wide_insert(i) } + [".index create username", ".exit"])
+    name = "user250".ljust(32, "_")
+    result = run_script(["select where username = #{name}", ".pool", ".exit"])
+    contains(result, "(250, user250_")
+    # Two index pages and two table pages instead of every leaf
+    misses = result.find { |line| line.start_with?("misses: ") }.split.last.to_i
+    expect(misses < 8).to be true
+  end
+
+  it 'keeps the index in step with updates and deletes' do
+    result = run_script([".index create email", "insert 1 a x@example.com", "insert 2 b y@example.com",
+                         "insert 3 c x@example.com", "update 2 b x@example.com", "delete 1", ".exit"])
+    contains(result, "Created index on email")
+    result = run_script(["select where email = x@example.com", "select where email = y@example.com",
+                         ".index create email", ".exit"])
+    rows = result.select { |line| line.start_with?("(") }
+    expect(rows).to eq ["(2, b, x@example.com)", "(3, c, x@example.com)"]
+    contains(result, "Index on email already exists")
+  end
+
+  it 'lists a common value again once deletes bring it back under the limit' do
+    script = [".index create username"] + (1..300).map { |i| "insert #{i} #{i <= 100 ? "same" : "other"} u#{i}@x" }
+    run_script(script + (1..70).map { |i| "delete #{i}" } + [".exit"])
+    result = run_script(["select where username = same", ".stats", ".exit"])
+    rows = result.select { |line| line.start_with?("(") }
+    expect(rows.length).to eq 30
+    # The 30 listed rows are checked, not the whole table
+    scanned = result.find { |line| line.start_with?("rows scanned: ") }.split.last.to_i
+    expect(scanned).to eq 30
+  end
+
+  it 'indexes rows loaded by .import' do
+    path = File.join(Dir.tmpdir, "tp_spec_index_#{Process.pid}.csv")
+    File.write(path, (1..300).map { |i| "#{i},user#{i % 7},person#{i}@example.com\n" }.join)
+    result = run_script([".index create username", ".import #{path}", "select where username = user3 limit 4",
+                         ".exit"])
+    rows = result.select { |line| line.start_with?("(") }
+    expect(rows).to eq [3, 10, 17, 24].map { |i| "(#{i}, user3, person#{i}@example.com)" }
+  ensure
+    File.delete(path) if path && File.exist?(path)
+  end
+end
+
+describe 'Transactions' do
+  before(:each) do
+    # Ensure the database is clean before running tests
+    system("make clean")
+  end
+  it 'inserts every row of a multi-row insert or none of them' do
+    result = run_script(["insert 3 c c@x, 1 a a@x, 2 b b@x", "insert 4 d d@x, 2 e e@x", "insert 5 e e@x, 5 f f@x",
+                         "select", ".pool", ".exit"])
+    rows = result.select { |line| line.start_with?("(") }
+    expect(rows).to eq ["(1, a, a@x)", "(2, b, b@x)", "(3, c, c@x)"]
+    contains(result, "Duplicate key error, row with id 2 already exists")
+    contains(result, "Duplicate key error, row with id 5 already exists")
+    # One commit creates the file, one holds all three rows; rejected statements write nothing
+    contains(result, "wal commits: 2")
+  end
+
+  it 'commits the statements of a transaction at once' do
+    script = ["begin"] + (1..200).map { |i| "insert #{i} user#{i} person#{i}@example.com" } +
+             ["update 1 first first@example.com", "commit", ".pool", ".exit"]
+    result = run_script(script)
+    contains(result, "wal commits: 2")
+    result = run_script(["select", ".exit"])
+    contains(result, "(1, first, first@example.com)")
+    contains(result, "(200, user200, person200@example.com)")
+  end
+
+  it 'restores the pages a rolled back transaction changed' do
+    run_script((1..100).map { |i| wide_insert(i) } + [".index create username", ".exit"])
+    result = run_script(["begin", "delete 50", "update 1 one one@example.com",
+                         *(101..150).map { |i| wide_insert(i) }, "rollback", "select where id between 49 and 51",
+                         "select where id > 99", "select where username = one", "commit", ".exit"])
+    rows = result.select { |line| line.start_with?("(") }.map { |line| line[/^\((\d+),/, 1].to_i }
+    expect(rows).to eq [49, 50, 51, 100]
+    contains(result, "No transaction is open")
+  end
+
+  it 'reports a transaction rolled back for outgrowing the buffer pool' do
+    script = ["begin"] + (1..300).map { |i| wide_insert(i) } + ["commit", "select where id < 10", ".exit"]
+    result = run_script(script, flags: "--pool-frames=16")
+    contains(result, "Transaction rolled back: it outgrew the buffer pool")
+    contains(result, "No transaction is open")
+    expect(result.any? { |line| line.start_with?("(") }).to be false
+  end
+
+  it 'discards a transaction left open at exit' do
+    run_script(["insert 1 a a@x", "begin", "insert 2 b b@x", ".exit"])
+    result = run_script(["select", ".exit"])
+    rows = result.select { |line| line.start_with?("(") }
+    expect(rows).to eq ["(1, a, a@x)"]
+  end
+end
+
+describe 'Prepared statements' do
+  before(:each) do
+    # Ensure the database is clean before running tests
+    system("make clean")
+  end
+  it 'reuses the program of a statement it has seen' do
+    result = run_script(["insert 1 a a@x", "select where id >= 1", "insert 2 b b@x", "select where id >= 1", ".exit"])
+    rows = result.select { |line| line.start_with?("(") }
+    expect(rows).to eq ["(1, a, a@x)", "(1, a, a@x)", "(2, b, b@x)"]
+    expect(result.count { |line| line.include?("reusing prepared statement") }).to eq 1
+  end
+
+  it 'compiles new statements into the ones evicted from a full cache' do
+    long = "x" * 200
+    script = (1..40).map { |i| "insert #{i} user#{i} #{long}#{i}" }
+    script += ["insert 41 a", "select where id >= 39", "select where id >= 1 limit 1", ".exit"]
+    result = run_script(script)
+    rows = result.select { |line| line.start_with?("(") }
+    expect(rows).to eq ["(39, user39, #{long}39)", "(40, user40, #{long}40)", "(1, user1, #{long}1)"]
+  end
+
+  it 'explains the program of a select' do
+    result = run_script([".explain select where username = a limit 2", "select where id > ?", ".exit"])
+    contains(result, "IndexSeek")
+    contains(result, "Seek")
+    contains(result, "Halt")
+    contains(result, "parameter 1 is not bound")
+  end
+end
+
+describe 'Output modes' do
+  before(:each) do
+    # Ensure the database is clean before running tests
+    system("make clean")
+  end
+  it 'prints rows as csv, quoting fields that need it' do
+    result = run_script(["insert 1 a a@x, 2 \"q\"u b@x", ".mode csv", "select", ".mode text", "select", ".exit"])
+    contains(result, "1,a,a@x")
+    contains(result, '2,"""q""u",b@x')
+    contains(result, '(2, "q"u, b@x)')
+  end
+
+  it 'prints rows as length-prefixed binary records' do
+    result = run_script(["insert 7 ab c@x", ".mode binary", "select", ".exit"])
+    record = [11, 7].pack("L<L<") + "\x02ab\x03c@x"
+    expect(result.join("\n").b.include?(record.b)).to be true
+  end
+end
+
+describe 'Metrics' do
+  before(:each) do
+    # Ensure the database is clean before running tests
+    system("make clean")
+  end
+  it 'reports splits, tree shape, rows and latencies' do
+    result = run_script((1..40).map { |i| wide_insert(i) } + ["select where id > 30 limit 2", ".stats", ".exit"])
+    contains(result, "leaf splits: 3")
+    contains(result, "tree height: 2")
+    contains(result, "rows: 40")
+    contains(result, "rows scanned: 2")
+    contains(result, "rows returned: 2")
+    expect(result.any? { |line| line.match?(/^insert\s+40\s/) }).to be true
+  end
+
+  it 'dumps the metrics to a JSON file' do
+    Dir.mktmpdir do |dir|
+      path = "#{dir}/stats.json"
+      run_script(["insert 1 a a@x", "select", ".exit"], flags: "--stats-file=#{path}")
+      dump = File.read(path)
+      expect(dump.start_with?('{"time":')).to be true
+      expect(dump.include?('"latency":{"select":{"count":')).to be true
+    end
+  end
+end
+
+describe 'Logging' do
+  before(:each) do
+    # Ensure the database is clean before running tests
+    system("make clean")
+  end
+  it 'drops messages below the runtime log level' do
+    result = run_script(["insert 1 a a@x", "select", ".exit"], flags: "--log=warn")
+    contains(result, "(1, a, a@x)")
+    expect(result.any? { |line| line.include?("received command") }).to be false
+    expect(result.any? { |line| line.include?("Entering REPL loop") }).to be false
+  end
+
+  it 'writes every message in asynchronous mode' do
+    result = run_script((1..50).map { |i| "insert #{i} user#{i} person#{i}@example.com" } + [".exit"],
+                        flags: "--log-async")
+    expect(result.count { |line| line.include?("Executing insert command") }).to eq 50
+    contains(result, "goodbye.")
+  end
+end
+
+describe 'Library' do
+  before(:each) do
+    # Ensure the database is clean before running tests
+    system("make clean")
+  end
+  it 'runs statements in-process through libsqlite-engine' do
+    Dir.mktmpdir do |dir|
+      File.write("#{dir}/client.c", <<~C)
+        #include "engine.h"
+
+        static bool
+        count(const Row* row, void* arg) {
+                *(uint32_t*)arg += row->id;
+                return true;
+        }
+
+        int
+        main(int argc, char** argv) {
+                Database* db = db_open(argv[1], NULL);
+                Statement* insert;
+                if (db_prepare(db, "insert ? ? ?", &insert) != PREPARE_SUCCESS)
+                        return 1;
+                for (int i = 1; i <= 50; i++) {
+                        stmt_reset(insert);
+                        stmt_bind_int(insert, 1, i);
+                        stmt_bind_text(insert, 2, "user");
+                        stmt_bind_text(insert, 3, "user@example.com");
+                        if (db_run(insert, NULL, NULL) != DB_OK)
+                                return 1;
+                }
+                stmt_finalize(insert);
+
+                uint32_t sum = 0;
+                DbResult result = db_exec(db, "select where id > 40", count, &sum);
+                printf("sum %u result %d\\n", sum, result);
+                db_close(db);
+                return 0;
+        }
+      C
+      expect(system("make lib > /dev/null")).to be true
+      expect(system("gcc -I include -o #{dir}/client #{dir}/client.c bin/libsqlite-engine.a -pthread")).to be true
+      output = `#{dir}/client #{dir}/lib.db`
+      contains(output.split("\n"), "sum 455 result 0")
+      # The rows were written to the file: inserting them again fails
+      expect(system("#{dir}/client #{dir}/lib.db > /dev/null")).to be false
+    end
+  end
+end
+
+describe 'Concurrency' do
+  before(:each) do
+    system("make clean")
+  end
+  it 'runs readers alongside a writer without seeing uncommitted rows' do
+    Dir.mktmpdir do |dir|
+      File.write("#{dir}/client.c", <<~C)
+        #include <pthread.h>
+        #include <stdio.h>
+        #include <string.h>
+        #include <unistd.h>
+
+        #include "engine.h"
+        #include "log.h"
+
+        #define ROWS    1000
+        #define READERS 3
+
+        static Database* db;
+        static int done;
+        static uint32_t committed; // Odd ids inserted so far, they are never deleted
+        static int failures;
+
+        typedef struct {
+                uint32_t last;
+                uint32_t odd;
+                bool bad;
+        } Scan;
+
+        static bool
+        check(const Row* row, void* arg) {
+                Scan* scan = arg;
+                char name[16];
+                snprintf(name, sizeof(name), "u%u", row->id);
+                scan->bad |= row->id <= scan->last || strcmp(row->username, name) != 0;
+                scan->last = row->id;
+                scan->odd += row->id % 2;
+                return true;
+        }
+
+        static void*
+        reader(void* arg) {
+                Statement* select;
+                db_prepare(db, "select", &select);
+                while (!__atomic_load_n(&done, __ATOMIC_ACQUIRE)) {
+                        Scan scan = {0};
+                        uint32_t odd = __atomic_load_n(&committed, __ATOMIC_ACQUIRE);
+                        stmt_reset(select);
+                        db_run(select, check, &scan);
+                        if (scan.bad || scan.odd < odd)
+                                __atomic_fetch_add(&failures, 1, __ATOMIC_RELAXED);
+                        usleep(1000); // Leave the writer room on a single core
+                }
+                stmt_finalize(select);
+                return NULL;
+        }
+
+        int
+        main(int argc, char** argv) {
+                PagerConfig config = {.pool_frames = 32};
+                log_set_level(LogLevel_OFF);
+                db = db_open(argv[1], &config);
+                pthread_t threads[READERS];
+                for (int i = 0; i < READERS; i++) pthread_create(&threads[i], NULL, reader, NULL);
+
+                char sql[64];
+                for (uint32_t i = 0; i < ROWS; i++) {
+                        uint32_t id = (i * 7919) % ROWS + 1; // Every id once, out of order
+                        snprintf(sql, sizeof(sql), "insert %u u%u u%u@example.com", id, id, id);
+                        db_exec(db, sql, NULL, NULL);
+                        if (id % 2)
+                                __atomic_fetch_add(&committed, 1, __ATOMIC_RELEASE);
+                        if (id % 2 == 0 && i % 3 == 0) {
+                                snprintf(sql, sizeof(sql), "delete %u", id);
+                                db_exec(db, sql, NULL, NULL);
+                        }
+                        if (i % 100 == 0) {
+                                db_exec(db, "begin", NULL, NULL);
+                                db_exec(db, "insert 99999 x x@example.com", NULL, NULL);
+                                db_exec(db, "rollback", NULL, NULL);
+                        }
+                }
+                __atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+                for (int i = 0; i < READERS; i++) pthread_join(threads[i], NULL);
+
+                Scan scan = {0};
+                db_exec(db, "select", check, &scan);
+                printf("odd %u failures %d\\n", scan.odd, failures);
+                db_close(db);
+                return 0;
+        }
+      C
+      expect(system("make lib > /dev/null")).to be true
+      expect(system("gcc -I include -o #{dir}/client #{dir}/client.c bin/libsqlite-engine.a -pthread")).to be true
+      output = `#{dir}/client #{dir}/concurrent.db`
+      contains(output.split("\n"), "odd 500 failures 0")
+    end
+  end
+  it 'checks and writes each row under one transaction when writers race' do
+    Dir.mktmpdir do |dir|
+      File.write("#{dir}/client.c", <<~C)
+        #include <pthread.h>
+        #include <stdio.h>
+
+        #include "engine.h"
+        #include "log.h"
+
+        #define ROWS    500
+        #define WRITERS 3
+
+        static Database* db;
+        static int inserted, deleted;
+
+        static bool
+        count(const Row* row, void* arg) {
+                (*(int*)arg)++;
+                return true;
+        }
+
+        static void*
+        writer(void* arg) {
+                Statement* insert;
+                Statement* delete;
+                db_prepare(db, "insert ? u e@example.com", &insert);
+                db_prepare(db, "delete ?", &delete);
+                // Every writer tries every id, each insert or delete must see the ones before it
+                for (uint32_t id = 1; id <= ROWS; id++) {
+                        stmt_reset(insert);
+                        stmt_bind_int(insert, 1, id);
+                        if (db_run(insert, NULL, NULL) == DB_OK)
+                                __atomic_fetch_add(&inserted, 1, __ATOMIC_RELAXED);
+                        if (id % 2 == 0) {
+                                stmt_reset(delete);
+                                stmt_bind_int(delete, 1, id - 1);
+                                if (db_run(delete, NULL, NULL) == DB_OK)
+                                        __atomic_fetch_add(&deleted, 1, __ATOMIC_RELAXED);
+                        }
+                }
+                stmt_finalize(insert);
+                stmt_finalize(delete);
+                return NULL;
+        }
+
+        int
+        main(int argc, char** argv) {
+                PagerConfig config = {.pool_frames = 32};
+                log_set_level(LogLevel_OFF);
+                db = db_open(argv[1], &config);
+                pthread_t threads[WRITERS];
+                for (int i = 0; i < WRITERS; i++) pthread_create(&threads[i], NULL, writer, NULL);
+                for (int i = 0; i < WRITERS; i++) pthread_join(threads[i], NULL);
+
+                int rows = 0;
+                db_exec(db, "select", count, &rows);
+                printf("rows %d balanced %d\\n", rows, inserted - deleted == rows);
+                db_close(db);
+                return 0;
+        }
+      C
+      expect(system("make lib > /dev/null")).to be true
+      expect(system("gcc -I include -o #{dir}/client #{dir}/client.c bin/libsqlite-engine.a -pthread")).to be true
+      output = `#{dir}/client #{dir}/writers.db`
+      contains(output.split("\n"), "rows 250 balanced 1")
+    end
+  end
+  it 'leaves the transaction of one thread to the thread that began it' do
+    Dir.mktmpdir do |dir|
+      File.write("#{dir}/client.c", <<~C)
+        #include <pthread.h>
+        #include <stdio.h>
+        #include <unistd.h>
+
+        #include "engine.h"
+        #include "log.h"
+
+        static Database* db;
+        static int committed;
+
+        static DbResult
+        run(const char* sql) {
+                Statement* stmt;
+                db_prepare(db, sql, &stmt);
+                DbResult result = db_run(stmt, NULL, NULL);
+                stmt_finalize(stmt);
+                return result;
+        }
+
+        static void*
+        other(void* arg) {
+                // Neither may end the main thread's transaction, begin waits for it to end
+                printf("commit %d rollback %d\\n", run("commit") == DB_OK, run("rollback") == DB_OK);
+                run("begin");
+                printf("began after commit %d\\n", __atomic_load_n(&committed, __ATOMIC_RELAXED));
+                run("insert 2 b b@x");
+                printf("commit %d\\n", run("commit") == DB_OK);
+                return NULL;
+        }
+
+        static bool
+        count(const Row* row, void* arg) {
+                (*(int*)arg)++;
+                return true;
+        }
+
+        int
+        main(int argc, char** argv) {
+                log_set_level(LogLevel_OFF);
+                db = db_open(argv[1], NULL);
+                run("begin");
+                run("insert 1 a a@x");
+                pthread_t thread;
+                pthread_create(&thread, NULL, other, NULL);
+                usleep(100000);
+                __atomic_store_n(&committed, 1, __ATOMIC_RELAXED);
+                run("commit");
+                pthread_join(thread, NULL);
+
+                int rows = 0;
+                db_exec(db, "select", count, &rows);
+                printf("rows %d\\n", rows);
+                db_close(db);
+                return 0;
+        }
+      C
+      expect(system("make lib > /dev/null")).to be true
+      expect(system("gcc -I include -o #{dir}/client #{dir}/client.c bin/libsqlite-engine.a -pthread")).to be true
+      lines = `#{dir}/client #{dir}/owner.db`.split("\n")
+      expect(lines).to eq ["commit 0 rollback 0", "began after commit 1", "commit 1", "rows 2"]
+    end
+  end
+  it 'keeps a statement left between rows on its snapshot across commits' do
+    Dir.mktmpdir do |dir|
+      File.write("#{dir}/client.c", <<~C)
+        #include <stdio.h>
+
+        #include "engine.h"
+        #include "log.h"
+
+        int
+        main(int argc, char** argv) {
+                log_set_level(LogLevel_OFF);
+                Database* db = db_open(argv[1], NULL);
+                char sql[64];
+                for (uint32_t id = 1; id <= 300; id++) {
+                        snprintf(sql, sizeof(sql), "insert %u u%u u%u@example.com", id, id, id);
+                        db_exec(db, sql, NULL, NULL);
+                }
+
+                Statement* select;
+                db_prepare(db, "select", &select);
+                uint32_t rows = stmt_step(select) == STEP_ROW;
+                for (uint32_t id = 2; id <= 300; id += 2) {
+                        snprintf(sql, sizeof(sql), "delete %u", id);
+                        db_exec(db, sql, NULL, NULL);
+                }
+                db_exec(db, "insert 301 late late@example.com", NULL, NULL);
+                while (stmt_step(select) == STEP_ROW) rows++;
+                stmt_finalize(select);
+
+                // Nothing reads the old pages any more, the next commit frees them
+                db_exec(db, "insert 302 last last@example.com", NULL, NULL);
+                PagerStats* stats = &db->table->pager->stats;
+                printf("rows %u versions left %d\\n", rows, (int)(stats->versions - stats->reclaimed));
+                db_close(db);
+                return 0;
+        }
+      C
+      expect(system("make lib > /dev/null")).to be true
+      expect(system("gcc -I include -o #{dir}/client #{dir}/client.c bin/libsqlite-engine.a -pthread")).to be true
+      output = `#{dir}/client #{dir}/snapshot.db`
+      contains(output.split("\n"), "rows 300 versions left 0")
+    end
+  end
+end
+
+describe 'Benchmarks' do
+  it 'reports every benchmark as a line of JSON' do
+    output = `make bench BENCH_FLAGS=--rows=2000 BENCH_OUTPUT=/dev/null 2>/dev/null`
+    lines = output.split("\n").select { |line| line.start_with?("{") }
+    names = lines.map { |line| line[/"bench":"(\w+)"/, 1] }
+    expect(names).to eq %w[insert_seq insert_rand insert_dup lookup_cold lookup_warm scan_cold scan_warm insert_split]
+    lines.each do |line|
+      expect(line.match?(/"ops":2000,.*"p999_ns":\d+,"pages_per_op":[\d.]+/)).to be true
+    end
+  end
+
+  it 'runs the warm lookups and scans without a miss however small the pool' do
+    output = `make bench BENCH_FLAGS="--rows=5000 --pool-frames=16" BENCH_OUTPUT=/dev/null 2>/dev/null`
+    warm = output.split("\n").select { |line| line.include?("_warm\"") }
+    expect(warm.length).to eq 2
+    warm.each { |line| expect(line.end_with?("\"misses\":0}")).to be true }
+  end
 end
 
 describe 'Complex operation' do
@@ -193,37 +889,8 @@ describe 'Complex operation' do
     system("make clean")
   end
   it 'allows printing out the structure of a 4-leaf-node btree2' do
-    script = [
-      "insert 18 user18 person18@example.com",
-      "insert 7 user7 person7@example.com",
-      "insert 10 user10 person10@example.com",
-      "insert 29 user29 person29@example.com",
-      "insert 23 user23 person23@example.com",
-      "insert 4 user4 person4@example.com",
-      "insert 14 user14 person14@example.com",
-      "insert 30 user30 person30@example.com",
-      "insert 15 user15 person15@example.com",
-      "insert 26 user26 person26@example.com",
-      "insert 22 user22 person22@example.com",
-      "insert 19 user19 person19@example.com",
-      "insert 2 user2 person2@example.com",
-      "insert 1 user1 person1@example.com",
-      "insert 21 user21 person21@example.com",
-      "insert 11 user11 person11@example.com",
-      "insert 6 user6 person6@example.com",
-      "insert 20 user20 person20@example.com",
-      "insert 5 user5 person5@example.com",
-      "insert 8 user8 person8@example.com",
-      "insert 9 user9 person9@example.com",
-      "insert 3 user3 person3@example.com",
-      "insert 12 user12 person12@example.com",
-      "insert 27 user27 person27@example.com",
-      "insert 17 user17 person17@example.com",
-      "insert 16 user16 person16@example.com",
-      "insert 13 user13 person13@example.com",
-      "insert 24 user24 person24@example.com",
-      "insert 25 user25 person25@example.com",
-      "insert 28 user28 person28@example.com",
+    ids = [18, 7, 10, 29, 23, 4, 14, 30, 15, 26, 22, 19, 2, 1, 21, 11, 6, 20, 5, 8, 9, 3, 12, 27, 17, 16, 13, 24, 25, 28]
+    script = ids.map { |i| wide_insert(i) } + [
       ".btree",
       ".exit",
     ]
@@ -233,3 +900,169 @@ describe 'Complex operation' do
     contains(result, "leaf (size 8)")
   end
 end
+
+describe 'Buffer pool' do
+  before(:each) do
+    # Ensure the database is clean before running tests
+    system("make clean")
+  end
+  it 'evicts pages when the table outgrows a small pool' do
+    script = (1..500).map { |i| wide_insert(i) }
+    script += ["select", ".pool", ".exit"]
+    result = run_script(script, flags: "--pool-frames=32")
+    contains(result, "(1, user1_")
+    contains(result, "(250, user250_")
+    contains(result, "(500, user500_")
+    contains(result, "frames: 32/32")
+  end
+
+  it 'reads back evicted pages after reopening' do
+    script = (1..500).map { |i| wide_insert(501 - i) }
+    run_script(script + [".exit"], flags: "--pool-frames=32")
+    result = run_script(["select", ".exit"], flags: "--pool-frames=32")
+    rows = result.select { |line| line.start_with?("(") && line.include?("@example.com") }
+    expect(rows.length).to eq 500
+    contains(result, "(1, user1_")
+    contains(result, "(500, user500_")
+  end
+
+  it 'reads ahead the next leaves during a full scan' do
+    script = (1..500).map { |i| wide_insert(i) }
+    run_script(script + [".exit"])
+    ["uring", "threads"].each do |backend|
+      result = run_script(["select", ".pool", ".exit"], flags: "--pool-frames=32 --aio=#{backend}")
+      rows = result.select { |line| line.start_with?("(") && line.include?("@example.com") }
+      expect(rows.length).to eq 500
+      expect(result.any? { |line| line =~ /^read ahead: \w+, [1-9]\d* pages/ }).to be true
+    end
+  end
+end
+
+describe 'Write-ahead log' do
+  before(:each) do
+    # Ensure the database is clean before running tests
+    system("make clean")
+  end
+  it 'recovers committed rows when the process dies without .exit' do
+    # Closing stdin without .exit kills the REPL before the pager is closed.
+    run_script((1..50).map { |i| "insert #{i} user#{i} person#{i}@example.com" })
+    expect(File.exist?("mydb.db-wal")).to be true
+    result = run_script(["select", ".exit"])
+    contains(result, "Recovered")
+    contains(result, "(1, user1, person1@example.com)")
+    contains(result, "(50, user50, person50@example.com)")
+  end
+
+  it 'removes the log after a clean exit' do
+    run_script(["insert 1 foo bar", ".exit"])
+    expect(File.exist?("mydb.db-wal")).to be false
+    result = run_script(["select", ".exit"])
+    contains(result, "(1, foo, bar)")
+  end
+
+  it 'shares syncs between back-to-back commits in normal mode' do
+    script = (1..200).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    result = run_script(script + [".pool", ".exit"], flags: "--wal-sync=normal")
+    contains(result, "wal commits: 201")
+    syncs = result.find { |line| line.start_with?("wal syncs:") }.split(":").last.to_i
+    expect(syncs < 200).to be true
+    result = run_script(["select", ".exit"])
+    contains(result, "(200, user200, person200@example.com)")
+  end
+end
+
+describe 'Dirty page tracking' do
+  before(:each) do
+    # Ensure the database is clean before running tests
+    system("make clean")
+  end
+  it 'writes nothing for a read-only session' do
+    run_script((1..100).map { |i| "insert #{i} user#{i} person#{i}@example.com" } + [".exit"])
+    result = run_script(["select", ".btree", ".pool", ".exit"])
+    contains(result, "(100, user100, person100@example.com)")
+    contains(result, "pages dirtied: 0")
+    contains(result, "wal frames: 0")
+  end
+
+  it 'logs only the leaf for an insert that does not split' do
+    result = run_script(["insert 1 foo bar", "insert 2 bar foo", ".pool", ".exit"])
+    # The meta page and the root when the file is created, then the leaf once per insert
+    contains(result, "wal frames: 4")
+  end
+end
+
+describe 'Memory mapped pager' do
+  before(:each) do
+    # Ensure the database is clean before running tests
+    system("make clean")
+  end
+  it 'serves pages from the mapping after reopening' do
+    script = (1..500).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    run_script(script + [".exit"], flags: "--mmap --pool-frames=32")
+    result = run_script(["select", ".pool", ".exit"], flags: "--mmap --pool-frames=32")
+    rows = result.select { |line| line.start_with?("(") && line.include?("@example.com") }
+    expect(rows.length).to eq 500
+    contains(result, "mode: mmap")
+    contains(result, "(500, user500, person500@example.com)")
+    expect(result.any? { |line| line =~ /^pages mapped: [1-9]/ }).to be true
+  end
+  it 'keeps old images for a snapshot while the checkpointer rewrites the file' do
+    Dir.mktmpdir do |dir|
+      File.write("#{dir}/client.c", <<~C)
+        #include <stdio.h>
+        #include <string.h>
+
+        #include "engine.h"
+        #include "log.h"
+
+        static bool
+        check(const Row* row, void* arg) {
+                char name[16];
+                snprintf(name, sizeof(name), "u%u", row->id);
+                *(int*)arg += strcmp(row->username, name) == 0;
+                return true;
+        }
+
+        int
+        main(int argc, char** argv) {
+                PagerConfig config = {.pool_frames = 16, .mode = PAGER_MODE_MMAP};
+                log_set_level(LogLevel_OFF);
+                char sql[64];
+                Database* db = db_open(argv[1], &config);
+                for (uint32_t id = 1; id <= 300; id++) {
+                        snprintf(sql, sizeof(sql), "insert %u u%u u%u@example.com", id, id, id);
+                        db_exec(db, sql, NULL, NULL);
+                }
+                db_close(db);
+
+                // Every page is in the file now, and read from the mapping
+                db = db_open(argv[1], &config);
+                Statement* select;
+                db_prepare(db, "select", &select);
+                int rows = stmt_step(select) == STEP_ROW;
+                for (uint32_t id = 2; id <= 300; id += 2) {
+                        snprintf(sql, sizeof(sql), "delete %u", id);
+                        db_exec(db, sql, NULL, NULL);
+                }
+                wal_checkpoint(db->table->pager->wal);
+                while (stmt_step(select) == STEP_ROW) rows++;
+                stmt_finalize(select);
+
+                db_exec(db, "insert 301 u301 u301@example.com", NULL, NULL);
+                wal_checkpoint(db->table->pager->wal);
+                int matched = 0;
+                db_exec(db, "select", check, &matched);
+                PagerStats* stats = &db->table->pager->stats;
+                printf("rows %d matched %d mapped %d versions left %d\\n", rows, matched, stats->mapped > 0,
+                       (int)(stats->versions - stats->reclaimed));
+                db_close(db);
+                return 0;
+        }
+      C
+      expect(system("make lib > /dev/null")).to be true
+      expect(system("gcc -I include -o #{dir}/client #{dir}/client.c bin/libsqlite-engine.a -pthread")).to be true
+      output = `#{dir}/client #{dir}/mapped.db`
+      contains(output.split("\n"), "rows 300 matched 151 mapped 1 versions left 0")
+    end
+  end
+end
@@ -0,0 +1,318 @@
+#include "aio.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "log.h"
+
+#if defined(__linux__)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+#define AIO_HAVE_URING 1
+#endif
+
+#ifdef AIO_HAVE_URING
+/**
+ * @brief Set up an io_uring of AIO_DEPTH entries and map its rings.
+ * liburing is not required, the three rings are mapped by hand. Returns false when
+ * the kernel (or a seccomp profile) refuses io_uring.
+ */
+static bool
+aio_uring_open(Aio* aio) {
+        AioUring* ring = &aio->uring;
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+
+        int fd = syscall(__NR_io_uring_setup, AIO_DEPTH, &params);
+        if (fd < 0)
+                return false;
+
+        ring->fd = fd;
+        ring->sq_ring_len = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+        ring->cq_ring_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+                if (ring->cq_ring_len > ring->sq_ring_len)
+                        ring->sq_ring_len = ring->cq_ring_len;
+                ring->cq_ring_len = ring->sq_ring_len;
+        }
+
+        ring->sq_ring = mmap(NULL, ring->sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                             IORING_OFF_SQ_RING);
+        if (ring->sq_ring == MAP_FAILED) {
+                close(fd);
+                return false;
+        }
+
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+                ring->cq_ring = ring->sq_ring;
+        } else {
+                ring->cq_ring = mmap(NULL, ring->cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                     fd, IORING_OFF_CQ_RING);
+                if (ring->cq_ring == MAP_FAILED) {
+                        munmap(ring->sq_ring, ring->sq_ring_len);
+                        close(fd);
+                        return false;
+                }
+        }
+
+        ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+        ring->sqes =
+            mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (ring->sqes == MAP_FAILED) {
+                if (ring->cq_ring != ring->sq_ring)
+                        munmap(ring->cq_ring, ring->cq_ring_len);
+                munmap(ring->sq_ring, ring->sq_ring_len);
+                close(fd);
+                return false;
+        }
+
+        char* sq = ring->sq_ring;
+        char* cq = ring->cq_ring;
+        ring->sq_head = (uint32_t*)(sq + params.sq_off.head);
+        ring->sq_tail = (uint32_t*)(sq + params.sq_off.tail);
+        ring->sq_mask = (uint32_t*)(sq + params.sq_off.ring_mask);
+        ring->sq_array = (uint32_t*)(sq + params.sq_off.array);
+        ring->cq_head = (uint32_t*)(cq + params.cq_off.head);
+        ring->cq_tail = (uint32_t*)(cq + params.cq_off.tail);
+        ring->cq_mask = (uint32_t*)(cq + params.cq_off.ring_mask);
+        ring->cqes = cq + params.cq_off.cqes;
+        return true;
+}
+
+static void
+aio_uring_close(Aio* aio) {
+        AioUring* ring = &aio->uring;
+        munmap(ring->sqes, ring->sqes_len);
+        if (ring->cq_ring != ring->sq_ring)
+                munmap(ring->cq_ring, ring->cq_ring_len);
+        munmap(ring->sq_ring, ring->sq_ring_len);
+        close(ring->fd);
+}
+
+static void
+aio_uring_enter(Aio* aio, uint32_t to_submit, uint32_t min_complete, uint32_t flags) {
+        while (syscall(__NR_io_uring_enter, aio->uring.fd, to_submit, min_complete, flags, NULL, 0) < 0) {
+                if (errno == EINTR || errno == EAGAIN)
+                        continue;
+                printf("Error submitting io_uring read: %d\n", errno);
+                exit(EXIT_FAILURE);
+        }
+}
+
+static void
+aio_uring_submit(Aio* aio, struct iovec* iov, int iovcnt, off_t offset, uint64_t tag) {
+        AioUring* ring = &aio->uring;
+        uint32_t tail = *ring->sq_tail;
+        uint32_t idx = tail & *ring->sq_mask;
+
+        struct io_uring_sqe* sqe = (struct io_uring_sqe*)ring->sqes + idx;
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_READV;
+        sqe->fd = aio->fd;
+        sqe->addr = (uint64_t)(uintptr_t)iov;
+        sqe->len = iovcnt;
+        sqe->off = offset;
+        sqe->user_data = tag;
+        ring->sq_array[idx] = idx;
+
+        // The kernel must see the entry before it sees the new tail.
+        __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+        aio_uring_enter(aio, 1, 0, 0);
+}
+
+static uint32_t
+aio_uring_reap(Aio* aio, AioCompletion* completions, uint32_t max, bool wait) {
+        AioUring* ring = &aio->uring;
+        uint32_t count = 0;
+        for (;;) {
+                uint32_t head = *ring->cq_head;
+                uint32_t tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+                while (head != tail && count < max) {
+                        struct io_uring_cqe* cqe = (struct io_uring_cqe*)ring->cqes + (head & *ring->cq_mask);
+                        completions[count].tag = cqe->user_data;
+                        completions[count].result = cqe->res;
+                        count++;
+                        head++;
+                }
+                __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+                if (count > 0 || !wait)
+                        return count;
+                aio_uring_enter(aio, 0, 1, IORING_ENTER_GETEVENTS);
+        }
+}
+#endif // AIO_HAVE_URING
+
+static void*
+aio_worker(void* arg) {
+        Aio* aio = arg;
+        AioPool* pool = &aio->pool;
+
+        pthread_mutex_lock(&pool->lock);
+        for (;;) {
+                while (!pool->stop && pool->pending_len == 0) pthread_cond_wait(&pool->work_cond, &pool->lock);
+                if (pool->pending_len == 0)
+                        break;
+
+                AioRequest request = pool->pending[pool->pending_head];
+                pool->pending_head = (pool->pending_head + 1) % AIO_DEPTH;
+                pool->pending_len--;
+                pthread_mutex_unlock(&pool->lock);
+
+                do {
+                        request.result = preadv(aio->fd, request.iov, request.iovcnt, request.offset);
+                } while (request.result == -1 && errno == EINTR);
+                if (request.result == -1)
+                        request.result = -errno;
+
+                pthread_mutex_lock(&pool->lock);
+                pool->done[(pool->done_head + pool->done_len) % AIO_DEPTH] = request;
+                pool->done_len++;
+                pthread_cond_signal(&pool->done_cond);
+        }
+        pthread_mutex_unlock(&pool->lock);
+        return NULL;
+}
+
+static void
+aio_pool_open(Aio* aio) {
+        AioPool* pool = &aio->pool;
+        pthread_mutex_init(&pool->lock, NULL);
+        pthread_cond_init(&pool->work_cond, NULL);
+        pthread_cond_init(&pool->done_cond, NULL);
+        for (int i = 0; i < AIO_THREADS; i++) {
+                if (pthread_create(&pool->threads[i], NULL, aio_worker, aio) != 0) {
+                        printf("Unable to start I/O thread\n");
+                        exit(EXIT_FAILURE);
+                }
+        }
+}
+
+static void
+aio_pool_close(Aio* aio) {
+        AioPool* pool = &aio->pool;
+        pthread_mutex_lock(&pool->lock);
+        pool->stop = true;
+        pthread_cond_broadcast(&pool->work_cond);
+        pthread_mutex_unlock(&pool->lock);
+        for (int i = 0; i < AIO_THREADS; i++) pthread_join(pool->threads[i], NULL);
+
+        pthread_cond_destroy(&pool->done_cond);
+        pthread_cond_destroy(&pool->work_cond);
+        pthread_mutex_destroy(&pool->lock);
+}
+
+static void
+aio_pool_submit(Aio* aio, struct iovec* iov, int iovcnt, off_t offset, uint64_t tag) {
+        AioPool* pool = &aio->pool;
+        pthread_mutex_lock(&pool->lock);
+        pool->pending[(pool->pending_head + pool->pending_len) % AIO_DEPTH] = (AioRequest){
+                .iov = iov,
+                .iovcnt = iovcnt,
+                .offset = offset,
+                .tag = tag,
+        };
+        pool->pending_len++;
+        pthread_cond_signal(&pool->work_cond);
+        pthread_mutex_unlock(&pool->lock);
+}
+
+static uint32_t
+aio_pool_reap(Aio* aio, AioCompletion* completions, uint32_t max, bool wait) {
+        AioPool* pool = &aio->pool;
+        uint32_t count = 0;
+        pthread_mutex_lock(&pool->lock);
+        while (wait && pool->done_len == 0) pthread_cond_wait(&pool->done_cond, &pool->lock);
+        while (pool->done_len > 0 && count < max) {
+                AioRequest* request = &pool->done[pool->done_head];
+                completions[count].tag = request->tag;
+                completions[count].result = request->result;
+                count++;
+                pool->done_head = (pool->done_head + 1) % AIO_DEPTH;
+                pool->done_len--;
+        }
+        pthread_mutex_unlock(&pool->lock);
+        return count;
+}
+
+Aio*
+aio_open(int fd, AioBackend backend) {
+        if (backend == AIO_BACKEND_OFF)
+                return NULL;
+
+        Aio* aio = calloc(1, sizeof(Aio));
+        aio->fd = fd;
+
+#ifdef AIO_HAVE_URING
+        if (backend != AIO_BACKEND_THREADS && aio_uring_open(aio)) {
+                aio->backend = AIO_BACKEND_URING;
+                return aio;
+        }
+#endif
+        if (backend == AIO_BACKEND_URING)
+                info("io_uring unavailable, reading ahead with %d threads", AIO_THREADS);
+
+        aio->backend = AIO_BACKEND_THREADS;
+        aio_pool_open(aio);
+        return aio;
+}
+
+void
+aio_close(Aio* aio) {
+        if (!aio)
+                return;
+#ifdef AIO_HAVE_URING
+        if (aio->backend == AIO_BACKEND_URING)
+                aio_uring_close(aio);
+#endif
+        if (aio->backend == AIO_BACKEND_THREADS)
+                aio_pool_close(aio);
+        free(aio);
+}
+
+bool
+aio_submit_read(Aio* aio, struct iovec* iov, int iovcnt, off_t offset, uint64_t tag) {
+        if (aio->in_flight == AIO_DEPTH)
+                return false;
+        aio->in_flight++;
+
+#ifdef AIO_HAVE_URING
+        if (aio->backend == AIO_BACKEND_URING) {
+                aio_uring_submit(aio, iov, iovcnt, offset, tag);
+                return true;
+        }
+#endif
+        aio_pool_submit(aio, iov, iovcnt, offset, tag);
+        return true;
+}
+
+uint32_t
+aio_reap(Aio* aio, AioCompletion* completions, uint32_t max, bool wait) {
+        if (aio->in_flight == 0)
+                return 0;
+
+        uint32_t count;
+#ifdef AIO_HAVE_URING
+        if (aio->backend == AIO_BACKEND_URING)
+                count = aio_uring_reap(aio, completions, max, wait);
+        else
+#endif
+                count = aio_pool_reap(aio, completions, max, wait);
+
+        aio->in_flight -= count;
+        return count;
+}
+
+const char*
+aio_backend_name(Aio* aio) {
+        if (!aio)
+                return "off";
+        return aio->backend == AIO_BACKEND_URING ? "io_uring" : "threads";
+}
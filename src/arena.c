@@ -0,0 +1,70 @@
+#include "arena.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define ARENA_ALIGN 8
+
+void
+arena_init(Arena* arena, size_t chunk_size) {
+        arena->head = NULL;
+        arena->current = NULL;
+        arena->allocated = 0;
+        arena->reserved = 0;
+        arena->chunk_size = chunk_size ? chunk_size : ARENA_CHUNK_SIZE;
+}
+
+/** @brief Append a chunk holding at least `size` bytes after the last one. */
+static ArenaChunk*
+arena_grow(Arena* arena, size_t size) {
+        size_t chunk_size = size > arena->chunk_size ? size : arena->chunk_size;
+        ArenaChunk* chunk = malloc(sizeof(ArenaChunk) + chunk_size);
+        if (!chunk) {
+                printf("Failed to allocate an arena chunk of %zu bytes\n", chunk_size);
+                exit(EXIT_FAILURE);
+        }
+        chunk->next = NULL;
+        chunk->size = chunk_size;
+        chunk->used = 0;
+
+        ArenaChunk** tail = &arena->head;
+        while (*tail) tail = &(*tail)->next;
+        *tail = chunk;
+        arena->reserved += chunk_size;
+        return chunk;
+}
+
+void*
+arena_alloc(Arena* arena, size_t size) {
+        size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+        // Chunks past `current` were kept by a reset, try them before asking the heap.
+        ArenaChunk* chunk = arena->current ? arena->current : arena->head;
+        while (chunk && chunk->size - chunk->used < size) chunk = chunk->next;
+        if (!chunk)
+                chunk = arena_grow(arena, size);
+
+        arena->current = chunk;
+        void* ptr = chunk->data + chunk->used;
+        chunk->used += size;
+        arena->allocated += size;
+        return ptr;
+}
+
+void
+arena_reset(Arena* arena) {
+        for (ArenaChunk* chunk = arena->head; chunk; chunk = chunk->next) chunk->used = 0;
+        arena->current = arena->head;
+        arena->allocated = 0;
+}
+
+void
+arena_free(Arena* arena) {
+        ArenaChunk* chunk = arena->head;
+        while (chunk) {
+                ArenaChunk* next = chunk->next;
+                free(chunk);
+                chunk = next;
+        }
+        arena_init(arena, arena->chunk_size);
+}
@@ -1,40 +1,59 @@
 #include "db.h"
 
-/** B-Tree Node Constants */
-const uint32_t BTREE_ORDER = 3; // Max children per node
+#include "metrics.h"
 
+/** B-Tree Node Constants */
 const uint32_t BTREE_NODE_TYPE_SIZE = sizeof(uint8_t); // Type of the node (leaf or internal)
 const uint32_t BTREE_NODE_TYPE_OFFSET = 0;
 
 const uint32_t BTREE_IS_ROOT_SIZE = sizeof(uint8_t);
 const uint32_t BTREE_IS_ROOT_OFFSET = BTREE_NODE_TYPE_SIZE;
+
+/*
+ * Nodes keep no parent pointer, splits find parents through the cursor's path. The field
+ * links the free list instead: the meta page holds its head and each free page the next
+ * one, 0 (the meta page, never free) ends it.
+ */
 const uint32_t BTREE_PARENT_POINTER_SIZE = sizeof(uint32_t);
 
 const uint32_t BTREE_PARENT_POINTER_OFFSET = BTREE_IS_ROOT_OFFSET + BTREE_IS_ROOT_SIZE;
 
 const uint8_t BTREE_COMMON_NODE_HEADER_SIZE = BTREE_NODE_TYPE_SIZE + BTREE_IS_ROOT_SIZE + BTREE_PARENT_POINTER_SIZE;
 
+/*
+ * Meta Page Layout
+ * The common header, its free list field heading the free list, followed by the root
+ * page of each secondary index or 0 where none was created.
+ */
+const uint32_t META_INDEX_ROOT_SIZE = sizeof(uint32_t);
+const uint32_t META_INDEX_ROOT_OFFSET = BTREE_COMMON_NODE_HEADER_SIZE;
+
 /** Leaf Node Constants  */
 const uint32_t LEAF_NODE_NUM_CELLS_SIZE = sizeof(uint32_t);
 const uint32_t LEAF_NODE_NUM_CELLS_OFFSET = BTREE_COMMON_NODE_HEADER_SIZE;
 const uint32_t LEAF_NODE_NEXT_LEAF_SIZE = sizeof(uint32_t);
 const uint32_t LEAF_NODE_NEXT_LEAF_OFFSET = LEAF_NODE_NUM_CELLS_OFFSET + LEAF_NODE_NUM_CELLS_SIZE;
+const uint32_t LEAF_NODE_CONTENT_START_SIZE = sizeof(uint32_t);
+const uint32_t LEAF_NODE_CONTENT_START_OFFSET = LEAF_NODE_NEXT_LEAF_OFFSET + LEAF_NODE_NEXT_LEAF_SIZE;
 const uint32_t LEAF_NODE_HEADER_SIZE = BTREE_COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELLS_SIZE +
-                                       LEAF_NODE_NEXT_LEAF_SIZE;
+                                       LEAF_NODE_NEXT_LEAF_SIZE + LEAF_NODE_CONTENT_START_SIZE;
 
 /*
  * Leaf Node Body Layout
+ * A slotted page: the keys of the rows form an array right after the header, followed by
+ * an array of the offset and size of each row's record, and records fill the page down
+ * from its end. Both arrays are in key order and grow by one entry per row; keeping the
+ * keys apart lets a search compare them a cache line at a time. Records sit wherever
+ * there was room.
  */
 const uint32_t LEAF_NODE_KEY_SIZE = sizeof(uint32_t);
-const uint32_t LEAF_NODE_KEY_OFFSET = 0;
-const uint32_t LEAF_NODE_VALUE_SIZE = SIZE_ROW;
-const uint32_t LEAF_NODE_VALUE_OFFSET = LEAF_NODE_KEY_OFFSET + LEAF_NODE_KEY_SIZE;
-const uint32_t LEAF_NODE_CELL_SIZE = LEAF_NODE_KEY_SIZE + LEAF_NODE_VALUE_SIZE;
+const uint32_t LEAF_NODE_RECORD_OFFSET_SIZE = sizeof(uint16_t);
+const uint32_t LEAF_NODE_RECORD_OFFSET_OFFSET = 0;
+const uint32_t LEAF_NODE_RECORD_SIZE_SIZE = sizeof(uint16_t);
+const uint32_t LEAF_NODE_RECORD_SIZE_OFFSET = LEAF_NODE_RECORD_OFFSET_OFFSET + LEAF_NODE_RECORD_OFFSET_SIZE;
+const uint32_t LEAF_NODE_RECORD_INFO_SIZE = LEAF_NODE_RECORD_OFFSET_SIZE + LEAF_NODE_RECORD_SIZE_SIZE;
+const uint32_t LEAF_NODE_SLOT_SIZE = LEAF_NODE_KEY_SIZE + LEAF_NODE_RECORD_INFO_SIZE; // Array bytes per row
 const uint32_t LEAF_NODE_SPACE_FOR_CELLS = PAGE_SIZE - LEAF_NODE_HEADER_SIZE;
-const uint32_t LEAF_NODE_MAX_CELLS = LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_CELL_SIZE;
-
-const uint32_t LEAF_NODE_RIGHT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) / 2;
-const uint32_t LEAF_NODE_LEFT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) - LEAF_NODE_RIGHT_SPLIT_COUNT;
 
 /*
  * Internal Node Header Layout
@@ -48,27 +67,28 @@ const uint32_t INTERNAL_NODE_HEADER_SIZE = BTREE_COMMON_NODE_HEADER_SIZE + INTER
 
 /*
  * Internal Node Body Layout
+ * An array of INTERNAL_NODE_MAX_CELLS keys, so a search reads them contiguously, then an
+ * array of as many children; child `i` holds the keys up to key `i` and the right child
+ * in the header those above the last key.
  */
 const uint32_t INTERNAL_NODE_KEY_SIZE = sizeof(uint32_t);
 const uint32_t INTERNAL_NODE_CHILD_SIZE = sizeof(uint32_t);
 const uint32_t INTERNAL_NODE_CELL_SIZE = INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEY_SIZE;
-const uint32_t INTERNAL_NODE_MAX_CELLS = 3;
-
-#define INVALID_PAGE_NUM UINT32_MAX
-
-void* get_page(Pager* pager, uint32_t page_num);
+const uint32_t INTERNAL_NODE_SPACE_FOR_CELLS = PAGE_SIZE - INTERNAL_NODE_HEADER_SIZE;
+const uint32_t INTERNAL_NODE_KEYS_OFFSET = INTERNAL_NODE_HEADER_SIZE;
 
-void intnode_split_and_insert(Table* table, uint32_t parent_page_num, uint32_t child_page_num);
-
-uint32_t*
-node_parent(void* node) {
-        return node + BTREE_PARENT_POINTER_OFFSET;
-}
+/*
+ * Internal nodes fill their page. Build with -DINTERNAL_NODE_MAX_KEYS=3 to make small
+ * tables split internal nodes, as the original layout did.
+ */
+#ifdef INTERNAL_NODE_MAX_KEYS
+const uint32_t INTERNAL_NODE_MAX_CELLS = INTERNAL_NODE_MAX_KEYS;
+#else
+const uint32_t INTERNAL_NODE_MAX_CELLS = (PAGE_SIZE - INTERNAL_NODE_HEADER_SIZE) / INTERNAL_NODE_CELL_SIZE;
+#endif
+const uint32_t INTERNAL_NODE_CHILDREN_OFFSET = INTERNAL_NODE_KEYS_OFFSET + INTERNAL_NODE_MAX_CELLS * INTERNAL_NODE_KEY_SIZE;
 
-uint32_t
-get_unused_page_num(Pager* pager) {
-        return pager->num_pages;
-}
+void intnode_split_and_insert(Cursor* cursor, uint32_t level, uint32_t separator, uint32_t new_child_page_num);
 
 NodeType
 get_node_type(void* node) {
@@ -82,18 +102,31 @@ set_node_type(void* node, NodeType type) {
         *((uint8_t*)(node + BTREE_NODE_TYPE_OFFSET)) = value;
 }
 
-void
+/**
+ * @brief Encode a row as its leaf record, returning the record's size.
+ * The username and email are stored with a one byte length prefix and no padding; the
+ * id is the key in the record's slot. `buffer` must hold ROW_MAX_RECORD_SIZE bytes.
+ */
+uint32_t
 serialize_row(Row* row, char* buffer) {
-        memcpy(buffer + OFS_ID, &row->id, SIZE_ID);
-        memcpy(buffer + OFS_UN, row->username, SIZE_UN);
-        memcpy(buffer + OFS_EM, row->email, SIZE_EM);
+        uint8_t username_len = strlen(row->username);
+        uint8_t email_len = strlen(row->email);
+        buffer[0] = username_len;
+        memcpy(buffer + 1, row->username, username_len);
+        buffer[1 + username_len] = email_len;
+        memcpy(buffer + 2 + username_len, row->email, email_len);
+        return 2 + username_len + email_len;
 }
 
 void
-deserialize_row(const char* buffer, Row* row) {
-        memcpy(&row->id, buffer + OFS_ID, SIZE_ID);
-        memcpy(row->username, buffer + OFS_UN, SIZE_UN);
-        memcpy(row->email, buffer + OFS_EM, SIZE_EM);
+deserialize_row(const char* buffer, uint32_t id, Row* row) {
+        uint8_t username_len = buffer[0];
+        uint8_t email_len = buffer[1 + username_len];
+        row->id = id;
+        memcpy(row->username, buffer + 1, username_len);
+        row->username[username_len] = '\0';
+        memcpy(row->email, buffer + 2 + username_len, email_len);
+        row->email[email_len] = '\0';
 }
 
 bool
@@ -108,14 +141,52 @@ set_node_root(void* node, bool is_root) {
         *((uint8_t*)(node + BTREE_IS_ROOT_OFFSET)) = value;
 }
 
-void*
-leafnode_cell(void* node, uint32_t cell_num) {
-        return (char*)node + LEAF_NODE_HEADER_SIZE + cell_num * LEAF_NODE_CELL_SIZE;
+uint32_t*
+node_free_list(void* node) {
+        return (uint32_t*)((char*)node + BTREE_PARENT_POINTER_OFFSET);
 }
 
-void*
-leafnode_val(void* node, uint32_t cell_num) {
-        return (char*)leafnode_cell(node, cell_num) + LEAF_NODE_VALUE_OFFSET;
+uint32_t*
+meta_index_root(void* node, IndexColumn column) {
+        return (uint32_t*)((char*)node + META_INDEX_ROOT_OFFSET + column * META_INDEX_ROOT_SIZE);
+}
+
+/**
+ * @brief Page for a new node, taken off the free list or else appended to the file.
+ * Must be called within a write transaction, the free list lives in the meta page and
+ * is shared by the table and its indexes.
+ */
+uint32_t
+get_unused_page_num(Table* table) {
+        Pager* pager = table->pager;
+        void* meta = get_page(pager, META_PAGE_NUM);
+        uint32_t page_num = *node_free_list(meta);
+        if (page_num == 0) {
+                pager_unpin(pager, META_PAGE_NUM);
+                return pager->num_pages;
+        }
+
+        void* page = get_page(pager, page_num);
+        meta = pager_mark_dirty(pager, META_PAGE_NUM);
+        *node_free_list(meta) = *node_free_list(page);
+        pager_unpin(pager, page_num);
+        pager_unpin(pager, META_PAGE_NUM);
+        return page_num;
+}
+
+/** @brief Put a page no node uses any more on the free list. */
+void
+free_page(Table* table, uint32_t page_num) {
+        Pager* pager = table->pager;
+        void* meta = get_page(pager, META_PAGE_NUM);
+        void* page = get_page(pager, page_num);
+        meta = pager_mark_dirty(pager, META_PAGE_NUM);
+        page = pager_mark_dirty(pager, page_num);
+        set_node_type(page, NODE_FREE);
+        *node_free_list(page) = *node_free_list(meta);
+        *node_free_list(meta) = page_num;
+        pager_unpin(pager, page_num);
+        pager_unpin(pager, META_PAGE_NUM);
 }
 
 uint32_t*
@@ -123,9 +194,42 @@ leafnode_num_cells(void* node) {
         return (uint32_t*)((char*)node + LEAF_NODE_NUM_CELLS_OFFSET);
 }
 
+/** @brief The keys of the rows in order, right after the header. */
+uint32_t*
+leafnode_keys(void* node) {
+        return (uint32_t*)((char*)node + LEAF_NODE_HEADER_SIZE);
+}
+
+/** @brief Record offset and size of the `cell_num`th row, in the array after the keys. */
+static char*
+leafnode_record_info(void* node, uint32_t cell_num) {
+        return (char*)(leafnode_keys(node) + *leafnode_num_cells(node)) + cell_num * LEAF_NODE_RECORD_INFO_SIZE;
+}
+
+uint16_t*
+leafnode_record_offset(void* node, uint32_t cell_num) {
+        return (uint16_t*)(leafnode_record_info(node, cell_num) + LEAF_NODE_RECORD_OFFSET_OFFSET);
+}
+
+uint16_t*
+leafnode_record_size(void* node, uint32_t cell_num) {
+        return (uint16_t*)(leafnode_record_info(node, cell_num) + LEAF_NODE_RECORD_SIZE_OFFSET);
+}
+
+void*
+leafnode_val(void* node, uint32_t cell_num) {
+        return (char*)node + *leafnode_record_offset(node, cell_num);
+}
+
+/** @brief Start of the record area, records are packed from here to the end of the page. */
+uint32_t*
+leafnode_content_start(void* node) {
+        return (uint32_t*)((char*)node + LEAF_NODE_CONTENT_START_OFFSET);
+}
+
 uint32_t*
 leafnode_get_key(void* node, uint32_t cell_num) {
-        return leafnode_cell(node, cell_num);
+        return leafnode_keys(node) + cell_num;
 }
 
 uint32_t*
@@ -143,9 +247,10 @@ intnode_right_child(void* node) {
         return node + INTERNAL_NODE_RIGHT_CHILD_OFFSET;
 }
 
+/** @brief Child `child_num` below the right child, see intnode_get_child() for a checked lookup. */
 uint32_t*
-intnode_cell(void* node, uint32_t cell_num) {
-        return node + INTERNAL_NODE_HEADER_SIZE + cell_num * INTERNAL_NODE_CELL_SIZE;
+intnode_child(void* node, uint32_t child_num) {
+        return (uint32_t*)((char*)node + INTERNAL_NODE_CHILDREN_OFFSET) + child_num;
 }
 
 void
@@ -154,6 +259,74 @@ new_leafnode(void* node) {
         set_node_root(node, false);
         *leafnode_num_cells(node) = 0;
         *leafnode_next_leaf(node) = 0; // No next leaf node
+        *leafnode_content_start(node) = PAGE_SIZE;
+}
+
+/** @brief Bytes between the key and record info arrays and the records, where a new row goes. */
+static uint32_t
+leafnode_free_space(void* node) {
+        return *leafnode_content_start(node) - LEAF_NODE_HEADER_SIZE - *leafnode_num_cells(node) * LEAF_NODE_SLOT_SIZE;
+}
+
+/** @brief Array and record bytes of the rows in the leaf, not counting gaps between records. */
+static uint32_t
+leafnode_used_space(void* node) {
+        uint32_t num_cells = *leafnode_num_cells(node);
+        uint32_t used = num_cells * LEAF_NODE_SLOT_SIZE;
+        for (uint32_t i = 0; i < num_cells; i++) used += *leafnode_record_size(node, i);
+        return used;
+}
+
+/** @brief Whether a record of `size` bytes fits, once gaps between records are closed if need be. */
+static bool
+leafnode_has_room(void* node, uint32_t size) {
+        uint32_t needed = size + LEAF_NODE_SLOT_SIZE;
+        if (leafnode_free_space(node) >= needed)
+                return true;
+        return LEAF_NODE_SPACE_FOR_CELLS - leafnode_used_space(node) >= needed;
+}
+
+/** @brief Pack the records against the end of the page, closing the gaps between them. */
+static void
+leafnode_compact(void* node) {
+        char scratch[PAGE_SIZE];
+        memcpy(scratch, node, PAGE_SIZE);
+
+        uint32_t content = PAGE_SIZE;
+        uint32_t num_cells = *leafnode_num_cells(node);
+        for (uint32_t i = 0; i < num_cells; i++) {
+                uint32_t size = *leafnode_record_size(scratch, i);
+                content -= size;
+                memcpy((char*)node + content, leafnode_val(scratch, i), size);
+                *leafnode_record_offset(node, i) = content;
+        }
+        *leafnode_content_start(node) = content;
+}
+
+/**
+ * @brief Add a record as the `cell_num`th row of the leaf.
+ * The caller has made sure leafnode_free_space() covers the record and its slot.
+ */
+static void
+leafnode_put(void* node, uint32_t cell_num, uint32_t key, const char* record, uint32_t size) {
+        uint32_t num_cells = *leafnode_num_cells(node);
+        uint32_t content = *leafnode_content_start(node) - size;
+        memcpy((char*)node + content, record, size);
+
+        /* The record info array moves up a key to make room for it, opening a gap at cell_num in both */
+        uint32_t* keys = leafnode_keys(node);
+        char* info = (char*)(keys + num_cells);
+        char* new_info = info + LEAF_NODE_KEY_SIZE;
+        memmove(new_info + (cell_num + 1) * LEAF_NODE_RECORD_INFO_SIZE, info + cell_num * LEAF_NODE_RECORD_INFO_SIZE,
+                (num_cells - cell_num) * LEAF_NODE_RECORD_INFO_SIZE);
+        memmove(new_info, info, cell_num * LEAF_NODE_RECORD_INFO_SIZE);
+        memmove(keys + cell_num + 1, keys + cell_num, (num_cells - cell_num) * LEAF_NODE_KEY_SIZE);
+
+        keys[cell_num] = key;
+        *leafnode_num_cells(node) = num_cells + 1;
+        *leafnode_record_offset(node, cell_num) = content;
+        *leafnode_record_size(node, cell_num) = size;
+        *leafnode_content_start(node) = content;
 }
 
 void
@@ -166,65 +339,13 @@ new_intnode(void* node) {
 
 uint32_t*
 intnode_key(void* node, uint32_t key_num) {
-        return (void*)intnode_cell(node, key_num) + INTERNAL_NODE_CHILD_SIZE;
-}
-
-uint32_t
-get_node_max_key(Pager* pager, void* node) {
-        /** 
-         * Internal nodes maximum key is the far right key
-         * Leaf nodes maximum key is the last key 
-         */
-        if (get_node_type(node) == NODE_LEAF) {
-                return *leafnode_get_key(node, *leafnode_num_cells(node) - 1);
-        }
-        void* right_child = get_page(pager, *intnode_right_child(node));
-        return get_node_max_key(pager, right_child);
-}
-
-Cursor*
-leafnode_find(Table* table, uint32_t page_num, uint32_t key) {
-        void* node = get_page(table->pager, page_num);
-        uint32_t len = *leafnode_num_cells(node);
-
-        Cursor* cursor = malloc(sizeof(Cursor));
-        cursor->table = table;
-        cursor->page_num = page_num;
-
-        uint32_t l = 0;
-        uint32_t r = len;
-
-        while (r != l) {
-                uint32_t m = (l + r) / 2;
-                uint32_t found = *leafnode_get_key(node, m);
-                if (key == found) {
-                        cursor->cell_num = m;
-                        return cursor;
-                } else if (key < found) {
-                        r = m;
-                } else {
-                        l = m + 1;
-                }
-        }
-        cursor->cell_num = l;
-        return cursor;
+        return (uint32_t*)((char*)node + INTERNAL_NODE_KEYS_OFFSET) + key_num;
 }
 
 uint32_t
 intnode_find_child(void* node, uint32_t key) {
-        /** Return the index of the child which should contain the given key. */
-        uint32_t num_keys = *intnode_num_keys(node);
-        uint32_t l = 0;
-        uint32_t r = num_keys; /* there is one more child than key */
-        while (l != r) {
-                uint32_t m = (l + r) / 2;
-                if (*intnode_key(node, m) >= key)
-                        r = m;
-                else
-                        l = m + 1;
-        }
-
-        return l;
+        /** Return the index of the child which should contain the given key, the right child past the last key. */
+        return keys_lower_bound(intnode_key(node, 0), *intnode_num_keys(node), key);
 }
 
 uint32_t*
@@ -243,7 +364,7 @@ intnode_get_child(void* node, uint32_t child_num) {
                 }
                 return right_child;
         } else {
-                uint32_t* child = intnode_cell(node, child_num);
+                uint32_t* child = intnode_child(node, child_num);
                 if (*child == INVALID_PAGE_NUM) {
                         printf("Tried to access child %d of node, but was invalid page\n", child_num);
                         exit(EXIT_FAILURE);
@@ -252,270 +373,497 @@ intnode_get_child(void* node, uint32_t child_num) {
         }
 }
 
+/**
+ * @brief Add `new_child_page_num` as the right sibling of a child that just split.
+ * The split child is the one the cursor descended through at `cursor->path[level]`,
+ * `separator` is the largest key left in it. The sibling takes over the child's old
+ * key (or its place as right child), so no subtree has to be searched for its maximum.
+ * The rest of the path supplies the grandparent should the node have to split.
+ */
 void
-intnode_insert(Table* table, uint32_t parent_page_num, uint32_t child_page_num) {
-        /*
-        Add a new child/key pair to parent that corresponds to child
-        */
-        void* parent = get_page(table->pager, parent_page_num);
-        void* child = get_page(table->pager, child_page_num);
-
-        uint32_t child_max_key = get_node_max_key(table->pager, child);
-        uint32_t index = intnode_find_child(parent, child_max_key);
-
-        uint32_t original_num_keys = *intnode_num_keys(parent);
-        *intnode_num_keys(parent) = original_num_keys + 1;
-
-        if (original_num_keys >= INTERNAL_NODE_MAX_CELLS) {
-                intnode_split_and_insert(table, parent_page_num, child_page_num);
+intnode_insert(Cursor* cursor, uint32_t level, uint32_t separator, uint32_t new_child_page_num) {
+        Pager* pager = cursor->table->pager;
+        uint32_t parent_page_num = cursor->path[level];
+        uint32_t index = cursor->path_child[level];
+        void* parent = get_page(pager, parent_page_num);
+        uint32_t num_keys = *intnode_num_keys(parent);
+
+        if (num_keys >= INTERNAL_NODE_MAX_CELLS) {
+                pager_unpin(pager, parent_page_num);
+                intnode_split_and_insert(cursor, level, separator, new_child_page_num);
                 return;
         }
 
-        uint32_t right_child_page_num = *intnode_right_child(parent);
-        void* right_child = get_page(table->pager, right_child_page_num);
-
-        if (child_max_key > get_node_max_key(table->pager, right_child)) {
-                /* Replace right child */
-                *intnode_get_child(parent, original_num_keys) = right_child_page_num;
-                *intnode_key(parent, original_num_keys) = get_node_max_key(table->pager, right_child);
-                *intnode_right_child(parent) = child_page_num;
+        parent = pager_mark_dirty(pager, parent_page_num);
+        if (index == num_keys) {
+                /* The split child was the right child, the sibling replaces it */
+                *intnode_child(parent, num_keys) = *intnode_right_child(parent);
+                *intnode_key(parent, num_keys) = separator;
+                *intnode_right_child(parent) = new_child_page_num;
         } else {
-                /* Make room for the new cell */
-                for (uint32_t i = original_num_keys; i > index; i--) {
-                        void* destination = intnode_cell(parent, i);
-                        void* source = intnode_cell(parent, i - 1);
-                        memcpy(destination, source, INTERNAL_NODE_CELL_SIZE);
-                }
-                *intnode_get_child(parent, index) = child_page_num;
-                *intnode_key(parent, index) = child_max_key;
+                /* Make room for the new cell, the sibling inherits the child's key */
+                memmove(intnode_key(parent, index + 1), intnode_key(parent, index),
+                        (num_keys - index) * INTERNAL_NODE_KEY_SIZE);
+                memmove(intnode_child(parent, index + 1), intnode_child(parent, index),
+                        (num_keys - index) * INTERNAL_NODE_CHILD_SIZE);
+                *intnode_key(parent, index) = separator;
+                *intnode_child(parent, index + 1) = new_child_page_num;
         }
+        *intnode_num_keys(parent) = num_keys + 1;
+        pager_unpin(pager, parent_page_num);
 }
 
+/**
+ * @brief Turn the root into an internal node over its old contents and a new right child.
+ * The root stays on its page, its contents move to a new left child. `separator` is the
+ * largest key in the left child.
+ */
 void
-update_internal_node_key(void* node, uint32_t old_key, uint32_t new_key) {
-        uint32_t old_child_index = intnode_find_child(node, old_key);
-        *intnode_key(node, old_child_index) = new_key;
-}
-
-
-
-void
-create_new_root(Table* table, uint32_t right_child_page_num) {
-        void* root = get_page(table->pager, table->root_page);
-        void* right_child = get_page(table->pager, right_child_page_num);
-        uint32_t left_child_page_num = get_unused_page_num(table->pager);
-        void* left_child = get_page(table->pager, left_child_page_num);
+create_new_root(Table* table, uint32_t separator, uint32_t right_child_page_num) {
+        Pager* pager = table->pager;
+        void* root = get_page(pager, table->root_page);
+        uint32_t left_child_page_num = get_unused_page_num(table);
+        void* left_child = get_page(pager, left_child_page_num);
+        root = pager_mark_dirty(pager, table->root_page);
+        left_child = pager_mark_dirty(pager, left_child_page_num);
 
-        if (get_node_type(root) == NODE_INTERNAL) {
-                new_intnode(right_child);
-                new_intnode(left_child);
-        }
-        /* Left child has data copied from old root */
+        /* Left child has data copied from old root, the right child is already filled in */
         memcpy(left_child, root, PAGE_SIZE);
         set_node_root(left_child, false);
+        *node_free_list(left_child) = 0;
 
-        if (get_node_type(left_child) == NODE_INTERNAL) {
-                void* child;
-                for (int i = 0; i < *intnode_num_keys(left_child); i++) {
-                        child = get_page(table->pager, *intnode_get_child(left_child, i));
-                        *node_parent(child) = left_child_page_num;
-                }
-                child = get_page(table->pager, *intnode_right_child(left_child));
-                *node_parent(child) = left_child_page_num;
-        }
         /* Root node is a new internal node with one key and two children */
         new_intnode(root);
         set_node_root(root, true);
         *intnode_num_keys(root) = 1;
         *intnode_get_child(root, 0) = left_child_page_num;
-        uint32_t left_child_max_key = get_node_max_key(table->pager, left_child);
-        *intnode_key(root, 0) = left_child_max_key;
+        *intnode_key(root, 0) = separator;
         *intnode_right_child(root) = right_child_page_num;
-        *node_parent(left_child) = table->root_page;
-        *node_parent(right_child) = table->root_page;
-}
-
-void
-intnode_split_and_insert(Table* table, uint32_t parent_page_num, uint32_t child_page_num) {
-        uint32_t old_page_num = parent_page_num;
-        void* old_node = get_page(table->pager, parent_page_num);
-        uint32_t old_max = get_node_max_key(table->pager, old_node);
-        void* child = get_page(table->pager, child_page_num);
-        uint32_t child_max = get_node_max_key(table->pager, child);
-        uint32_t new_page_num = get_unused_page_num(table->pager);
-        uint32_t splitting_root = is_node_root(old_node);
-
-        void* parent;
-        void* new_node;
-        if (splitting_root) {
-                create_new_root(table, new_page_num);
-                parent = get_page(table->pager, table->root_page);
-                old_page_num = *intnode_get_child(parent, 0);
-                old_node = get_page(table->pager, old_page_num);
-        } else {
-                parent = get_page(table->pager, *node_parent(old_node));
-                new_node = get_page(table->pager, new_page_num);
-                new_intnode(new_node);
-        }
-
-        uint32_t* old_num_keys = intnode_num_keys(old_node);
-        uint32_t cur_page_num = *intnode_right_child(old_node);
-        void* cur = get_page(table->pager, cur_page_num);
-
-        intnode_insert(table, new_page_num, cur_page_num);
-        *node_parent(cur) = new_page_num;
-        *intnode_right_child(old_node) = INVALID_PAGE_NUM;
-        for (int i = INTERNAL_NODE_MAX_CELLS - 1; i > INTERNAL_NODE_MAX_CELLS / 2; i--) {
-                cur_page_num = *intnode_get_child(old_node, i);
-                cur = get_page(table->pager, cur_page_num);
-                intnode_insert(table, new_page_num, cur_page_num);
-                *node_parent(cur) = new_page_num;
-                (*old_num_keys)--;
-        }
 
-        *intnode_right_child(old_node) = *intnode_get_child(old_node, *old_num_keys - 1);
-        (*old_num_keys)--;
-
-        uint32_t max_after_split = get_node_max_key(table->pager, old_node);
-
-        uint32_t destination_page_num = child_max < max_after_split ? old_page_num : new_page_num;
-
-        intnode_insert(table, destination_page_num, child_page_num);
-        *node_parent(child) = destination_page_num;
-
-        update_internal_node_key(parent, old_max, get_node_max_key(table->pager, old_node));
+        pager_unpin(pager, left_child_page_num);
+        pager_unpin(pager, table->root_page);
+}
 
-        if (!splitting_root) {
-                intnode_insert(table, *node_parent(old_node), new_page_num);
-                *node_parent(new_node) = *node_parent(old_node);
+/**
+ * @brief Lay out `num_cells` children given as child/key pairs in key order.
+ * The last child becomes the right child, its key is ignored.
+ */
+static void
+intnode_fill(void* node, const uint32_t* cells, uint32_t num_cells) {
+        for (uint32_t i = 0; i + 1 < num_cells; i++) {
+                *intnode_child(node, i) = cells[2 * i];
+                *intnode_key(node, i) = cells[2 * i + 1];
         }
+        *intnode_num_keys(node) = num_cells - 1;
+        *intnode_right_child(node) = cells[2 * (num_cells - 1)];
 }
 
-Cursor*
-intnode_find(Table* table, uint32_t page_num, uint32_t key) {
-        void* node = get_page(table->pager, page_num);
-        uint32_t child_index = intnode_find_child(node, key);
-        uint32_t child_num = *intnode_get_child(node, child_index);
-        void* child = get_page(table->pager, child_num);
-        switch (get_node_type(child)) {
-                case NODE_LEAF: return leafnode_find(table, child_num, key);
-                case NODE_INTERNAL: return intnode_find(table, child_num, key);
+/** @brief Copy the node's children below the right child out as child/key pairs, see intnode_fill(). */
+static void
+intnode_cells(void* node, uint32_t* cells) {
+        uint32_t num_keys = *intnode_num_keys(node);
+        for (uint32_t i = 0; i < num_keys; i++) {
+                cells[2 * i] = *intnode_child(node, i);
+                cells[2 * i + 1] = *intnode_key(node, i);
         }
 }
 
+/**
+ * @brief Split the full internal node at `cursor->path[level]` while adding a new child.
+ * The node's cells and its right child are laid out in a scratch buffer with the new
+ * cell inserted as in intnode_insert(); the lower half goes back into the node and the
+ * upper half is laid out in a new right sibling. Nodes keep no parent
+ * pointers, so moving children touches no other page. The key of the left half's last
+ * cell becomes the separator added one level up the path, which may split in turn.
+ */
+void
+intnode_split_and_insert(Cursor* cursor, uint32_t level, uint32_t separator, uint32_t new_child_page_num) {
+        METRIC_INC(internal_splits);
+        Table* table = cursor->table;
+        Pager* pager = table->pager;
+        uint32_t old_page_num = cursor->path[level];
+        uint32_t index = cursor->path_child[level];
+        void* old_node = get_page(pager, old_page_num);
+        uint32_t num_keys = *intnode_num_keys(old_node);
+
+        /* All children in key order, the last one (the right child) has no key */
+        uint32_t num_cells = num_keys + 2;
+        uint32_t cells[2 * (INTERNAL_NODE_MAX_CELLS + 2)];
+        intnode_cells(old_node, cells);
+        cells[2 * num_keys] = *intnode_right_child(old_node);
+        memmove(&cells[2 * (index + 1)], &cells[2 * index], (num_keys + 1 - index) * INTERNAL_NODE_CELL_SIZE);
+        cells[2 * index + 1] = separator;
+        cells[2 * (index + 1)] = new_child_page_num;
+
+        /* Appends only ever add to the right edge, leave the new sibling a single key */
+        uint32_t left_cells = num_cells / 2;
+        if (cursor->append && index == num_keys && num_cells > 3)
+                left_cells = num_cells - 2;
+        uint32_t right_cells = num_cells - left_cells;
+        uint32_t left_max = cells[2 * (left_cells - 1) + 1];
+
+        old_node = pager_mark_dirty(pager, old_page_num);
+        intnode_fill(old_node, cells, left_cells);
+
+        uint32_t new_page_num = get_unused_page_num(table);
+        void* new_node = get_page(pager, new_page_num);
+        new_node = pager_mark_dirty(pager, new_page_num);
+        new_intnode(new_node);
+        intnode_fill(new_node, &cells[2 * left_cells], right_cells);
+
+        pager_unpin(pager, new_page_num);
+        pager_unpin(pager, old_page_num);
+
+        if (level == 0)
+                create_new_root(table, left_max, new_page_num);
+        else
+                intnode_insert(cursor, level - 1, left_max, new_page_num);
+}
 
-
+/**
+ * @brief Split a leaf that has no room for a new row.
+ * The rows and the new one are laid out again across the leaf and a new right sibling,
+ * cut where the bytes of both halves balance since records vary in size.
+ */
 void
-leaf_node_split_and_insert(Cursor* cursor, uint32_t key, Row* value) {
+leaf_node_split_and_insert(Cursor* cursor, uint32_t key, const char* record, uint32_t size) {
         dblog("leaf_node_split_and_insert()");
+        METRIC_INC(leaf_splits);
+
+        Table* table = cursor->table;
+        Pager* pager = table->pager;
+        void* old_node = get_page(pager, cursor->page_num);
+        uint32_t new_page_num = get_unused_page_num(table);
+        void* new_node = get_page(pager, new_page_num);
+        old_node = pager_mark_dirty(pager, cursor->page_num);
+        new_node = pager_mark_dirty(pager, new_page_num);
+
+        /*
+         * A key past the end of the rightmost leaf is an append: the old leaf stays full
+         * and the new one starts with the key alone, so increasing ids leave full pages
+         * behind instead of half empty ones.
+         */
+        uint32_t num_cells = *leafnode_num_cells(old_node);
+        bool rightmost = *leafnode_next_leaf(old_node) == 0;
+        cursor->append = rightmost && cursor->cell_num == num_cells;
 
-        void* old_node = get_page(cursor->table->pager, cursor->page_num);
-        uint32_t old_max = get_node_max_key(cursor->table->pager, old_node);
-        uint32_t new_page_num = get_unused_page_num(cursor->table->pager);
-        void* new_node = get_page(cursor->table->pager, new_page_num);
         new_leafnode(new_node);
-        *node_parent(new_node) = *node_parent(old_node);
         *leafnode_next_leaf(new_node) = *leafnode_next_leaf(old_node);
         *leafnode_next_leaf(old_node) = new_page_num;
 
-        for (int32_t i = LEAF_NODE_MAX_CELLS; i >= 0; i--) {
-                void* destination_node;
-                if (i >= LEAF_NODE_LEFT_SPLIT_COUNT) {
-                        destination_node = new_node;
-                } else {
-                        destination_node = old_node;
-                }
-                uint32_t index_within_node = i % LEAF_NODE_LEFT_SPLIT_COUNT;
-                void* destination = leafnode_cell(destination_node, index_within_node);
-
-                if (i == cursor->cell_num) {
-                        serialize_row(value, leafnode_val(destination_node, index_within_node));
-                        *leafnode_get_key(destination_node, index_within_node) = key;
-                } else if (i > cursor->cell_num) {
-                        memcpy(destination, leafnode_cell(old_node, i - 1), LEAF_NODE_CELL_SIZE);
-                } else {
-                        memcpy(destination, leafnode_cell(old_node, i), LEAF_NODE_CELL_SIZE);
+        if (cursor->append) {
+                leafnode_put(new_node, 0, key, record, size);
+        } else {
+                char scratch[PAGE_SIZE];
+                memcpy(scratch, old_node, PAGE_SIZE);
+                *leafnode_num_cells(old_node) = 0;
+                *leafnode_content_start(old_node) = PAGE_SIZE;
+
+                uint32_t total = size + LEAF_NODE_SLOT_SIZE;
+                for (uint32_t i = 0; i < num_cells; i++) total += *leafnode_record_size(scratch, i) + LEAF_NODE_SLOT_SIZE;
+
+                uint32_t placed = 0;
+                for (uint32_t i = 0; i <= num_cells; i++) {
+                        uint32_t cell_key = key;
+                        const char* cell_record = record;
+                        uint32_t cell_size = size;
+                        if (i != cursor->cell_num) {
+                                uint32_t from = i < cursor->cell_num ? i : i - 1;
+                                cell_key = *leafnode_get_key(scratch, from);
+                                cell_record = leafnode_val(scratch, from);
+                                cell_size = *leafnode_record_size(scratch, from);
+                        }
+                        void* destination_node = placed < total / 2 ? old_node : new_node;
+                        leafnode_put(destination_node, *leafnode_num_cells(destination_node), cell_key, cell_record,
+                                     cell_size);
+                        placed += cell_size + LEAF_NODE_SLOT_SIZE;
                 }
         }
-        /* Update cell count on both leaf nodes */
-        *(leafnode_num_cells(old_node)) = LEAF_NODE_LEFT_SPLIT_COUNT;
-        *(leafnode_num_cells(new_node)) = LEAF_NODE_RIGHT_SPLIT_COUNT;
-        if (is_node_root(old_node)) {
-                return create_new_root(cursor->table, new_page_num);
-        } else {
-                uint32_t parent_page_num = *node_parent(old_node);
-                uint32_t new_max = get_node_max_key(cursor->table->pager, new_node);
-                void* parent = get_page(cursor->table->pager, parent_page_num);
-                update_internal_node_key(parent, old_max, new_max);
-                intnode_insert(cursor->table, parent_page_num, new_page_num);
+
+        if (rightmost) {
+                table->right_leaf = new_page_num;
+                table->right_max = *leafnode_get_key(new_node, *leafnode_num_cells(new_node) - 1);
+        }
+
+        uint32_t separator = *leafnode_get_key(old_node, *leafnode_num_cells(old_node) - 1);
+        pager_unpin(pager, new_page_num);
+        pager_unpin(pager, cursor->page_num);
+
+        if (cursor->depth == 0)
+                create_new_root(table, separator, new_page_num);
+        else
+                intnode_insert(cursor, cursor->depth - 1, separator, new_page_num);
+}
+
+/** @brief Add a record of at most ROW_MAX_RECORD_SIZE bytes at the cursor, splitting the leaf if it is full. */
+static void
+leafnode_insert_record(Cursor* cursor, uint32_t key, const char* record, uint32_t size) {
+        Pager* pager = cursor->table->pager;
+        void* node = get_page(pager, cursor->page_num);
+
+        if (!leafnode_has_room(node, size)) {
+                // Node full
+                pager_unpin(pager, cursor->page_num);
+                leaf_node_split_and_insert(cursor, key, record, size);
                 return;
         }
+
+        node = pager_mark_dirty(pager, cursor->page_num);
+        if (leafnode_free_space(node) < size + LEAF_NODE_SLOT_SIZE)
+                leafnode_compact(node);
+        leafnode_put(node, cursor->cell_num, key, record, size);
+
+        if (*leafnode_next_leaf(node) == 0) {
+                uint32_t num_cells = *leafnode_num_cells(node);
+                cursor->table->right_leaf = cursor->page_num;
+                cursor->table->right_max = *leafnode_get_key(node, num_cells - 1);
+        }
+        pager_unpin(pager, cursor->page_num);
 }
 
 void
 leafnode_insert(Cursor* cursor, uint32_t key, Row* value) {
-        void* node = get_page(cursor->table->pager, cursor->page_num);
+        char record[ROW_MAX_RECORD_SIZE];
+        uint32_t size = serialize_row(value, record);
+        leafnode_insert_record(cursor, key, record, size);
+}
 
+/** @brief Drop the `cell_num`th row, its record is left as a gap until the leaf is compacted. */
+static void
+leafnode_remove(void* node, uint32_t cell_num) {
         uint32_t num_cells = *leafnode_num_cells(node);
-        if (num_cells >= LEAF_NODE_MAX_CELLS) {
-                // Node full
-                leaf_node_split_and_insert(cursor, key, value);
-                return;
+        if (*leafnode_record_offset(node, cell_num) == *leafnode_content_start(node))
+                *leafnode_content_start(node) += *leafnode_record_size(node, cell_num);
+
+        /* Close the gap in both arrays, the record info array moves down a key */
+        uint32_t* keys = leafnode_keys(node);
+        char* info = (char*)(keys + num_cells);
+        char* new_info = info - LEAF_NODE_KEY_SIZE;
+        memmove(keys + cell_num, keys + cell_num + 1, (num_cells - cell_num - 1) * LEAF_NODE_KEY_SIZE);
+        memmove(new_info, info, cell_num * LEAF_NODE_RECORD_INFO_SIZE);
+        memmove(new_info + cell_num * LEAF_NODE_RECORD_INFO_SIZE, info + (cell_num + 1) * LEAF_NODE_RECORD_INFO_SIZE,
+                (num_cells - cell_num - 1) * LEAF_NODE_RECORD_INFO_SIZE);
+        *leafnode_num_cells(node) = num_cells - 1;
+}
+
+/**
+ * @brief Drop the key between children `index` and `index + 1` after they were merged.
+ * The merged node is child `index` and takes over the right one's key (or its place as
+ * right child), which bounds the keys of both.
+ */
+static void
+intnode_remove(void* node, uint32_t index) {
+        uint32_t num_keys = *intnode_num_keys(node);
+        if (index + 1 == num_keys) {
+                *intnode_right_child(node) = *intnode_child(node, index);
+        } else {
+                *intnode_key(node, index) = *intnode_key(node, index + 1);
+                memmove(intnode_key(node, index + 1), intnode_key(node, index + 2),
+                        (num_keys - index - 2) * INTERNAL_NODE_KEY_SIZE);
+                memmove(intnode_child(node, index + 1), intnode_child(node, index + 2),
+                        (num_keys - index - 2) * INTERNAL_NODE_CHILD_SIZE);
         }
+        *intnode_num_keys(node) = num_keys - 1;
+}
 
-        if (cursor->cell_num < num_cells) {
-                // Make room for new cell
-                for (uint32_t i = num_cells; i > cursor->cell_num; i--) {
-                        memcpy(leafnode_cell(node, i), leafnode_cell(node, i - 1), LEAF_NODE_CELL_SIZE);
+/**
+ * @brief Merge two adjacent leaves, or share their rows out evenly if they do not fit in one.
+ * The leaves are children `index` and `index + 1` of `parent`, which is dirty. Returns
+ * true if the right leaf was merged into the left one and freed.
+ */
+static bool
+leafnode_rebalance(Table* table, void* parent, uint32_t index) {
+        Pager* pager = table->pager;
+        uint32_t left_page_num = *intnode_get_child(parent, index);
+        uint32_t right_page_num = *intnode_get_child(parent, index + 1);
+        void* left = get_page(pager, left_page_num);
+        void* right = get_page(pager, right_page_num);
+        left = pager_mark_dirty(pager, left_page_num);
+        right = pager_mark_dirty(pager, right_page_num);
+
+        char scratch[2][PAGE_SIZE];
+        memcpy(scratch[0], left, PAGE_SIZE);
+        memcpy(scratch[1], right, PAGE_SIZE);
+        uint32_t total = leafnode_used_space(left) + leafnode_used_space(right);
+        bool merge = total <= LEAF_NODE_SPACE_FOR_CELLS;
+
+        *leafnode_num_cells(left) = 0;
+        *leafnode_content_start(left) = PAGE_SIZE;
+        *leafnode_num_cells(right) = 0;
+        *leafnode_content_start(right) = PAGE_SIZE;
+
+        uint32_t placed = 0;
+        for (uint32_t i = 0; i < 2; i++) {
+                uint32_t num_cells = *leafnode_num_cells(scratch[i]);
+                for (uint32_t j = 0; j < num_cells; j++) {
+                        void* destination_node = merge || placed < total / 2 ? left : right;
+                        uint32_t size = *leafnode_record_size(scratch[i], j);
+                        leafnode_put(destination_node, *leafnode_num_cells(destination_node),
+                                     *leafnode_get_key(scratch[i], j), leafnode_val(scratch[i], j), size);
+                        placed += size + LEAF_NODE_SLOT_SIZE;
                 }
         }
 
-        *(leafnode_num_cells(node)) += 1;
-        *(leafnode_get_key(node, cursor->cell_num)) = key;
-        serialize_row(value, leafnode_val(node, cursor->cell_num));
+        if (merge) {
+                *leafnode_next_leaf(left) = *leafnode_next_leaf(right);
+                intnode_remove(parent, index);
+        } else {
+                *intnode_key(parent, index) = *leafnode_get_key(left, *leafnode_num_cells(left) - 1);
+        }
+        pager_unpin(pager, right_page_num);
+        pager_unpin(pager, left_page_num);
+
+        if (merge)
+                free_page(table, right_page_num);
+        return merge;
 }
 
-Pager*
-new_pager(const char* filename) {
-        int fd = open(filename,
-                      O_RDWR |  // Read/Write mode
-                      O_CREAT,  // Create file if it does not exist
-                      S_IWUSR | // User write permission
-                      S_IRUSR   // User read permission
-        );
+/**
+ * @brief Merge two adjacent internal nodes, or share their children out evenly.
+ * As leafnode_rebalance(); the parent's key between the nodes moves down to separate
+ * the left node's right child from what follows it.
+ */
+static bool
+intnode_rebalance(Table* table, void* parent, uint32_t index) {
+        Pager* pager = table->pager;
+        uint32_t left_page_num = *intnode_get_child(parent, index);
+        uint32_t right_page_num = *intnode_get_child(parent, index + 1);
+        void* left = get_page(pager, left_page_num);
+        void* right = get_page(pager, right_page_num);
+        left = pager_mark_dirty(pager, left_page_num);
+        right = pager_mark_dirty(pager, right_page_num);
+
+        /* All children of both nodes in key order, as in intnode_split_and_insert() */
+        uint32_t left_keys = *intnode_num_keys(left);
+        uint32_t right_keys = *intnode_num_keys(right);
+        uint32_t num_cells = left_keys + right_keys + 2;
+        uint32_t cells[2 * (2 * INTERNAL_NODE_MAX_CELLS + 2)];
+        intnode_cells(left, cells);
+        cells[2 * left_keys] = *intnode_right_child(left);
+        cells[2 * left_keys + 1] = *intnode_key(parent, index);
+        intnode_cells(right, &cells[2 * (left_keys + 1)]);
+        cells[2 * (num_cells - 1)] = *intnode_right_child(right);
+
+        bool merge = num_cells - 1 <= INTERNAL_NODE_MAX_CELLS;
+        if (merge) {
+                intnode_fill(left, cells, num_cells);
+                intnode_remove(parent, index);
+        } else {
+                uint32_t left_cells = num_cells / 2;
+                intnode_fill(left, cells, left_cells);
+                intnode_fill(right, &cells[2 * left_cells], num_cells - left_cells);
+                *intnode_key(parent, index) = cells[2 * (left_cells - 1) + 1];
+        }
+        pager_unpin(pager, right_page_num);
+        pager_unpin(pager, left_page_num);
 
-        if (fd == -1) {
-                printf("Unable to open file\n");
-                exit(EXIT_FAILURE);
+        if (merge)
+                free_page(table, right_page_num);
+        return merge;
+}
+
+/**
+ * @brief Replace an internal root that is down to a single child by that child.
+ * The root stays on its page, the child's page goes on the free list.
+ */
+static void
+btree_collapse_root(Table* table) {
+        Pager* pager = table->pager;
+        void* root = get_page(pager, table->root_page);
+        while (get_node_type(root) == NODE_INTERNAL && *intnode_num_keys(root) == 0) {
+                uint32_t child_page_num = *intnode_right_child(root);
+                void* child = get_page(pager, child_page_num);
+                root = pager_mark_dirty(pager, table->root_page);
+                memcpy(root, child, PAGE_SIZE);
+                set_node_root(root, true);
+                pager_unpin(pager, child_page_num);
+                free_page(table, child_page_num);
         }
+        pager_unpin(pager, table->root_page);
+}
 
-        // lseek() returns the offset of the file pointer, which is the file length if
-        // we seek to the end of the file.
-        off_t file_length = lseek(fd, 0, SEEK_END);
-        if (file_length % PAGE_SIZE != 0) {
-                printf("Db file is not a whole number of pages. Corrupt file.\n");
-                exit(EXIT_FAILURE);
+/**
+ * @brief Restore the fill of the nodes on the cursor's path after a row left its leaf.
+ * A node less than a third full is merged with a sibling under the same parent, or
+ * evened out with it when both do not fit in one page. A merge takes a key from the
+ * parent, which is checked in turn; the root only collapses once it has one child left.
+ */
+static void
+btree_rebalance(Cursor* cursor) {
+        Table* table = cursor->table;
+        Pager* pager = table->pager;
+        uint32_t page_num = cursor->page_num;
+        uint32_t level = cursor->depth;
+
+        for (; level > 0; level--) {
+                void* node = get_page(pager, page_num);
+                bool leaf = get_node_type(node) == NODE_LEAF;
+                bool underflow = leaf ? leafnode_used_space(node) * 3 < LEAF_NODE_SPACE_FOR_CELLS
+                                      : *intnode_num_keys(node) < INTERNAL_NODE_MAX_CELLS / 3;
+                pager_unpin(pager, page_num);
+                if (!underflow)
+                        return;
+
+                uint32_t parent_page_num = cursor->path[level - 1];
+                uint32_t index = cursor->path_child[level - 1];
+                void* parent = get_page(pager, parent_page_num);
+                uint32_t num_keys = *intnode_num_keys(parent);
+                if (num_keys == 0) {
+                        pager_unpin(pager, parent_page_num);
+                        break;
+                }
+
+                /* Pair the node with its right sibling, or its left one if it is the right child */
+                parent = pager_mark_dirty(pager, parent_page_num);
+                uint32_t left_index = index < num_keys ? index : index - 1;
+                bool merged = leaf ? leafnode_rebalance(table, parent, left_index)
+                                   : intnode_rebalance(table, parent, left_index);
+                pager_unpin(pager, parent_page_num);
+
+                /* Rows moved between leaves, the rightmost leaf is found again by the next insert */
+                table->right_leaf = INVALID_PAGE_NUM;
+                if (!merged)
+                        return;
+                page_num = parent_page_num;
         }
+        btree_collapse_root(table);
+}
 
-        // Create a new Pager instance and initialize it.
-        Pager* pager = malloc(sizeof(Pager));
-        pager->num_pages = file_length / PAGE_SIZE;
-        pager->file_len = file_length;
-        pager->fd = fd;
+/** @brief Handle on the tree rooted at `root_page`, on the same pager as the table. */
+static Table*
+table_open_tree(Pager* pager, uint32_t root_page) {
+        Table* tree = calloc(1, sizeof(Table));
+        tree->pager = pager;
+        tree->root_page = root_page;
+        tree->right_leaf = INVALID_PAGE_NUM;
+        return tree;
+}
 
-        for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) pager->pages[i] = NULL;
-        return pager;
+/** @brief Remove the row under the cursor and rebalance the tree around its leaf. */
+static void
+btree_delete(Cursor* cursor) {
+        Table* table = cursor->table;
+        Pager* pager = table->pager;
+        void* node = get_page(pager, cursor->page_num);
+        node = pager_mark_dirty(pager, cursor->page_num);
+        leafnode_remove(node, cursor->cell_num);
+        pager_unpin(pager, cursor->page_num);
+
+        /* The largest key may be gone */
+        if (cursor->page_num == table->right_leaf)
+                table->right_leaf = INVALID_PAGE_NUM;
+        btree_rebalance(cursor);
 }
 
 Table*
-new_table(const char* filename) {
+new_table(const char* filename, const PagerConfig* config) {
         Table* table = (Table*)malloc(sizeof(Table));
         if (!table) {
                 perror("Failed to allocate memory for table");
                 return NULL;
         }
 
-        Pager* pager = new_pager(filename);
+        Pager* pager = new_pager(filename, config);
         if (!pager) {
                 perror("Failed to create pager");
                 free(table);
@@ -523,151 +871,504 @@ new_table(const char* filename) {
         }
 
         table->pager = pager;
-        table->root_page = 0; // Initialize root page to 0
+        table->root_page = TABLE_ROOT_PAGE_NUM;
+        table->right_leaf = INVALID_PAGE_NUM;
+        memset(table->index, 0, sizeof(table->index));
         if (pager->num_pages == 0) {
-                // If the file is empty, create a new root page.
-                void* root_node = get_page(pager, 0);
+                // If the file is empty, create the meta page and an empty root page.
+                pager_begin(pager);
+                void* meta = get_page(pager, META_PAGE_NUM);
+                meta = pager_mark_dirty(pager, META_PAGE_NUM);
+                memset(meta, 0, PAGE_SIZE);
+                set_node_type(meta, NODE_META);
+                pager_unpin(pager, META_PAGE_NUM);
+
+                void* root_node = get_page(pager, TABLE_ROOT_PAGE_NUM);
+                root_node = pager_mark_dirty(pager, TABLE_ROOT_PAGE_NUM);
                 new_leafnode(root_node);
                 set_node_root(root_node, true);
-                // *leafnode_num_cells(root_node) = 0; // Initialize number of cells to 0
+                pager_unpin(pager, TABLE_ROOT_PAGE_NUM);
+                pager_commit(pager);
+        }
+
+        void* meta = get_page(pager, META_PAGE_NUM);
+        if (get_node_type(meta) != NODE_META) {
+                printf("%s has no meta page, it was not created by this version\n", filename);
+                exit(EXIT_FAILURE);
+        }
+        for (IndexColumn column = 0; column < INDEX_COLUMNS; column++) {
+                uint32_t root_page = *meta_index_root(meta, column);
+                if (root_page != 0)
+                        table->index[column] = table_open_tree(pager, root_page);
         }
+        pager_unpin(pager, META_PAGE_NUM);
         // table->num_rows = 0;
         return table;
 }
 
-void*
-get_page(Pager* pager, uint32_t page_num) {
-        if (page_num > TABLE_MAX_PAGES) {
-                printf("Tried to fetch page number out of bounds. %d > %d\n", page_num, TABLE_MAX_PAGES);
-                exit(EXIT_FAILURE);
+void
+free_table(Table* table) {
+        for (IndexColumn column = 0; column < INDEX_COLUMNS; column++) free(table->index[column]);
+        free_pager(table->pager);
+        free(table);
+}
+
+/**
+ * @brief Walk from the root to the leaf that should contain `key`, as of `snapshot`.
+ * The internal nodes passed on the way are stored in `path`, root first, and the index
+ * of the child taken in each in `path_child`; returns the leaf's page number.
+ */
+static uint32_t
+table_descend(Table* table, uint64_t snapshot, uint32_t key, uint32_t* path, uint32_t* path_child,
+              uint32_t* depth) {
+        uint32_t page_num = table->root_page;
+        *depth = 0;
+        for (;;) {
+                void* node = pager_read(table->pager, page_num, snapshot);
+                if (get_node_type(node) == NODE_LEAF) {
+                        pager_unpin(table->pager, page_num);
+                        return page_num;
+                }
+                if (*depth == BTREE_MAX_DEPTH) {
+                        printf("Tree is deeper than %d levels. Corrupt file.\n", BTREE_MAX_DEPTH);
+                        exit(EXIT_FAILURE);
+                }
+                uint32_t child_index = intnode_find_child(node, key);
+                uint32_t child_num = *intnode_get_child(node, child_index);
+                path[*depth] = page_num;
+                path_child[(*depth)++] = child_index;
+                pager_unpin(table->pager, page_num);
+                page_num = child_num;
         }
+}
 
-        if (pager->pages[page_num] != NULL)
-                return pager->pages[page_num]; // Cache hit. Return the page.
+void
+cursor_open(Table* table, Cursor* cursor) {
+        cursor->table = table;
+        cursor->table_end = true;
+        cursor->snapshot = pager_snapshot(table->pager);
+}
 
-        void* page = malloc(PAGE_SIZE);
-        uint32_t num_pages = pager->file_len / PAGE_SIZE;
+void
+cursor_close(Cursor* cursor) {
+        pager_snapshot_release(cursor->table->pager, cursor->snapshot);
+}
 
-        if (pager->file_len % PAGE_SIZE) // Partial page at end of file
-                num_pages += 1;
+/** @brief Place the open `cursor` on the first row of `table` with an id of at least `key`, returning its leaf pinned. */
+static void*
+cursor_find(Table* table, uint32_t key, Cursor* cursor) {
+        cursor->table = table;
+        cursor->page_num = table_descend(table, cursor->snapshot, key, cursor->path, cursor->path_child, &cursor->depth);
+        cursor->table_end = false;
+        cursor->read_ahead = 0;
+        cursor->end_key = UINT32_MAX;
+        cursor->append = false;
+        void* node = pager_read(table->pager, cursor->page_num, cursor->snapshot);
+        cursor->cell_num = keys_lower_bound(leafnode_keys(node), *leafnode_num_cells(node), key);
+        return node;
+}
 
-        if (page_num <= num_pages) {
-                lseek(pager->fd, page_num * PAGE_SIZE, SEEK_SET);
-                ssize_t bytes_read = read(pager->fd, page, PAGE_SIZE);
-                if (bytes_read == -1) {
-                        printf("Error reading file: %d\n", errno);
-                        exit(EXIT_FAILURE);
+void
+table_find(Table* table, uint32_t key, Cursor* cursor) {
+        cursor_find(table, key, cursor);
+        pager_unpin(table->pager, cursor->page_num);
+}
+
+/**
+ * @brief Start reading the leaves after the cursor's leaf while it is still scanned.
+ * The leaves that follow are the next children of the leaf's parent, so their page
+ * numbers are known without walking the leaf chain. The parent is found again from the
+ * root since the cursor's path goes stale once it follows the leaf chain; the internal
+ * nodes are cached. Leaves past the cursor's end key are left alone. The next window is
+ * requested once the cursor is halfway through.
+ */
+static void
+cursor_read_ahead(Cursor* cursor) {
+        Pager* pager = cursor->table->pager;
+        void* leaf = pager_read(pager, cursor->page_num, cursor->snapshot);
+        uint32_t num_cells = *leafnode_num_cells(leaf);
+        uint32_t first_key = num_cells > 0 ? *leafnode_get_key(leaf, 0) : 0;
+        pager_unpin(pager, cursor->page_num);
+
+        uint32_t path[BTREE_MAX_DEPTH];
+        uint32_t path_child[BTREE_MAX_DEPTH];
+        uint32_t depth;
+        uint32_t leaves[TABLE_READ_AHEAD];
+        uint32_t num_leaves = 0;
+        if (num_cells > 0 &&
+            table_descend(cursor->table, cursor->snapshot, first_key, path, path_child, &depth) == cursor->page_num &&
+            depth > 0) {
+                uint32_t parent_page_num = path[depth - 1];
+                void* parent = pager_read(pager, parent_page_num, cursor->snapshot);
+                uint32_t num_keys = *intnode_num_keys(parent);
+                for (uint32_t i = path_child[depth - 1] + 1; i <= num_keys && num_leaves < TABLE_READ_AHEAD; i++) {
+                        leaves[num_leaves++] = *intnode_get_child(parent, i);
+                        if (i < num_keys && *intnode_key(parent, i) >= cursor->end_key)
+                                break;
                 }
+                pager_unpin(pager, parent_page_num);
         }
-        pager->pages[page_num] = page;
 
-        if (page_num >= pager->num_pages)
-                pager->num_pages = page_num + 1;
+        pager_read_ahead(pager, leaves, num_leaves);
+        cursor->read_ahead = num_leaves > 1 ? num_leaves / 2 : 1;
+}
+
+/**
+ * @brief Move a cursor that is past the last row of its leaf along the leaf chain.
+ * Sets `table_end` when the table runs out or the row reached is above `end_key`.
+ */
+static void
+cursor_settle(Cursor* cursor) {
+        Pager* pager = cursor->table->pager;
+        for (;;) {
+                void* page = pager_read(pager, cursor->page_num, cursor->snapshot);
+                uint32_t num_cells = *leafnode_num_cells(page);
+                uint32_t next_page_num = *leafnode_next_leaf(page);
+                uint32_t key = cursor->cell_num < num_cells ? *leafnode_get_key(page, cursor->cell_num) : 0;
+                pager_unpin(pager, cursor->page_num);
 
-        return pager->pages[page_num];
+                if (cursor->cell_num < num_cells) {
+                        cursor->table_end = key > cursor->end_key;
+                        return;
+                }
+                if (next_page_num == 0) {
+                        /* This was rightmost leaf */
+                        cursor->table_end = true;
+                        return;
+                }
+                cursor->page_num = next_page_num;
+                cursor->cell_num = 0;
+                if (cursor->read_ahead > 0 && --cursor->read_ahead == 0)
+                        cursor_read_ahead(cursor);
+        }
 }
 
+/**
+ * @brief Cursor on the first row with an id of at least `start_key`, ending after `end_key`.
+ * The seek descends once and the scan then follows the leaf chain, so a range touches
+ * the pages on one path and the leaves holding its rows. Reading ahead starts once the
+ * scan leaves its first leaf; point lookups and short ranges never read ahead.
+ */
 void
-pager_flush(Pager* pager, uint32_t page_num) {
-        if (pager->pages[page_num] == NULL) {
-                printf("Tried to flush null page\n");
-                exit(EXIT_FAILURE);
-        }
+table_seek(Table* table, uint32_t start_key, uint32_t end_key, Cursor* cursor) {
+        table_find(table, start_key, cursor);
+        cursor->end_key = end_key;
+        cursor_settle(cursor);
+        cursor->read_ahead = 1;
+}
+
+void
+table_start(Table* table, Cursor* cursor) {
+        table_seek(table, 0, UINT32_MAX, cursor);
+}
 
-        off_t offset = lseek(pager->fd, page_num * PAGE_SIZE, SEEK_SET);
+/** @brief Copy the row under the cursor out of its leaf. */
+void
+cursor_value(Cursor* cursor, Row* row) {
+        Pager* pager = cursor->table->pager;
+        void* page = pager_read(pager, cursor->page_num, cursor->snapshot);
+        deserialize_row(leafnode_val(page, cursor->cell_num), *leafnode_get_key(page, cursor->cell_num), row);
+        pager_unpin(pager, cursor->page_num);
+}
 
-        if (offset == -1) {
-                printf("Error seeking: %d\n", errno);
-                exit(EXIT_FAILURE);
-        }
+void
+cursor_advance(Cursor* cursor) {
+        cursor->cell_num += 1;
+        cursor_settle(cursor);
+}
 
-        ssize_t bytes_written = write(pager->fd, pager->pages[page_num], PAGE_SIZE);
+/** @brief Place `cursor` on the row with `key`, false if the tree has none. */
+bool
+btree_find_exact(Table* table, uint32_t key, Cursor* cursor) {
+        void* node = cursor_find(table, key, cursor);
+        bool found = cursor->cell_num < *leafnode_num_cells(node) &&
+                     *leafnode_get_key(node, cursor->cell_num) == key;
+        pager_unpin(table->pager, cursor->page_num);
+        return found;
+}
 
-        if (bytes_written == -1) {
-                printf("Error writing: %d\n", errno);
-                exit(EXIT_FAILURE);
+/*
+ * Secondary Indexes
+ * An index entry is keyed by the hash of a column value; its record is a flag byte
+ * followed by the ids of the rows whose value has that hash. Rows found through an index
+ * are checked against the value itself, so a hash collision costs a lookup, not a wrong
+ * row. An entry that would outgrow ROW_MAX_RECORD_SIZE drops its ids and keeps only
+ * INDEX_ENTRY_OVERFLOW with a count of its rows, and selects on that value scan the table
+ * instead. Once deletes bring the count down to INDEX_RELIST_IDS the ids are listed again
+ * from one scan of the table; half the limit, so a value hovering at the limit does not
+ * rescan the table on every write.
+ */
+#define INDEX_ENTRY_OVERFLOW 0x1
+#define INDEX_RELIST_IDS (INDEX_MAX_IDS / 2)
+#define INDEX_OVERFLOW_SIZE (1 + sizeof(uint32_t)) // Flag and row count
+
+static const char*
+row_column(Row* row, IndexColumn column) {
+        return column == INDEX_USERNAME ? row->username : row->email;
+}
+
+/** @brief 32-bit FNV-1a hash of a column value, the key of its index entry. */
+static uint32_t
+index_hash(const char* value) {
+        uint32_t hash = 2166136261u;
+        for (; *value; value++) {
+                hash ^= (uint8_t)*value;
+                hash *= 16777619u;
         }
+        return hash;
 }
 
-void
-free_table(Table* table) {
-        Pager* pager = table->pager;
+static int
+compare_ids(const void* a, const void* b) {
+        uint32_t x = *(const uint32_t*)a;
+        uint32_t y = *(const uint32_t*)b;
+        return (x > y) - (x < y);
+}
 
-        for (uint32_t i = 0; i < pager->num_pages; i++) {
-                if (pager->pages[i] == NULL) {
-                        continue;
-                }
-                pager_flush(pager, i);
-                free(pager->pages[i]);
-                pager->pages[i] = NULL;
+/** @brief Add row `id` to the entry of `value`, within the caller's write transaction. */
+static void
+index_add(Table* index, const char* value, uint32_t id) {
+        Pager* pager = index->pager;
+        uint32_t key = index_hash(value);
+        Cursor cursor;
+        cursor_open(index, &cursor);
+        table_find(index, key, &cursor);
+        void* node = get_page(pager, cursor.page_num);
+        bool found = cursor.cell_num < *leafnode_num_cells(node) &&
+                     *leafnode_get_key(node, cursor.cell_num) == key;
+
+        char record[ROW_MAX_RECORD_SIZE] = {0};
+        uint32_t size = 1;
+        if (found) {
+                size = *leafnode_record_size(node, cursor.cell_num);
+                memcpy(record, leafnode_val(node, cursor.cell_num), size);
+        }
+        if ((record[0] & INDEX_ENTRY_OVERFLOW) && size < INDEX_OVERFLOW_SIZE) {
+                /* Written without a count, the next remove lists it again */
+                pager_unpin(pager, cursor.page_num);
+                cursor_close(&cursor);
+                return;
+        }
+        if ((record[0] & INDEX_ENTRY_OVERFLOW) || size + sizeof(uint32_t) > ROW_MAX_RECORD_SIZE) {
+                /* Too many rows share the value to list them, keep the flag and count them */
+                uint32_t count = (size - 1) / sizeof(uint32_t);
+                if (record[0] & INDEX_ENTRY_OVERFLOW)
+                        memcpy(&count, record + 1, sizeof(uint32_t));
+                count++;
+                node = pager_mark_dirty(pager, cursor.page_num);
+                char* entry = leafnode_val(node, cursor.cell_num);
+                entry[0] = INDEX_ENTRY_OVERFLOW;
+                memcpy(entry + 1, &count, sizeof(uint32_t));
+                *leafnode_record_size(node, cursor.cell_num) = INDEX_OVERFLOW_SIZE;
+                pager_unpin(pager, cursor.page_num);
+                cursor_close(&cursor);
+                return;
         }
 
-        int result = close(pager->fd);
-        if (result == -1) {
-                printf("Error closing db file.\n");
-                exit(EXIT_FAILURE);
+        memcpy(record + size, &id, sizeof(uint32_t));
+        size += sizeof(uint32_t);
+        if (found) {
+                node = pager_mark_dirty(pager, cursor.page_num);
+                leafnode_remove(node, cursor.cell_num);
         }
-        for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-                void* page = pager->pages[i];
-                if (page) {
-                        free(page);
-                        pager->pages[i] = NULL;
+        pager_unpin(pager, cursor.page_num);
+        leafnode_insert_record(&cursor, key, record, size);
+        cursor_close(&cursor);
+}
+
+/**
+ * @brief Entry of the rows of `table` whose `column` hashes to `key`, from one scan.
+ * Lists their ids, or counts them behind INDEX_ENTRY_OVERFLOW when there are too many.
+ */
+static uint32_t
+index_relist(Table* table, IndexColumn column, uint32_t key, char* record) {
+        uint32_t count = 0;
+        Cursor cursor;
+        cursor_open(table, &cursor);
+        table_start(table, &cursor);
+        Row row;
+        while (!cursor.table_end) {
+                cursor_value(&cursor, &row);
+                if (index_hash(row_column(&row, column)) == key) {
+                        if (count < INDEX_MAX_IDS)
+                                memcpy(record + 1 + count * sizeof(uint32_t), &row.id, sizeof(uint32_t));
+                        count++;
                 }
+                cursor_advance(&cursor);
         }
-        free(pager);
-        free(table);
-}
+        cursor_close(&cursor);
 
-void
-print_row(Row* row) {
-        printf("(%d, %s, %s)\n", row->id, row->username, row->email);
+        if (count > INDEX_MAX_IDS) {
+                record[0] = INDEX_ENTRY_OVERFLOW;
+                memcpy(record + 1, &count, sizeof(uint32_t));
+                return INDEX_OVERFLOW_SIZE;
+        }
+        record[0] = 0;
+        return 1 + count * sizeof(uint32_t);
 }
 
-Cursor*
-table_find(Table* table, uint32_t key) {
-        uint32_t root_page = table->root_page;
+/**
+ * @brief Drop row `id` from the entry of its `column` value, removing the entry with its last id.
+ * The row has already left `table`, within the caller's write transaction.
+ */
+static void
+index_remove(Table* table, IndexColumn column, const char* value, uint32_t id) {
+        Table* index = table->index[column];
+        Pager* pager = index->pager;
+        uint32_t key = index_hash(value);
+        Cursor cursor;
+        cursor_open(index, &cursor);
+        if (!btree_find_exact(index, key, &cursor)) {
+                cursor_close(&cursor);
+                return;
+        }
+
+        void* node = get_page(pager, cursor.page_num);
+        char* record = leafnode_val(node, cursor.cell_num);
+        uint32_t size = *leafnode_record_size(node, cursor.cell_num);
+        if (record[0] & INDEX_ENTRY_OVERFLOW) {
+                uint32_t count = INDEX_RELIST_IDS; // Entries written without a count are listed again
+                if (size >= INDEX_OVERFLOW_SIZE)
+                        memcpy(&count, record + 1, sizeof(uint32_t));
+                if (--count > INDEX_RELIST_IDS) {
+                        node = pager_mark_dirty(pager, cursor.page_num);
+                        memcpy(leafnode_val(node, cursor.cell_num) + 1, &count, sizeof(uint32_t));
+                        pager_unpin(pager, cursor.page_num);
+                        cursor_close(&cursor);
+                        return;
+                }
+                pager_unpin(pager, cursor.page_num);
+
+                char listed[ROW_MAX_RECORD_SIZE];
+                uint32_t listed_size = index_relist(table, column, key, listed);
+                if (listed_size == 1) {
+                        btree_delete(&cursor);
+                } else {
+                        node = get_page(pager, cursor.page_num);
+                        node = pager_mark_dirty(pager, cursor.page_num);
+                        leafnode_remove(node, cursor.cell_num);
+                        pager_unpin(pager, cursor.page_num);
+                        leafnode_insert_record(&cursor, key, listed, listed_size);
+                }
+                cursor_close(&cursor);
+                return;
+        }
 
-        void* root = get_page(table->pager, root_page);
+        uint32_t num_ids = (size - 1) / sizeof(uint32_t);
+        uint32_t i = 0;
+        for (; i < num_ids; i++) {
+                uint32_t entry;
+                memcpy(&entry, record + 1 + i * sizeof(uint32_t), sizeof(uint32_t));
+                if (entry == id)
+                        break;
+        }
 
-        if (get_node_type(root) == NODE_LEAF) {
-                return leafnode_find(table, root_page, key);
+        if (i == num_ids) {
+                pager_unpin(pager, cursor.page_num);
+        } else if (num_ids == 1) {
+                pager_unpin(pager, cursor.page_num);
+                btree_delete(&cursor);
         } else {
-                return intnode_find(table, root_page, key);
+                node = pager_mark_dirty(pager, cursor.page_num);
+                record = leafnode_val(node, cursor.cell_num);
+                memmove(record + 1 + i * sizeof(uint32_t), record + 1 + (i + 1) * sizeof(uint32_t),
+                        (num_ids - i - 1) * sizeof(uint32_t));
+                *leafnode_record_size(node, cursor.cell_num) = size - sizeof(uint32_t);
+                pager_unpin(pager, cursor.page_num);
         }
+        cursor_close(&cursor);
 }
 
-Cursor*
-table_start(Table* table) {
-        Cursor* cursor = table_find(table, 0);
-        void* node = get_page(table->pager, cursor->page_num);
-        uint32_t num_cells = *leafnode_num_cells(node);
-        cursor->table_end = (num_cells == 0);
-        return cursor;
-}
+/**
+ * @brief Ids of the rows whose value hashes like `value`, in ascending order.
+ * Read through the open `cursor`. `ids` holds INDEX_MAX_IDS entries. Returns false if
+ * the value is too common to be listed.
+ */
+static bool
+index_lookup(Table* index, const char* value, Cursor* cursor, uint32_t* ids, uint32_t* num_ids) {
+        *num_ids = 0;
+        uint32_t key = index_hash(value);
+        void* node = cursor_find(index, key, cursor);
+        bool listed = true;
+        if (cursor->cell_num < *leafnode_num_cells(node) && *leafnode_get_key(node, cursor->cell_num) == key) {
+                const char* record = leafnode_val(node, cursor->cell_num);
+                listed = !(record[0] & INDEX_ENTRY_OVERFLOW);
+                if (listed) {
+                        *num_ids = (*leafnode_record_size(node, cursor->cell_num) - 1) / sizeof(uint32_t);
+                        memcpy(ids, record + 1, *num_ids * sizeof(uint32_t));
+                }
+        }
+        pager_unpin(index->pager, cursor->page_num);
 
-void*
-cursor_value(Cursor* cursor) {
-        uint32_t page_num = cursor->page_num;
-        void* page = get_page(cursor->table->pager, page_num);
-        return leafnode_val(page, cursor->cell_num);
+        qsort(ids, *num_ids, sizeof(uint32_t), compare_ids);
+        return listed;
 }
 
-void
-cursor_advance(Cursor* cursor) {
-        uint32_t page_num = cursor->page_num;
-        void* page = get_page(cursor->table->pager, page_num);
+/**
+ * @brief Index `column` of every row of `source` in a new tree, returning its root page.
+ * Runs in the caller's write transaction but commits whenever half the pool is dirty, as
+ * a bulk load does; the tree is unreachable until its root is stored in the meta page.
+ */
+static uint32_t
+index_build(Table* source, IndexColumn column) {
+        Pager* pager = source->pager;
+        uint32_t root_page = get_unused_page_num(source);
+        void* root = get_page(pager, root_page);
+        root = pager_mark_dirty(pager, root_page);
+        new_leafnode(root);
+        set_node_root(root, true);
+        pager_unpin(pager, root_page);
 
-        cursor->cell_num += 1;
-        if (cursor->cell_num >= *leafnode_num_cells(page)) {
-                uint32_t next_page_num = *leafnode_next_leaf(page);
-                if (next_page_num == 0) {
-                        /* This was rightmost leaf */
-                        cursor->table_end = true;
-                } else {
-                        cursor->page_num = next_page_num;
-                        cursor->cell_num = 0;
+        Table* index = table_open_tree(pager, root_page);
+        Cursor cursor;
+        cursor_open(source, &cursor);
+        table_start(source, &cursor);
+        Row row;
+        while (!cursor.table_end) {
+                cursor_value(&cursor, &row);
+                index_add(index, row_column(&row, column), row.id);
+                if (pager->num_dirty >= pager->num_frames / 2) {
+                        pager_commit(pager);
+                        pager_begin(pager);
                 }
+                cursor_advance(&cursor);
         }
+        cursor_close(&cursor);
+        free(index);
+        return root_page;
+}
+
+bool
+table_create_index(Table* table, IndexColumn column) {
+        if (table->index[column])
+                return false;
+
+        Pager* pager = table->pager;
+        pager_begin(pager);
+        uint32_t root_page = index_build(table, column);
+        void* meta = get_page(pager, META_PAGE_NUM);
+        meta = pager_mark_dirty(pager, META_PAGE_NUM);
+        *meta_index_root(meta, column) = root_page;
+        pager_unpin(pager, META_PAGE_NUM);
+        pager_commit(pager);
+
+        table->index[column] = table_open_tree(pager, root_page);
+        return true;
+}
+
+/** @brief Enter a new row in every index, within the caller's write transaction. */
+static void
+table_index_add(Table* table, Row* row) {
+        for (IndexColumn column = 0; column < INDEX_COLUMNS; column++)
+                if (table->index[column])
+                        index_add(table->index[column], row_column(row, column), row->id);
+}
+
+static void
+table_index_remove(Table* table, Row* row) {
+        for (IndexColumn column = 0; column < INDEX_COLUMNS; column++)
+                if (table->index[column])
+                        index_remove(table, column, row_column(row, column), row->id);
 }
 
 void
@@ -707,51 +1408,620 @@ print_tree(Pager* pager, uint32_t page_num, uint32_t indentation_level) {
                                 print_tree(pager, child, indentation_level + 1);
                         }
                         break;
+                default:
+                        indent(indentation_level);
+                        printf("- page %d is not a tree node (type %d)\n", page_num, get_node_type(node));
+                        break;
+        }
+        pager_unpin(pager, page_num);
+}
+
+static void
+table_shape_walk(Pager* pager, uint64_t snapshot, uint32_t page_num, uint32_t level, TreeShape* shape, uint64_t* used) {
+        void* node = pager_read(pager, page_num, snapshot);
+        if (level + 1 > shape->height)
+                shape->height = level + 1;
+        if (get_node_type(node) == NODE_LEAF) {
+                shape->leaves++;
+                shape->cells += *leafnode_num_cells(node);
+                used[0] += leafnode_used_space(node);
+        } else {
+                uint32_t num_keys = *intnode_num_keys(node);
+                shape->internal_nodes++;
+                used[1] += num_keys;
+                for (uint32_t i = 0; i < num_keys; i++)
+                        table_shape_walk(pager, snapshot, *intnode_get_child(node, i), level + 1, shape, used);
+                table_shape_walk(pager, snapshot, *intnode_right_child(node), level + 1, shape, used);
         }
+        pager_unpin(pager, page_num);
 }
 
 void
-exec_insert(Command* cmd, Table* table) {
-        replog("Executing insert command");
+table_shape(Pager* pager, uint32_t root_page, bool walk, TreeShape* shape) {
+        memset(shape, 0, sizeof(TreeShape));
+        uint64_t snapshot = pager_snapshot(pager);
+        if (walk) {
+                uint64_t used[2] = {0, 0}; // Leaf bytes, internal keys
+                table_shape_walk(pager, snapshot, root_page, 0, shape, used);
+                if (shape->leaves)
+                        shape->leaf_fill = (double)used[0] / ((uint64_t)shape->leaves * LEAF_NODE_SPACE_FOR_CELLS);
+                if (shape->internal_nodes)
+                        shape->internal_fill = (double)used[1] / ((uint64_t)shape->internal_nodes * INTERNAL_NODE_MAX_CELLS);
+                pager_snapshot_release(pager, snapshot);
+                return;
+        }
 
-        void* node = get_page(table->pager, table->root_page);
-        uint32_t num_cells = *leafnode_num_cells(node);
+        /* Every leaf is at the same depth, the leftmost path has the height */
+        uint32_t page_num = root_page;
+        for (;;) {
+                void* node = pager_read(pager, page_num, snapshot);
+                shape->height++;
+                bool leaf = get_node_type(node) == NODE_LEAF;
+                uint32_t child_num = leaf ? 0 : *intnode_get_child(node, 0);
+                pager_unpin(pager, page_num);
+                if (leaf)
+                        break;
+                page_num = child_num;
+        }
+        pager_snapshot_release(pager, snapshot);
+}
 
-        //log user name and email sizes
-        replog("username size: %zu, email size: %zu", strlen(cmd->row.username), strlen(cmd->row.email));
+/**
+ * @brief Forget the open transaction and every page it changed.
+ * The rightmost leaves the table and its indexes remember may be pages the transaction
+ * created, they are found again by the next insert.
+ */
+static void
+table_discard_txn(Table* table) {
+        pager_rollback(table->pager);
+        table->right_leaf = INVALID_PAGE_NUM;
+        for (IndexColumn column = 0; column < INDEX_COLUMNS; column++) {
+                if (table->index[column])
+                        table->index[column]->right_leaf = INVALID_PAGE_NUM;
+        }
+}
+
+BulkLoad*
+table_bulk_begin(Table* table, uint32_t fill_percent) {
+        void* root = get_page(table->pager, table->root_page);
+        bool empty = get_node_type(root) == NODE_LEAF && *leafnode_num_cells(root) == 0;
+        pager_unpin(table->pager, table->root_page);
+        if (!empty)
+                return NULL;
 
-        Row* row = &cmd->row;
-        uint32_t key_to_insert = row->id;
-        Cursor* cursor = table_find(table, key_to_insert);
+        /* The rightmost leaf is found again by the first insert after the load */
+        table->right_leaf = INVALID_PAGE_NUM;
 
-        if (cursor->cell_num < num_cells) {
-                uint32_t key_at_index = *leafnode_get_key(node, cursor->cell_num);
-                if (key_at_index == key_to_insert) {
-                        replog("Duplicate key error, row with id %d already exists", key_to_insert);
+        if (fill_percent == 0 || fill_percent > 100)
+                fill_percent = BULK_DEFAULT_FILL;
+
+        BulkLoad* load = calloc(1, sizeof(BulkLoad));
+        load->table = table;
+        load->leaf_space = LEAF_NODE_SPACE_FOR_CELLS * fill_percent / 100;
+        load->internal_keys = INTERNAL_NODE_MAX_CELLS * fill_percent / 100;
+        if (load->leaf_space < ROW_MAX_RECORD_SIZE + LEAF_NODE_SLOT_SIZE)
+                load->leaf_space = ROW_MAX_RECORD_SIZE + LEAF_NODE_SLOT_SIZE;
+        if (load->internal_keys == 0)
+                load->internal_keys = 1;
+        load->leaf_page_num = INVALID_PAGE_NUM;
+
+        pager_begin(table->pager);
+        return load;
+}
+
+/**
+ * @brief Append a finished child to the open internal node at `level`.
+ * A full node is closed, handed to the level above, and replaced by a new sibling.
+ */
+static void
+bulk_push(BulkLoad* load, uint32_t level, uint32_t child_page_num, uint32_t child_max) {
+        Pager* pager = load->table->pager;
+
+        if (level < load->height) {
+                uint32_t page_num = load->level_page_num[level];
+                void* node = get_page(pager, page_num);
+                uint32_t num_keys = *intnode_num_keys(node);
+                if (num_keys < load->internal_keys) {
+                        node = pager_mark_dirty(pager, page_num);
+                        *intnode_child(node, num_keys) = *intnode_right_child(node);
+                        *intnode_key(node, num_keys) = load->level_max[level];
+                        *intnode_num_keys(node) = num_keys + 1;
+                        *intnode_right_child(node) = child_page_num;
+                        load->level_max[level] = child_max;
+                        pager_unpin(pager, page_num);
                         return;
                 }
+                pager_unpin(pager, page_num);
+                bulk_push(load, level + 1, page_num, load->level_max[level]);
+        } else if (level == BTREE_MAX_DEPTH) {
+                printf("Bulk load is deeper than %d levels\n", BTREE_MAX_DEPTH);
+                exit(EXIT_FAILURE);
+        } else {
+                load->height++;
+        }
+
+        /* Start a new node on this level with the child as its only child */
+        uint32_t page_num = get_unused_page_num(load->table);
+        void* node = get_page(pager, page_num);
+        node = pager_mark_dirty(pager, page_num);
+        new_intnode(node);
+        *intnode_right_child(node) = child_page_num;
+        pager_unpin(pager, page_num);
+        load->level_page_num[level] = page_num;
+        load->level_max[level] = child_max;
+}
+
+/**
+ * @brief Close the leaf being filled and start the next one.
+ * Pages are committed in batches; none of them is reachable from the root until
+ * table_bulk_finish(), so a partial load is invisible.
+ */
+static void
+bulk_next_leaf(BulkLoad* load) {
+        Pager* pager = load->table->pager;
+        uint32_t page_num = get_unused_page_num(load->table);
+        void* leaf = get_page(pager, page_num);
+        leaf = pager_mark_dirty(pager, page_num);
+        new_leafnode(leaf);
+        pager_unpin(pager, page_num);
+
+        uint32_t prev_page_num = load->leaf_page_num;
+        load->leaf_page_num = page_num;
+        load->leaf_used = 0;
+        if (prev_page_num == INVALID_PAGE_NUM) {
+                load->first_leaf = page_num;
+                return;
+        }
+
+        void* prev = get_page(pager, prev_page_num);
+        prev = pager_mark_dirty(pager, prev_page_num);
+        *leafnode_next_leaf(prev) = page_num;
+        pager_unpin(pager, prev_page_num);
+        bulk_push(load, 0, prev_page_num, load->last_key);
+
+        if (pager->num_dirty >= pager->num_frames / 2) {
+                pager_commit(pager);
+                pager_begin(pager);
+                load->committed = true;
+        }
+}
+
+bool
+table_bulk_add(BulkLoad* load, Row* row) {
+        if (load->rows > 0 && row->id <= load->last_key)
+                return false;
+
+        char record[ROW_MAX_RECORD_SIZE];
+        uint32_t size = serialize_row(row, record);
+        uint32_t needed = size + LEAF_NODE_SLOT_SIZE;
+        if (load->leaf_page_num == INVALID_PAGE_NUM || load->leaf_used + needed > load->leaf_space)
+                bulk_next_leaf(load);
+
+        Pager* pager = load->table->pager;
+        void* leaf = get_page(pager, load->leaf_page_num);
+        leaf = pager_mark_dirty(pager, load->leaf_page_num);
+        leafnode_put(leaf, *leafnode_num_cells(leaf), row->id, record, size);
+        load->leaf_used += needed;
+        pager_unpin(pager, load->leaf_page_num);
+
+        load->last_key = row->id;
+        load->rows++;
+        return true;
+}
+
+uint64_t
+table_bulk_finish(BulkLoad* load) {
+        Table* table = load->table;
+        Pager* pager = table->pager;
+        uint64_t rows = load->rows;
+
+        if (rows > 0) {
+                /* Close the right edge bottom-up, the last node left open is the top */
+                uint32_t top_page_num = load->leaf_page_num;
+                if (load->height > 0) {
+                        bulk_push(load, 0, load->leaf_page_num, load->last_key);
+                        for (uint32_t level = 0; level + 1 < load->height; level++)
+                                bulk_push(load, level + 1, load->level_page_num[level], load->level_max[level]);
+                        top_page_num = load->level_page_num[load->height - 1];
+                }
+
+                /* Index the loaded rows in new trees, swapped in for the empty ones below */
+                Table loaded = {.pager = pager, .root_page = top_page_num, .right_leaf = INVALID_PAGE_NUM};
+                uint32_t index_roots[INDEX_COLUMNS];
+                for (IndexColumn column = 0; column < INDEX_COLUMNS; column++)
+                        if (table->index[column])
+                                index_roots[column] = index_build(&loaded, column);
+
+                /* The root lives on a fixed page, copy the top node over the empty root */
+                void* top = get_page(pager, top_page_num);
+                void* root = get_page(pager, table->root_page);
+                root = pager_mark_dirty(pager, table->root_page);
+                memcpy(root, top, PAGE_SIZE);
+                set_node_root(root, true);
+                pager_unpin(pager, table->root_page);
+                pager_unpin(pager, top_page_num);
+                free_page(table, top_page_num);
+
+                for (IndexColumn column = 0; column < INDEX_COLUMNS; column++) {
+                        Table* index = table->index[column];
+                        if (!index)
+                                continue;
+                        void* meta = get_page(pager, META_PAGE_NUM);
+                        meta = pager_mark_dirty(pager, META_PAGE_NUM);
+                        *meta_index_root(meta, column) = index_roots[column];
+                        pager_unpin(pager, META_PAGE_NUM);
+                        free_page(table, index->root_page);
+                        index->root_page = index_roots[column];
+                        index->right_leaf = INVALID_PAGE_NUM;
+                }
+        }
+
+        pager_commit(pager);
+        free(load);
+        return rows;
+}
+
+/** @brief Put a page the load wrote on the free list, committing in batches like the load did. */
+static void
+bulk_free_page(BulkLoad* load, uint32_t page_num) {
+        Pager* pager = load->table->pager;
+        free_page(load->table, page_num);
+        if (pager->num_dirty >= pager->num_frames / 2) {
+                pager_commit(pager);
+                pager_begin(pager);
         }
-        leafnode_insert(cursor, row->id, row);
-        free(cursor);
 }
 
+/** @brief Free the internal nodes of the subtree at `page_num`, `level` levels above the leaves. */
+static void
+bulk_free_internal(BulkLoad* load, uint32_t page_num, uint32_t level) {
+        Pager* pager = load->table->pager;
+        uint32_t children[INTERNAL_NODE_MAX_CELLS + 1];
+        void* node = get_page(pager, page_num);
+        uint32_t num_children = *intnode_num_keys(node) + 1;
+        for (uint32_t i = 0; i < num_children; i++) children[i] = *intnode_get_child(node, i);
+        pager_unpin(pager, page_num);
+
+        if (level > 0) {
+                for (uint32_t i = 0; i < num_children; i++) bulk_free_internal(load, children[i], level - 1);
+        }
+        bulk_free_page(load, page_num);
+}
+
+/*
+ * A load that has not committed a batch yet, in a transaction of its own, is rolled back
+ * whole. Otherwise its pages are
+ * already in the file: the leaves are chained from the first one and every internal node
+ * hangs below the open node of its level, so each is found and put on the free list for
+ * the next writes to reuse.
+ */
 void
-exec_select(Command* cmd, Table* table) {
-        Cursor* cursor = table_start(table);
+table_bulk_abort(BulkLoad* load) {
+        Table* table = load->table;
+        if (!load->committed && table->pager->txn_depth == 1) {
+                table_discard_txn(table);
+                free(load);
+                return;
+        }
+
+        for (uint32_t level = 0; level < load->height; level++)
+                bulk_free_internal(load, load->level_page_num[level], level);
+        uint32_t page_num = load->first_leaf;
+        while (page_num != 0) {
+                void* leaf = get_page(table->pager, page_num);
+                uint32_t next_page_num = *leafnode_next_leaf(leaf);
+                pager_unpin(table->pager, page_num);
+                bulk_free_page(load, page_num);
+                page_num = next_page_num;
+        }
+        pager_commit(table->pager);
+        free(load);
+}
+
+/**
+ * @brief Place `cursor` past the last row of the table when the row's id is above every key in it.
+ * Inserts remember the rightmost leaf and its largest key, so increasing ids go straight
+ * to it without a descent. Returns false when the key belongs elsewhere or the row does not
+ * fit; a split needs the path from the root, which only a descent collects.
+ */
+static bool
+table_append_cursor(Table* table, Row* row, Cursor* cursor) {
+        uint32_t key = row->id;
+        if (table->right_leaf == INVALID_PAGE_NUM || key <= table->right_max)
+                return false;
+
+        void* node = get_page(table->pager, table->right_leaf);
+        uint32_t num_cells = *leafnode_num_cells(node);
+        char record[ROW_MAX_RECORD_SIZE];
+        bool usable = get_node_type(node) == NODE_LEAF && *leafnode_next_leaf(node) == 0 && num_cells > 0 &&
+                      *leafnode_get_key(node, num_cells - 1) == table->right_max &&
+                      leafnode_has_room(node, serialize_row(row, record));
+        pager_unpin(table->pager, table->right_leaf);
+        if (!usable)
+                return false;
+
+        cursor->table = table;
+        cursor->page_num = table->right_leaf;
+        cursor->cell_num = num_cells;
+        cursor->table_end = false;
+        cursor->read_ahead = 0;
+        cursor->end_key = UINT32_MAX;
+        cursor->depth = 0;
+        cursor->append = true;
+        return true;
+}
+
+/** @brief Largest id in the table, false if it holds no rows. */
+static bool
+table_max_key(Table* table, uint32_t* key) {
+        if (table->right_leaf != INVALID_PAGE_NUM) {
+                *key = table->right_max;
+                return true;
+        }
+
+        Cursor cursor;
+        cursor_open(table, &cursor);
+        void* node = cursor_find(table, UINT32_MAX, &cursor);
+        uint32_t num_cells = *leafnode_num_cells(node);
+        if (num_cells > 0)
+                *key = *leafnode_get_key(node, num_cells - 1);
+        pager_unpin(table->pager, cursor.page_num);
+        cursor_close(&cursor);
+        return num_cells > 0;
+}
+
+static int
+compare_rows(const void* a, const void* b) {
+        uint32_t x = ((const Row*)a)->id;
+        uint32_t y = ((const Row*)b)->id;
+        return (x > y) - (x < y);
+}
+
+/**
+ * @brief Roll back a transaction that holds half the pool in dirty pages.
+ * Dirty pages stay in the pool until they commit, a transaction growing past this would
+ * leave too few frames to read the tree through.
+ */
+static bool
+table_txn_overflow(Table* table) {
+        Pager* pager = table->pager;
+        if (!pager_writing(pager) || pager->num_dirty < pager->num_frames / 2)
+                return false;
+        replog("Transaction exceeds the buffer pool, rolled back");
+        table_discard_txn(table);
+        return true;
+}
+
+/**
+ * @brief End a write that failed its checks before changing anything.
+ * No page was written, so committing writes nothing to the WAL: a transaction the write
+ * opened just ends, an enclosing one carries on unchanged.
+ */
+static void
+table_abandon_write(Table* table) {
+        pager_commit(table->pager);
+}
+
+/**
+ * The write transaction opens before the checks, so no other writer can commit between
+ * a check passing and the change it allowed.
+ * Rows are sorted by id and checked against each other and the table before anything
+ * is written; ids above the largest one in the table need no lookup. Increasing ids then
+ * go one after another to the rightmost leaf without a descent, and all rows share one
+ * commit, or the open transaction.
+ */
+WriteResult
+table_insert_rows(Table* table, Row* rows, uint32_t num_rows) {
+        replog("Executing insert command");
+
+        //log user name and email sizes
+        replog("username size: %zu, email size: %zu", strlen(rows[0].username), strlen(rows[0].email));
+
+        Pager* pager = table->pager;
+        pager_begin(pager);
+        if (table_txn_overflow(table))
+                return WRITE_TXN_ROLLED_BACK;
+        qsort(rows, num_rows, sizeof(Row), compare_rows);
+
+        uint32_t max_key;
+        bool has_rows = table_max_key(table, &max_key);
+        Cursor cursor;
+        cursor_open(table, &cursor);
+        for (uint32_t i = 0; i < num_rows; i++) {
+                uint32_t key = rows[i].id;
+                if ((i > 0 && key == rows[i - 1].id) ||
+                    (has_rows && key <= max_key && btree_find_exact(table, key, &cursor))) {
+                        replog("Duplicate key error, row with id %d already exists", key);
+                        cursor_close(&cursor);
+                        table_abandon_write(table);
+                        return WRITE_FAILED;
+                }
+        }
+
+        for (uint32_t i = 0; i < num_rows; i++) {
+                if (table_txn_overflow(table)) {
+                        cursor_close(&cursor);
+                        return WRITE_TXN_ROLLED_BACK;
+                }
+                Row* row = &rows[i];
+                if (!table_append_cursor(table, row, &cursor))
+                        table_find(table, row->id, &cursor);
+                leafnode_insert(&cursor, row->id, row);
+                table_index_add(table, row);
+        }
+        cursor_close(&cursor);
+        pager_commit(pager);
+        return WRITE_OK;
+}
+
+/**
+ * @brief Place `cursor` on the row with `key`, false if the table has none.
+ */
+static bool
+table_find_row(Table* table, uint32_t key, Cursor* cursor) {
+        bool found = btree_find_exact(table, key, cursor);
+        if (!found)
+                replog("No row with id %d", key);
+        return found;
+}
+
+/**
+ * A record that is no larger is overwritten in place; a larger one is reinserted, which
+ * may split the leaf. Indexes on a column whose value changed move the row to its new entry.
+ */
+WriteResult
+table_update_row(Table* table, Row* row) {
+        Pager* pager = table->pager;
+        pager_begin(pager);
+        if (table_txn_overflow(table))
+                return WRITE_TXN_ROLLED_BACK;
+        Cursor cursor;
+        cursor_open(table, &cursor);
+        if (!table_find_row(table, row->id, &cursor)) {
+                cursor_close(&cursor);
+                table_abandon_write(table);
+                return WRITE_FAILED;
+        }
+
+        Row old_row;
+        cursor_value(&cursor, &old_row);
+        void* node = get_page(pager, cursor.page_num);
+        node = pager_mark_dirty(pager, cursor.page_num);
+        char record[ROW_MAX_RECORD_SIZE];
+        uint32_t size = serialize_row(row, record);
+        if (size <= *leafnode_record_size(node, cursor.cell_num)) {
+                memcpy(leafnode_val(node, cursor.cell_num), record, size);
+                *leafnode_record_size(node, cursor.cell_num) = size;
+                pager_unpin(pager, cursor.page_num);
+        } else {
+                leafnode_remove(node, cursor.cell_num);
+                pager_unpin(pager, cursor.page_num);
+                leafnode_insert(&cursor, row->id, row);
+        }
+
+        for (IndexColumn column = 0; column < INDEX_COLUMNS; column++) {
+                Table* index = table->index[column];
+                if (index && strcmp(row_column(&old_row, column), row_column(row, column)) != 0) {
+                        index_remove(table, column, row_column(&old_row, column), row->id);
+                        index_add(index, row_column(row, column), row->id);
+                }
+        }
+        cursor_close(&cursor);
+        pager_commit(pager);
+        return WRITE_OK;
+}
+
+WriteResult
+table_delete_row(Table* table, uint32_t id) {
+        Pager* pager = table->pager;
+        pager_begin(pager);
+        if (table_txn_overflow(table))
+                return WRITE_TXN_ROLLED_BACK;
+        Cursor cursor;
+        cursor_open(table, &cursor);
+        if (!table_find_row(table, id, &cursor)) {
+                cursor_close(&cursor);
+                table_abandon_write(table);
+                return WRITE_FAILED;
+        }
+
         Row row;
-        while (!cursor->table_end) {
-                deserialize_row(cursor_value(cursor), &row);
-                print_row(&row);
-                cursor_advance(cursor);
+        cursor_value(&cursor, &row);
+        btree_delete(&cursor);
+        table_index_remove(table, &row);
+        cursor_close(&cursor);
+        pager_commit(pager);
+        return WRITE_OK;
+}
+
+bool
+table_begin(Table* table) {
+        if (pager_writing(table->pager)) {
+                replog("A transaction is already open");
+                return false;
         }
-        free(cursor);
+        pager_begin(table->pager);
+        return true;
+}
+
+bool
+table_commit(Table* table) {
+        if (!pager_writing(table->pager)) {
+                replog("No transaction is open");
+                return false;
+        }
+        pager_commit(table->pager);
+        return true;
+}
+
+bool
+table_rollback(Table* table) {
+        if (!pager_writing(table->pager)) {
+                replog("No transaction is open");
+                return false;
+        }
+        table_discard_txn(table);
+        return true;
 }
 
 void
-exec_command(Command* cmd, Table* table) {
-        switch (cmd->type) {
-                case COMMAND_SELECT: exec_select(cmd, table); break;
-                case COMMAND_INSERT: exec_insert(cmd, table); break;
-                default: replog("Unknown command"); break;
+filter_init(Filter* filter) {
+        memset(filter, 0, sizeof(Filter));
+        filter->max_id = UINT32_MAX;
+        filter->limit = UINT32_MAX;
+}
+
+/** @brief Whether a leaf record passes the filter's username and email tests, without decoding it. */
+static bool
+record_matches(const char* record, const Filter* filter) {
+        uint8_t username_len = record[0];
+        if (filter->match_username &&
+            (username_len != strlen(filter->username) || memcmp(record + 1, filter->username, username_len) != 0))
+                return false;
+
+        const char* email = record + 1 + username_len;
+        uint8_t email_len = email[0];
+        if (filter->match_email &&
+            (email_len != strlen(filter->email) || memcmp(email + 1, filter->email, email_len) != 0))
+                return false;
+        return true;
+}
+
+bool
+cursor_filter(Cursor* cursor, const Filter* filter, Row* row) {
+        Pager* pager = cursor->table->pager;
+        void* page = pager_read(pager, cursor->page_num, cursor->snapshot);
+        const char* record = leafnode_val(page, cursor->cell_num);
+        bool match = record_matches(record, filter);
+        if (match)
+                deserialize_row(record, *leafnode_get_key(page, cursor->cell_num), row);
+        pager_unpin(pager, cursor->page_num);
+        return match;
+}
+
+/**
+ * Only the id list is read here; the rows are fetched one by one with btree_find_exact()
+ * as the caller returns them, so a limit stops the lookups early. The index roots are read
+ * from the meta page as of the snapshot: an index created, or rebuilt by a bulk load,
+ * after it was taken is not the snapshot's.
+ */
+bool
+table_index_lookup(Cursor* cursor, const Filter* filter, uint32_t* ids, uint32_t* num_ids) {
+        Pager* pager = cursor->table->pager;
+        void* meta = pager_read(pager, META_PAGE_NUM, cursor->snapshot);
+        uint32_t username = *meta_index_root(meta, INDEX_USERNAME);
+        uint32_t email = *meta_index_root(meta, INDEX_EMAIL);
+        pager_unpin(pager, META_PAGE_NUM);
+
+        Table index = {.pager = pager, .right_leaf = INVALID_PAGE_NUM};
+        Cursor lookup = {.snapshot = cursor->snapshot}; // Borrowed, `cursor` releases it
+        if (filter->match_username && username) {
+                index.root_page = username;
+                return index_lookup(&index, filter->username, &lookup, ids, num_ids);
+        }
+        if (filter->match_email && email) {
+                index.root_page = email;
+                return index_lookup(&index, filter->email, &lookup, ids, num_ids);
         }
+        return false;
 }
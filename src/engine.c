@@ -0,0 +1,118 @@
+/**
+ * Library entry points, what the REPL and embedding programs drive the engine through.
+ */
+
+#include "engine.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "metrics.h"
+
+Database*
+db_open(const char* filename, const PagerConfig* config) {
+        PagerConfig defaults;
+        if (!config) {
+                memset(&defaults, 0, sizeof(defaults));
+                config = &defaults;
+        }
+
+        Database* db = (Database*)calloc(1, sizeof(Database));
+        if (!db) {
+                perror("Failed to allocate memory for database");
+                return NULL;
+        }
+
+        db->table = new_table(filename, config);
+        if (!db->table) {
+                free(db);
+                return NULL;
+        }
+        return db;
+}
+
+void
+db_close(Database* db) {
+        if (!db)
+                return;
+        for (uint32_t i = 0; i < DB_STMT_CACHE; i++) stmt_finalize(db->cache.entries[i].stmt);
+        free_table(db->table);
+        free(db);
+}
+
+PrepareResult
+db_prepare(Database* db, const char* sql, Statement** stmt) {
+        return stmt_prepare(db->table, sql, stmt);
+}
+
+static uint64_t
+db_hash(const char* text) {
+        uint64_t hash = 14695981039346656037ULL;
+        for (; *text; text++) hash = (hash ^ (uint8_t)*text) * 1099511628211ULL;
+        return hash;
+}
+
+/*
+ * The cache holds the last DB_STMT_CACHE statements run, so a statement run again is
+ * reset and stepped without being parsed. The oldest one makes room for a new one, which
+ * is compiled into it: once the cache is full, new statements reuse its memory.
+ */
+Statement*
+db_statement(Database* db, const char* sql, PrepareResult* result) {
+        StatementCache* cache = &db->cache;
+        uint64_t hash = db_hash(sql);
+        for (uint32_t i = 0; i < DB_STMT_CACHE; i++) {
+                CachedStatement* entry = &cache->entries[i];
+                if (entry->stmt && entry->hash == hash && strcmp(entry->stmt->sql, sql) == 0) {
+                        replog("reusing prepared statement");
+                        stmt_reset(entry->stmt);
+                        *result = PREPARE_SUCCESS;
+                        return entry->stmt;
+                }
+        }
+
+        CachedStatement* entry = &cache->entries[cache->next];
+        if (entry->stmt)
+                *result = stmt_reprepare(entry->stmt, db->table, sql);
+        else
+                *result = stmt_prepare(db->table, sql, &entry->stmt);
+        if (*result != PREPARE_SUCCESS)
+                return NULL;
+
+        cache->next = (cache->next + 1) % DB_STMT_CACHE;
+        entry->hash = hash;
+        return entry->stmt;
+}
+
+DbResult
+db_run(Statement* stmt, RowCallback callback, void* arg) {
+        uint64_t started = metrics_now();
+        DbResult result = DB_OK;
+        StepResult step;
+        while ((step = stmt_step(stmt)) == STEP_ROW) {
+                if (callback && !callback(stmt_row(stmt), arg)) {
+                        stmt_reset(stmt);
+                        result = DB_ABORTED;
+                        break;
+                }
+        }
+        if (step == STEP_ERROR)
+                result = DB_STEP_ERROR;
+        else if (step == STEP_TXN_ROLLED_BACK)
+                result = DB_TXN_ROLLED_BACK;
+
+        metrics_record_latency(stmt->type, metrics_now() - started);
+        metrics_tick(stmt->table);
+        return result;
+}
+
+DbResult
+db_exec(Database* db, const char* sql, RowCallback callback, void* arg) {
+        PrepareResult result;
+        Statement* stmt = db_statement(db, sql, &result);
+        if (!stmt)
+                return DB_PREPARE_ERROR;
+        return db_run(stmt, callback, arg);
+}
@@ -1,5 +1,9 @@
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
 #include "log.h"
@@ -15,35 +19,137 @@
 #define LIGHT_GRAY_COLOR "\033[40m"
 #define LIGHT_BLUE_COLOR "\033[44m"
 
-// Internal function to get current timestamp
+LogLevel log_level = LogLevel_DEV;
+
+/**
+ * Asynchronous mode. Producers append whole lines at `head`, the writer thread takes
+ * everything up to it from `tail`; both only grow, the ring index is their remainder.
+ */
+static struct {
+        bool running;
+        bool stopping;
+        pthread_t thread;
+        pthread_mutex_t lock;
+        pthread_cond_t queued;  // Signalled when lines are appended or the writer should stop
+        pthread_cond_t drained; // Signalled when the writer frees room
+        uint64_t head;
+        uint64_t tail;
+        char ring[LOG_RING_SIZE];
+} log_async = {.lock = PTHREAD_MUTEX_INITIALIZER, .queued = PTHREAD_COND_INITIALIZER,
+               .drained = PTHREAD_COND_INITIALIZER};
+
+// Internal function to get current timestamp, formatted once per second per thread
+static const char*
+get_timestamp(void) {
+        static __thread time_t cached = -1;
+        static __thread char buffer[64];
+
+        time_t rawtime = time(NULL);
+        if (rawtime != cached) {
+                struct tm timeinfo;
+                localtime_r(&rawtime, &timeinfo);
+                strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", &timeinfo);
+                cached = rawtime;
+        }
+        return buffer;
+}
+
+static void*
+log_writer(void* arg) {
+        (void)arg;
+        pthread_mutex_lock(&log_async.lock);
+        while (1) {
+                while (log_async.head == log_async.tail && !log_async.stopping)
+                        pthread_cond_wait(&log_async.queued, &log_async.lock);
+                if (log_async.head == log_async.tail)
+                        break;
+
+                // Let lines gather for a moment, so one write carries many of them
+                if (!log_async.stopping && log_async.head - log_async.tail < LOG_RING_SIZE / 2) {
+                        struct timespec until;
+                        clock_gettime(CLOCK_REALTIME, &until);
+                        until.tv_nsec += LOG_FLUSH_INTERVAL_MS * 1000000L;
+                        if (until.tv_nsec >= 1000000000L) {
+                                until.tv_sec++;
+                                until.tv_nsec -= 1000000000L;
+                        }
+                        pthread_cond_timedwait(&log_async.queued, &log_async.lock, &until);
+                }
+
+                // Up to the end of the ring at most, the rest goes in the next round
+                uint64_t tail = log_async.tail;
+                size_t offset = tail % LOG_RING_SIZE;
+                size_t len = log_async.head - tail;
+                if (len > LOG_RING_SIZE - offset)
+                        len = LOG_RING_SIZE - offset;
+                pthread_mutex_unlock(&log_async.lock);
+
+                fwrite(log_async.ring + offset, 1, len, stdout);
+                fflush(stdout);
+
+                pthread_mutex_lock(&log_async.lock);
+                log_async.tail += len;
+                pthread_cond_broadcast(&log_async.drained);
+        }
+        pthread_mutex_unlock(&log_async.lock);
+        return NULL;
+}
+
+// Internal function to write out one formatted line, or queue it for the writer
 static void
-get_timestamp(char* buffer, size_t size) {
-        time_t rawtime;
-        struct tm* timeinfo;
+log_emit(const char* line, size_t len) {
+        pthread_mutex_lock(&log_async.lock);
+        while (log_async.running && LOG_RING_SIZE - (log_async.head - log_async.tail) < len)
+                pthread_cond_wait(&log_async.drained, &log_async.lock);
+        if (!log_async.running) {
+                pthread_mutex_unlock(&log_async.lock);
+                fwrite(line, 1, len, stdout);
+                fflush(stdout);
+                return;
+        }
+
+        size_t offset = log_async.head % LOG_RING_SIZE;
+        size_t first = len < LOG_RING_SIZE - offset ? len : LOG_RING_SIZE - offset;
+        memcpy(log_async.ring + offset, line, first);
+        memcpy(log_async.ring, line + first, len - first);
+        // Wake the writer for the first line, and again once half the ring is waiting
+        uint64_t pending = log_async.head - log_async.tail;
+        if (pending == 0 || (pending < LOG_RING_SIZE / 2 && pending + len >= LOG_RING_SIZE / 2))
+                pthread_cond_signal(&log_async.queued);
+        log_async.head += len;
+        pthread_mutex_unlock(&log_async.lock);
+}
 
-        time(&rawtime);
-        timeinfo = localtime(&rawtime);
-        strftime(buffer, size, "%Y-%m-%d %H:%M:%S", timeinfo);
+/** @brief Format `format` after `len` bytes already in `line` and end the line with `suffix`. */
+static size_t
+log_format(char* line, size_t len, const char* suffix, const char* format, va_list args) {
+        if (len < LOG_LINE_MAX) {
+                int n = vsnprintf(line + len, LOG_LINE_MAX - len, format, args);
+                if (n > 0)
+                        len += (size_t)n;
+        }
+        if (len > LOG_LINE_MAX - strlen(suffix) - 2)
+                len = LOG_LINE_MAX - strlen(suffix) - 2;
+        len += sprintf(line + len, "%s\n", suffix);
+        return len;
 }
 
 // Internal function to log with a specific level
 static void
 log_message(const char* level, const char* color, const char* format, va_list args) {
-        char timestamp[64];
-        get_timestamp(timestamp, sizeof(timestamp));
+        char line[LOG_LINE_MAX];
+        int len;
 
 #if defined(NO_COLOR)
         // Print timestamp and level without color
-        printf("[%s] [%s] ", timestamp, level);
+        len = snprintf(line, sizeof(line), "[%s] [%s] ", get_timestamp(), level);
 #else
         // Print timestamp and level with color
-        printf("%s[%s] [%s]%s ", color, timestamp, level, RESET_COLOR);
+        len = snprintf(line, sizeof(line), "%s[%s] [%s]%s ", color, get_timestamp(), level, RESET_COLOR);
 #endif
 
         // Print the actual message
-        vprintf(format, args);
-        printf("\n");
-        fflush(stdout);
+        log_emit(line, log_format(line, len, "", format, args));
 }
 
 void
@@ -59,6 +165,7 @@ log_wrap(LogLevel level, const char* file, int line, const char* message, ...) {
                 case LogLevel_FATAL: log_message("FATAL", RED_COLOR, message, args); break;
                 default: break;
         }
+        va_end(args);
 }
 
 void
@@ -66,17 +173,18 @@ logdb(LogLevel level, const char* file, int line, const char* message, ...) {
         va_list args;
         va_start(args, message);
 
+        char text[LOG_LINE_MAX];
+        int len;
 #if defined(NO_COLOR)
-        // Print timestamp and level without color
-        printf("%s", message);
+        // Print the message alone
+        len = 0;
+        log_emit(text, log_format(text, len, "", message, args));
 #else
-        // Print timestamp and level with color
-        printf("%s(%s %d) ", GRAY_COLOR, file, line);
-
+        // Print the location with color
+        len = snprintf(text, sizeof(text), "%s(%s %d) ", GRAY_COLOR, file, line);
+        log_emit(text, log_format(text, len, RESET_COLOR, message, args));
 #endif
-        vprintf(message, args);
-        printf("%s\n", RESET_COLOR);
-        fflush(stdout);
+        va_end(args);
 }
 
 void
@@ -84,26 +192,80 @@ logrepl(LogLevel level, const char* file, int line, const char* message, ...) {
         va_list args;
         va_start(args, message);
 
-        char prefix[128];
+        char text[LOG_LINE_MAX];
         int prefix_len;
 
 #if defined(NO_COLOR)
-        prefix_len = snprintf(prefix, sizeof(prefix), "(%s %d)", file, line);
+        prefix_len = snprintf(text, sizeof(text), "(%s %d)", file, line);
 #else
-        prefix_len = snprintf(prefix, sizeof(prefix), "%s(%s %d)", YELLOW_COLOR, file, line);
+        prefix_len = snprintf(text, sizeof(text), "%s(%s %d)", YELLOW_COLOR, file, line);
 #endif
 
         // Calculate padding to align message
         int padding = 30 - prefix_len;
         if (padding < 1)
                 padding = 1;
+        memset(text + prefix_len, ' ', padding); // Prefix + padding
+
+        // Format the message after them
+        log_emit(text, log_format(text, prefix_len + padding, RESET_COLOR, message, args));
+        va_end(args);
+}
 
-        printf("%s%*s", prefix, padding, ""); // Print prefix + padding
+void
+log_set_level(LogLevel level) {
+        log_level = level;
+}
 
-        // Print the formatted message
-        vprintf(message, args);
-        printf("%s\n", RESET_COLOR);
+bool
+log_level_parse(const char* name, LogLevel* level) {
+        static const char* names[] = {
+                [LogLevel_DEV] = "dev",     [LogLevel_DEBUG] = "debug", [LogLevel_INFO] = "info",
+                [LogLevel_WARN] = "warn",   [LogLevel_ERROR] = "error", [LogLevel_FATAL] = "fatal",
+                [LogLevel_OFF] = "off",
+        };
+        for (LogLevel l = LogLevel_DEV; l <= LogLevel_OFF; l++) {
+                if (strcmp(name, names[l]) == 0) {
+                        *level = l;
+                        return true;
+                }
+        }
+        return false;
+}
 
-        va_end(args);
-        fflush(stdout);
-}
\ No newline at end of file
+void
+log_async_start(void) {
+        static bool registered = false;
+        pthread_mutex_lock(&log_async.lock);
+        if (log_async.running) {
+                pthread_mutex_unlock(&log_async.lock);
+                return;
+        }
+        log_async.stopping = false;
+        if (pthread_create(&log_async.thread, NULL, log_writer, NULL) != 0) {
+                pthread_mutex_unlock(&log_async.lock);
+                return; // Stay synchronous
+        }
+        log_async.running = true;
+        pthread_mutex_unlock(&log_async.lock);
+        if (!registered)
+                atexit(log_async_stop);
+        registered = true;
+}
+
+void
+log_async_stop(void) {
+        pthread_mutex_lock(&log_async.lock);
+        if (!log_async.running) {
+                pthread_mutex_unlock(&log_async.lock);
+                return;
+        }
+        // Lines logged from here on are written in place, the writer drains the rest
+        log_async.running = false;
+        log_async.stopping = true;
+        pthread_cond_signal(&log_async.queued);
+        pthread_cond_broadcast(&log_async.drained);
+        pthread_mutex_unlock(&log_async.lock);
+
+        pthread_join(log_async.thread, NULL);
+}
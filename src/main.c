@@ -25,6 +25,7 @@ preprocess(void) {
 int
 main(int argc, char const** argv) {
         info("Hello, World!");
+        info("Key search: %s", keys_search_isa());
 
         if (argc > 1) {
                 info("Arguments provided:");
@@ -0,0 +1,161 @@
+/**
+ * Engine metrics registry, reported by `.stats` and the periodic JSON dump.
+ */
+
+#include "metrics.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+Metrics metrics;
+
+/** Statements that get a latency histogram, by the name they are reported under */
+static const char* command_names[] = {
+        [COMMAND_SELECT] = "select", [COMMAND_INSERT] = "insert", [COMMAND_UPDATE] = "update",
+        [COMMAND_DELETE] = "delete", [COMMAND_BEGIN] = "begin",   [COMMAND_COMMIT] = "commit",
+        [COMMAND_ROLLBACK] = "rollback",
+};
+
+uint64_t
+metrics_now(void) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void
+metrics_record_latency(CommandType type, uint64_t ns) {
+        LatencyHistogram* histogram = &metrics.latency[type];
+        uint32_t bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+        if (bucket >= METRICS_LATENCY_BUCKETS)
+                bucket = METRICS_LATENCY_BUCKETS - 1;
+        __atomic_fetch_add(&histogram->buckets[bucket], 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&histogram->total_ns, ns, __ATOMIC_RELAXED);
+        uint64_t max = __atomic_load_n(&histogram->max_ns, __ATOMIC_RELAXED);
+        while (ns > max && !__atomic_compare_exchange_n(&histogram->max_ns, &max, ns, true, __ATOMIC_RELAXED,
+                                                         __ATOMIC_RELAXED))
+                ;
+}
+
+/** @brief Upper bound of the bucket holding the `q` quantile, the histogram's resolution. */
+static uint64_t
+histogram_quantile(const LatencyHistogram* histogram, double q) {
+        uint64_t rank = (uint64_t)(q * histogram->count);
+        uint64_t seen = 0;
+        for (uint32_t i = 0; i < METRICS_LATENCY_BUCKETS; i++) {
+                seen += histogram->buckets[i];
+                if (seen > rank)
+                        return 2ULL << i < histogram->max_ns ? 2ULL << i : histogram->max_ns;
+        }
+        return histogram->max_ns;
+}
+
+void
+metrics_print(Table* table) {
+        // Taken before the walk below adds its own page lookups
+        PagerStats stats = table->pager->stats;
+        PagerStats* pager = &stats;
+        WalStats* wal = &table->pager->wal->stats;
+        uint64_t lookups = pager->hits + pager->misses;
+        TreeShape shape;
+        table_shape(table->pager, table->root_page, true, &shape);
+
+        printf("page reads: %" PRIu64 ", %" PRIu64 " read ahead\n", pager->reads, pager->prefetched);
+        printf("page writes: %" PRIu64 " to the log, %" PRIu64 " checkpointed\n", wal->frames,
+               wal->pages_checkpointed);
+        printf("cache hits: %" PRIu64 "\n", pager->hits);
+        printf("cache misses: %" PRIu64 "\n", pager->misses);
+        printf("hit ratio: %.2f%%\n", lookups ? 100.0 * pager->hits / lookups : 0.0);
+        printf("leaf splits: %" PRIu64 "\n", metrics.leaf_splits);
+        printf("internal splits: %" PRIu64 "\n", metrics.internal_splits);
+        printf("tree height: %u\n", shape.height);
+        printf("leaves: %u, %.1f%% full\n", shape.leaves, 100.0 * shape.leaf_fill);
+        printf("internal nodes: %u, %.1f%% full\n", shape.internal_nodes, 100.0 * shape.internal_fill);
+        printf("rows: %" PRIu64 "\n", shape.cells);
+        printf("rows scanned: %" PRIu64 "\n", metrics.rows_scanned);
+        printf("rows returned: %" PRIu64 "\n", metrics.rows_returned);
+        printf("%-10s %10s %10s %10s %10s %10s\n", "latency", "count", "mean us", "p50 us", "p99 us", "max us");
+        for (CommandType type = 0; type <= COMMAND_SIZING_ERR; type++) {
+                LatencyHistogram* histogram = &metrics.latency[type];
+                if (!command_names[type] || histogram->count == 0)
+                        continue;
+                printf("%-10s %10" PRIu64 " %10.1f %10.1f %10.1f %10.1f\n", command_names[type], histogram->count,
+                       histogram->total_ns / 1e3 / histogram->count, histogram_quantile(histogram, 0.50) / 1e3,
+                       histogram_quantile(histogram, 0.99) / 1e3, histogram->max_ns / 1e3);
+        }
+}
+
+void
+metrics_write_json(Table* table, FILE* out) {
+        PagerStats* pager = &table->pager->stats;
+        WalStats* wal = &table->pager->wal->stats;
+        TreeShape shape;
+        table_shape(table->pager, table->root_page, false, &shape);
+
+        fprintf(out, "{\"time\":%lld,", (long long)time(NULL));
+        fprintf(out,
+                "\"pages\":{\"reads\":%" PRIu64 ",\"read_ahead\":%" PRIu64 ",\"log_writes\":%" PRIu64
+                ",\"checkpoint_writes\":%" PRIu64 ",\"hits\":%" PRIu64 ",\"misses\":%" PRIu64 "},",
+                pager->reads, pager->prefetched, wal->frames, wal->pages_checkpointed, pager->hits, pager->misses);
+        fprintf(out, "\"splits\":{\"leaf\":%" PRIu64 ",\"internal\":%" PRIu64 "},", metrics.leaf_splits,
+                metrics.internal_splits);
+        fprintf(out, "\"tree\":{\"height\":%u},", shape.height);
+        fprintf(out, "\"rows\":{\"scanned\":%" PRIu64 ",\"returned\":%" PRIu64 "},", metrics.rows_scanned,
+                metrics.rows_returned);
+        fprintf(out, "\"latency\":{");
+        bool first = true;
+        for (CommandType type = 0; type <= COMMAND_SIZING_ERR; type++) {
+                LatencyHistogram* histogram = &metrics.latency[type];
+                if (!command_names[type])
+                        continue;
+                fprintf(out,
+                        "%s\"%s\":{\"count\":%" PRIu64 ",\"total_ns\":%" PRIu64 ",\"p50_ns\":%" PRIu64
+                        ",\"p99_ns\":%" PRIu64 ",\"max_ns\":%" PRIu64 ",\"buckets\":[",
+                        first ? "" : ",", command_names[type], histogram->count, histogram->total_ns,
+                        histogram_quantile(histogram, 0.50), histogram_quantile(histogram, 0.99), histogram->max_ns);
+                for (uint32_t i = 0; i < METRICS_LATENCY_BUCKETS; i++)
+                        fprintf(out, "%s%" PRIu64, i ? "," : "", histogram->buckets[i]);
+                fprintf(out, "]}");
+                first = false;
+        }
+        fprintf(out, "}}\n");
+}
+
+void
+metrics_dump_start(const char* path, uint32_t interval) {
+        free(metrics.dump_path);
+        metrics.dump_path = strdup(path);
+        metrics.dump_interval = interval ? interval : METRICS_DEFAULT_INTERVAL;
+        metrics.next_dump_ns = metrics_now();
+}
+
+void
+metrics_tick(Table* table) {
+        if (!metrics.dump_path)
+                return;
+        uint64_t now = metrics_now();
+        uint64_t due = __atomic_load_n(&metrics.next_dump_ns, __ATOMIC_RELAXED);
+        // Of the threads finding a dump due, the one moving the deadline writes it
+        if (now < due || !__atomic_compare_exchange_n(&metrics.next_dump_ns, &due,
+                                                      now + metrics.dump_interval * 1000000000ULL, false,
+                                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                return;
+
+        /* Written beside the file and renamed over it */
+        size_t len = strlen(metrics.dump_path) + sizeof(".tmp");
+        char* tmp = malloc(len);
+        snprintf(tmp, len, "%s.tmp", metrics.dump_path);
+        FILE* out = fopen(tmp, "w");
+        if (!out) {
+                replog("unable to write metrics to %s", tmp);
+                free(tmp);
+                return;
+        }
+        metrics_write_json(table, out);
+        fclose(out);
+        rename(tmp, metrics.dump_path);
+        free(tmp);
+}
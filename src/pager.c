@@ -0,0 +1,1013 @@
+#include "pager.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "log.h"
+
+/** @brief Byte offset of a page within the database file. */
+#define PAGE_OFFSET(page_num) ((off_t)(page_num) * PAGE_SIZE)
+
+/** @brief Bump a counter that lookups from several threads update at once. */
+#define PAGER_COUNT(pager, name) __atomic_fetch_add(&(pager)->stats.name, 1, __ATOMIC_RELAXED)
+
+/** Its address identifies the calling thread as the owner of a write transaction */
+static __thread char pager_thread;
+
+static uint32_t
+pager_hash(Pager* pager, uint32_t page_num) {
+        // Fibonacci hashing spreads sequential page numbers across the buckets.
+        return (page_num * 2654435761u) & pager->bucket_mask;
+}
+
+static pthread_mutex_t*
+pager_shard(Pager* pager, uint32_t page_num) {
+        return &pager->shards[pager_hash(pager, page_num) % PAGER_SHARDS];
+}
+
+bool
+pager_writing(Pager* pager) {
+        // Only the owner stores its own token, no other thread can read it back.
+        return __atomic_load_n(&pager->writer_thread, __ATOMIC_RELAXED) == &pager_thread;
+}
+
+static uint32_t
+pager_lookup(Pager* pager, uint32_t page_num) {
+        uint32_t idx = pager->buckets[pager_hash(pager, page_num)];
+        while (idx != INVALID_PAGE_NUM) {
+                if (pager->frames[idx].page_num == page_num)
+                        return idx;
+                idx = pager->frames[idx].next;
+        }
+        return INVALID_PAGE_NUM;
+}
+
+static void
+pager_hash_insert(Pager* pager, uint32_t frame_idx) {
+        uint32_t bucket = pager_hash(pager, pager->frames[frame_idx].page_num);
+        pager->frames[frame_idx].next = pager->buckets[bucket];
+        pager->buckets[bucket] = frame_idx;
+}
+
+static void
+pager_hash_remove(Pager* pager, uint32_t frame_idx) {
+        uint32_t* link = &pager->buckets[pager_hash(pager, pager->frames[frame_idx].page_num)];
+        while (*link != frame_idx) link = &pager->frames[*link].next;
+        *link = pager->frames[frame_idx].next;
+}
+
+/** @brief Take a reference on a cached frame, with its shard locked. */
+static void
+pager_pin(Frame* frame) {
+        frame->pin_count++;
+        frame->referenced = true;
+}
+
+static void*
+pager_alloc_page(void) {
+        void* page = malloc(PAGE_SIZE);
+        if (!page) {
+                printf("Unable to allocate a page\n");
+                exit(EXIT_FAILURE);
+        }
+        return page;
+}
+
+/**
+ * @brief A page buffer for a shadow or a frame, off the spare list.
+ * The list starts with half the pool and takes back every buffer a version or a shadow
+ * gives up, so the heap is only touched while it grows. Used by the writer alone.
+ */
+static void*
+pager_take_page(Pager* pager) {
+        void* page = pager->spare_pages;
+        if (!page)
+                return pager_alloc_page();
+        pager->spare_pages = *(void**)page;
+        return page;
+}
+
+static void
+pager_give_page(Pager* pager, void* page) {
+        *(void**)page = pager->spare_pages;
+        pager->spare_pages = page;
+}
+
+/** @brief A version off the spare list, see pager_take_page(). */
+static PageVersion*
+pager_take_version(Pager* pager) {
+        PageVersion* version = pager->spare_versions;
+        if (version) {
+                pager->spare_versions = version->next;
+                return version;
+        }
+        version = malloc(sizeof(PageVersion));
+        if (!version) {
+                printf("Unable to allocate a page version\n");
+                exit(EXIT_FAILURE);
+        }
+        return version;
+}
+
+static void
+pager_give_version(Pager* pager, PageVersion* version) {
+        version->next = pager->spare_versions;
+        pager->spare_versions = version;
+}
+
+/**
+ * @brief Pick a frame for a new page, evicting an unpinned page if the pool is full.
+ * Uses the CLOCK policy: the hand sweeps the pool clearing reference bits and
+ * stops at the first unpinned frame that has not been touched since the last sweep.
+ * Dirty pages are never chosen and clean pages are already in the WAL or the
+ * database file, so a victim is dropped without being written. Called with `pool_lock`
+ * held, which keeps every frame's page number still; each candidate is checked under
+ * its shard's lock as readers pin pages under it alone.
+ */
+static uint32_t
+pager_victim(Pager* pager) {
+        if (pager->used_frames < pager->num_frames)
+                return pager->used_frames++;
+
+        for (uint32_t sweep = 0; sweep < 2 * pager->num_frames; sweep++) {
+                uint32_t idx = pager->clock_hand;
+                Frame* frame = &pager->frames[idx];
+                pager->clock_hand = (pager->clock_hand + 1) % pager->num_frames;
+
+                if (frame->page_num == INVALID_PAGE_NUM)
+                        return idx; // Released by a rollback
+
+                pthread_mutex_t* shard = pager_shard(pager, frame->page_num);
+                pthread_mutex_lock(shard);
+                if (frame->pin_count > 0 || frame->dirty) {
+                        pthread_mutex_unlock(shard);
+                        continue;
+                }
+                if (frame->referenced) {
+                        frame->referenced = false;
+                        pthread_mutex_unlock(shard);
+                        continue;
+                }
+
+                pager->stats.evictions++;
+                pager_hash_remove(pager, idx);
+                frame->page_num = INVALID_PAGE_NUM;
+                pthread_mutex_unlock(shard);
+                return idx;
+        }
+
+        printf("Buffer pool exhausted, all %d frames are pinned or dirty\n", pager->num_frames);
+        exit(EXIT_FAILURE);
+}
+
+/**
+ * @brief Read whole pages at `offset`, retrying interrupted and short reads.
+ * Bytes past the end of the file are left as they are, callers zero them first.
+ */
+static void
+pager_preadv(Pager* pager, struct iovec* iov, int iovcnt, off_t offset) {
+        while (iovcnt > 0) {
+                ssize_t bytes_read = preadv(pager->fd, iov, iovcnt, offset);
+                PAGER_COUNT(pager, reads);
+                if (bytes_read == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        printf("Error reading file: %d\n", errno);
+                        exit(EXIT_FAILURE);
+                }
+                if (bytes_read == 0)
+                        return; // End of file
+                offset += bytes_read;
+                while (iovcnt > 0 && (size_t)bytes_read >= iov->iov_len) {
+                        bytes_read -= iov->iov_len;
+                        iov++;
+                        iovcnt--;
+                }
+                if (iovcnt > 0) {
+                        iov->iov_base = (char*)iov->iov_base + bytes_read;
+                        iov->iov_len -= bytes_read;
+                }
+        }
+}
+
+static void
+pager_map(Pager* pager, size_t len) {
+        void* map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, pager->fd, 0);
+        if (map == MAP_FAILED) {
+                printf("Error mapping file: %d\n", errno);
+                exit(EXIT_FAILURE);
+        }
+        pager->map = map;
+        pager->map_len = len;
+}
+
+/**
+ * @brief Map a larger window of the file once it outgrows the current mapping.
+ * Loads copy pages out of the mapping without `pool_lock`, so the old one stays mapped
+ * until the pager is freed. Each window is twice the last, together they never take more
+ * address space than the newest.
+ */
+static void
+pager_remap(Pager* pager) {
+        size_t len = pager->map_len;
+        while (len < (size_t)pager->file_len) len *= 2;
+        if (pager->num_old_maps == PAGER_MAX_MAPS) {
+                printf("Database file outgrew %d mappings\n", PAGER_MAX_MAPS);
+                exit(EXIT_FAILURE);
+        }
+        pager->old_maps[pager->num_old_maps].addr = pager->map;
+        pager->old_maps[pager->num_old_maps++].len = pager->map_len;
+        pager_map(pager, len);
+        pager->stats.remaps++;
+}
+
+/**
+ * @brief Address of a page inside the mapping, NULL if it has to be read instead.
+ * Pages past the end of the file are new, touching them in the mapping would fault.
+ */
+static void*
+pager_mapped_page(Pager* pager, uint32_t page_num) {
+        off_t end = PAGE_OFFSET(page_num + 1);
+        if (end > pager->file_len) {
+                // The checkpointer grows the file behind our back.
+                struct stat st;
+                if (fstat(pager->fd, &st) == -1 || end > st.st_size)
+                        return NULL;
+                pager->file_len = st.st_size;
+        }
+        if ((size_t)end > pager->map_len)
+                pager_remap(pager);
+        return pager->map + PAGE_OFFSET(page_num);
+}
+
+/**
+ * @brief Whether a version of `page_num` holds its page of the mapping, with the shard locked.
+ * That page is private and keeps an image older than the file's until the version is
+ * reclaimed, a load must read the file instead.
+ */
+static bool
+pager_mapped_version(Pager* pager, uint32_t page_num) {
+        for (PageVersion* version = pager->versions[pager_hash(pager, page_num)]; version; version = version->next) {
+                if (version->page_num == page_num && version->mapped)
+                        return true;
+        }
+        return false;
+}
+
+/**
+ * @brief Give a page of the mapping a private copy, so writes to the file no longer show in it.
+ * The contents stay the same, readers on the page see no change.
+ */
+static void
+pager_privatize(void* page) {
+#ifdef MADV_POPULATE_WRITE
+        if (madvise(page, PAGE_SIZE, MADV_POPULATE_WRITE) == 0)
+                return;
+#endif
+        // Older kernels take the copy on the first write, storing the byte already there
+        volatile char* byte = page;
+        *byte = *byte;
+}
+
+/** @brief Drop the private copy of a page of the mapping, it shows the file again. */
+static void
+pager_unprivatize(void* page) {
+        if (madvise(page, PAGE_SIZE, MADV_DONTNEED) == -1) {
+                printf("Error releasing a mapped page: %d\n", errno);
+                exit(EXIT_FAILURE);
+        }
+}
+
+/**
+ * @brief Finish reads ahead that have completed, blocking for one if `wait` is set.
+ * A short read is completed synchronously, bytes past the end of the file stay zero.
+ * Called with `pool_lock` held.
+ */
+static void
+pager_reap(Pager* pager, bool wait) {
+        AioCompletion completions[AIO_DEPTH];
+        uint32_t count = aio_reap(pager->aio, completions, AIO_DEPTH, wait);
+
+        for (uint32_t i = 0; i < count; i++) {
+                PagerRead* read = &pager->reads[completions[i].tag];
+                ssize_t result = completions[i].result;
+                if (result < 0) {
+                        printf("Error reading file: %d\n", (int)-result);
+                        exit(EXIT_FAILURE);
+                }
+
+                size_t expected = (size_t)read->len * PAGE_SIZE;
+                if ((size_t)result < expected) {
+                        uint32_t first = result / PAGE_SIZE;
+                        size_t partial = result % PAGE_SIZE;
+                        read->iov[first].iov_base = (char*)read->iov[first].iov_base + partial;
+                        read->iov[first].iov_len -= partial;
+                        pager_preadv(pager, read->iov + first, read->len - first, read->offset + result);
+                }
+
+                for (uint32_t j = 0; j < read->len; j++) {
+                        Frame* frame = &pager->frames[read->frame_idxs[j]];
+                        pthread_mutex_t* shard = pager_shard(pager, frame->page_num);
+                        pthread_mutex_lock(shard);
+                        frame->loading = false;
+                        frame->pin_count--;
+                        pthread_mutex_unlock(shard);
+                }
+                pager->reading -= read->len;
+                read->busy = false;
+        }
+}
+
+static void
+pager_submit_read(Pager* pager, PagerRead* read) {
+        for (uint32_t i = 0; i < read->len; i++) {
+                read->iov[i].iov_base = pager->frames[read->frame_idxs[i]].buffer;
+                read->iov[i].iov_len = PAGE_SIZE;
+        }
+        aio_submit_read(pager->aio, read->iov, read->len, read->offset, read - pager->reads);
+        pager->stats.async_reads++;
+}
+
+static PagerRead*
+pager_free_read(Pager* pager) {
+        for (uint32_t i = 0; i < AIO_DEPTH; i++) {
+                if (!pager->reads[i].busy)
+                        return &pager->reads[i];
+        }
+        return NULL;
+}
+
+Pager*
+new_pager(const char* filename, const PagerConfig* config) {
+        int fd = open(filename,
+                      O_RDWR |  // Read/Write mode
+                      O_CREAT,  // Create file if it does not exist
+                      S_IWUSR | // User write permission
+                      S_IRUSR   // User read permission
+        );
+
+        if (fd == -1) {
+                printf("Unable to open file\n");
+                exit(EXIT_FAILURE);
+        }
+
+        // Replay a WAL left behind by a crash before the file length is trusted.
+        WalSyncMode wal_sync = config ? config->wal_sync : WAL_SYNC_FULL;
+        Wal* wal = wal_open(filename, fd, wal_sync);
+
+        // lseek() returns the offset of the file pointer, which is the file length if
+        // we seek to the end of the file.
+        off_t file_length = lseek(fd, 0, SEEK_END);
+        if (file_length % PAGE_SIZE != 0) {
+                printf("Db file is not a whole number of pages. Corrupt file.\n");
+                exit(EXIT_FAILURE);
+        }
+
+        uint32_t num_frames = (config && config->pool_frames) ? config->pool_frames : PAGER_DEFAULT_FRAMES;
+        if (num_frames < PAGER_MIN_FRAMES)
+                num_frames = PAGER_MIN_FRAMES;
+
+        // Two buckets per frame keeps the chains short.
+        uint32_t num_buckets = 1;
+        while (num_buckets < 2 * num_frames) num_buckets <<= 1;
+
+        // Create a new Pager instance and initialize it.
+        Pager* pager = calloc(1, sizeof(Pager));
+        pager->num_pages = file_length / PAGE_SIZE;
+        pager->file_len = file_length;
+        pager->fd = fd;
+        pager->wal = wal;
+        pager->mode = config ? config->mode : PAGER_MODE_READ;
+        if (pager->mode == PAGER_MODE_READ)
+                pager->aio = aio_open(fd, config ? config->aio : AIO_BACKEND_AUTO);
+
+        pager->num_frames = num_frames;
+        pager->frames = calloc(num_frames, sizeof(Frame));
+        pager->buckets = malloc(num_buckets * sizeof(uint32_t));
+        pager->bucket_mask = num_buckets - 1;
+        pager->versions = calloc(num_buckets, sizeof(PageVersion*));
+        pager->dirty_frames = malloc(num_frames * sizeof(uint32_t));
+        pager->txn_page_nums = malloc(num_frames * sizeof(uint32_t));
+        pager->txn_pages = malloc(num_frames * sizeof(void*));
+
+        if (!pager->frames || !pager->buckets || !pager->versions || !pager->dirty_frames ||
+            !pager->txn_page_nums || !pager->txn_pages) {
+                printf("Unable to allocate buffer pool of %d frames\n", num_frames);
+                exit(EXIT_FAILURE);
+        }
+
+        // Each frame owns its buffer, a commit hands it to a version and takes the shadow's.
+        for (uint32_t i = 0; i < num_buckets; i++) pager->buckets[i] = INVALID_PAGE_NUM;
+        for (uint32_t i = 0; i < num_frames; i++) {
+                pager->frames[i].page_num = INVALID_PAGE_NUM;
+                pager->frames[i].next = INVALID_PAGE_NUM;
+                pager->frames[i].buffer = pager_alloc_page();
+                pager->frames[i].data = pager->frames[i].buffer;
+        }
+
+        // Half the pool is the most a statement dirties before it is rolled back, or a
+        // load commits. Each commit turns that many shadows into frames and versions.
+        for (uint32_t i = 0; i < num_frames / 2; i++) {
+                pager_give_page(pager, pager_alloc_page());
+                pager_give_version(pager, pager_take_version(pager));
+        }
+
+        pthread_mutex_init(&pager->pool_lock, NULL);
+        pthread_cond_init(&pager->loaded, NULL);
+        for (uint32_t i = 0; i < PAGER_SHARDS; i++) pthread_mutex_init(&pager->shards[i], NULL);
+        pthread_mutex_init(&pager->snapshot_lock, NULL);
+        pthread_mutex_init(&pager->writer, NULL);
+
+        if (pager->mode == PAGER_MODE_MMAP) {
+                size_t len = PAGER_MMAP_MIN_LEN;
+                while (len < 2 * (size_t)file_length) len *= 2;
+                pager_map(pager, len);
+        }
+        return pager;
+}
+
+/**
+ * @brief Wait for the load of a frame the caller has pinned.
+ * A read ahead only completes when someone reaps it, which the waiter does while reads
+ * are in flight; a miss loading the frame wakes it instead.
+ */
+static void
+pager_wait_loaded(Pager* pager, Frame* frame) {
+        PAGER_COUNT(pager, waits);
+        pthread_mutex_lock(&pager->pool_lock);
+        while (frame->loading) {
+                if (pager->reading > 0)
+                        pager_reap(pager, true);
+                else
+                        pthread_cond_wait(&pager->loaded, &pager->pool_lock);
+        }
+        pthread_mutex_unlock(&pager->pool_lock);
+}
+
+/**
+ * @brief Bring a page missing from the pool into a frame, returning the frame pinned.
+ * The page is looked up again under `pool_lock` in case another thread loaded it first.
+ * Otherwise a frame is taken for it and published as loading, as a read ahead does, and
+ * the lock is dropped for the read: other misses go on, and fetches of this page wait.
+ * A page the file holds the newest image of is served straight from the mapping.
+ */
+static uint32_t
+pager_load(Pager* pager, uint32_t page_num) {
+        pthread_mutex_t* shard = pager_shard(pager, page_num);
+        pthread_mutex_lock(&pager->pool_lock);
+        pthread_mutex_lock(shard);
+        uint32_t idx = pager_lookup(pager, page_num);
+        if (idx != INVALID_PAGE_NUM) {
+                PAGER_COUNT(pager, hits);
+                Frame* frame = &pager->frames[idx];
+                pager_pin(frame);
+                bool loading = frame->loading;
+                pthread_mutex_unlock(shard);
+                pthread_mutex_unlock(&pager->pool_lock);
+                if (loading)
+                        pager_wait_loaded(pager, frame);
+                return idx;
+        }
+        pthread_mutex_unlock(shard);
+
+        PAGER_COUNT(pager, misses);
+        idx = pager_victim(pager);
+        Frame* frame = &pager->frames[idx];
+        // Where the page lives in the file is settled under the lock, a remap moves the window.
+        void* mapped = pager->map ? pager_mapped_page(pager, page_num) : NULL;
+        pthread_mutex_lock(shard);
+        if (mapped && pager_mapped_version(pager, page_num))
+                mapped = NULL;
+        frame->page_num = page_num;
+        frame->pin_count = 1;
+        frame->referenced = true;
+        frame->dirty = false;
+        frame->loading = true;
+        frame->data = frame->buffer;
+        pager_hash_insert(pager, idx);
+        pthread_mutex_unlock(shard);
+
+        struct stat st;
+        // A page committed past the end may have been checkpointed since the log restarted.
+        if (!mapped && PAGE_OFFSET(page_num) >= pager->file_len && fstat(pager->fd, &st) == 0)
+                pager->file_len = st.st_size;
+        bool in_file = PAGE_OFFSET(page_num) < pager->file_len;
+        if (page_num >= pager->num_pages)
+                pager->num_pages = page_num + 1;
+        pthread_mutex_unlock(&pager->pool_lock);
+
+        // The newest committed image lives in the WAL until it is checkpointed.
+        void* data = frame->buffer;
+        if (wal_read_page(pager->wal, page_num, frame->buffer)) {
+        } else if (mapped) {
+                data = mapped;
+                PAGER_COUNT(pager, mapped);
+        } else {
+                memset(frame->buffer, 0, PAGE_SIZE);
+                if (in_file) {
+                        struct iovec iov = {.iov_base = frame->buffer, .iov_len = PAGE_SIZE};
+                        pager_preadv(pager, &iov, 1, PAGE_OFFSET(page_num));
+                }
+        }
+
+        pthread_mutex_lock(&pager->pool_lock);
+        pthread_mutex_lock(shard);
+        frame->data = data;
+        frame->loading = false;
+        pthread_mutex_unlock(shard);
+        pthread_cond_broadcast(&pager->loaded);
+        pthread_mutex_unlock(&pager->pool_lock);
+        return idx;
+}
+
+/** @brief Pin `page_num` in the pool, returning its frame. */
+static uint32_t
+pager_fetch(Pager* pager, uint32_t page_num) {
+        if (page_num == INVALID_PAGE_NUM) {
+                printf("Tried to fetch invalid page number\n");
+                exit(EXIT_FAILURE);
+        }
+
+        pthread_mutex_t* shard = pager_shard(pager, page_num);
+        pthread_mutex_lock(shard);
+        uint32_t idx = pager_lookup(pager, page_num);
+        if (idx == INVALID_PAGE_NUM) {
+                pthread_mutex_unlock(shard);
+                return pager_load(pager, page_num);
+        }
+
+        // Cache hit. Pin the page, waiting for it if a read ahead is still loading it.
+        Frame* frame = &pager->frames[idx];
+        pager_pin(frame);
+        bool loading = frame->loading;
+        pthread_mutex_unlock(shard);
+        PAGER_COUNT(pager, hits);
+        if (loading)
+                pager_wait_loaded(pager, frame);
+        return idx;
+}
+
+void*
+get_page(Pager* pager, uint32_t page_num) {
+        uint32_t idx = pager_fetch(pager, page_num);
+        Frame* frame = &pager->frames[idx];
+        // The frame is pinned and only the writer sets its shadow or swaps its image.
+        if (pager_writing(pager) && frame->shadow)
+                return frame->shadow;
+        return frame->data;
+}
+
+void
+pager_unpin(Pager* pager, uint32_t page_num) {
+        pthread_mutex_t* shard = pager_shard(pager, page_num);
+        pthread_mutex_lock(shard);
+        uint32_t idx = pager_lookup(pager, page_num);
+        if (idx == INVALID_PAGE_NUM || pager->frames[idx].pin_count == 0) {
+                printf("Tried to unpin page %d which is not pinned\n", page_num);
+                exit(EXIT_FAILURE);
+        }
+        pager->frames[idx].pin_count--;
+        pthread_mutex_unlock(shard);
+}
+
+/** @brief The version of a page `snapshot` reads, NULL for the frame's image. Called with the shard locked. */
+static PageVersion*
+pager_version(Pager* pager, uint32_t page_num, uint64_t snapshot) {
+        PageVersion* visible = NULL;
+        for (PageVersion* version = pager->versions[pager_hash(pager, page_num)]; version; version = version->next) {
+                // Newer versions come first, the last one past the snapshot is the one it saw
+                if (version->page_num == page_num && version->end > snapshot)
+                        visible = version;
+        }
+        return visible;
+}
+
+void*
+pager_read(Pager* pager, uint32_t page_num, uint64_t snapshot) {
+        if (pager_writing(pager))
+                return get_page(pager, page_num);
+
+        uint32_t idx = pager_fetch(pager, page_num);
+        pthread_mutex_t* shard = pager_shard(pager, page_num);
+        pthread_mutex_lock(shard);
+        PageVersion* version = pager_version(pager, page_num, snapshot);
+        void* data = version ? version->data : pager->frames[idx].data;
+        pthread_mutex_unlock(shard);
+        return data;
+}
+
+/*
+ * Snapshots are kept in ascending order: a new one is the newest commit, never below one
+ * already held. The commit count moves under the same lock, so a commit reclaiming
+ * versions sees every snapshot that could still read them.
+ */
+uint64_t
+pager_snapshot(Pager* pager) {
+        pthread_mutex_lock(&pager->snapshot_lock);
+        if (pager->num_snapshots == pager->snapshots_cap) {
+                pager->snapshots_cap = pager->snapshots_cap ? 2 * pager->snapshots_cap : 16;
+                pager->snapshots = realloc(pager->snapshots, pager->snapshots_cap * sizeof(uint64_t));
+                if (!pager->snapshots) {
+                        printf("Unable to allocate %d snapshots\n", pager->snapshots_cap);
+                        exit(EXIT_FAILURE);
+                }
+        }
+        uint64_t snapshot = pager->commit_seq;
+        pager->snapshots[pager->num_snapshots++] = snapshot;
+        pthread_mutex_unlock(&pager->snapshot_lock);
+        return snapshot;
+}
+
+/** @brief Index of the first held snapshot at or above `seq`, with `snapshot_lock` held. */
+static uint32_t
+pager_snapshot_index(Pager* pager, uint64_t seq) {
+        uint32_t lo = 0;
+        uint32_t hi = pager->num_snapshots;
+        while (lo < hi) {
+                uint32_t mid = lo + (hi - lo) / 2;
+                if (pager->snapshots[mid] < seq)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+        return lo;
+}
+
+void
+pager_snapshot_release(Pager* pager, uint64_t snapshot) {
+        pthread_mutex_lock(&pager->snapshot_lock);
+        uint32_t i = pager_snapshot_index(pager, snapshot);
+        if (i == pager->num_snapshots || pager->snapshots[i] != snapshot) {
+                printf("Tried to release snapshot %" PRIu64 " which is not held\n", snapshot);
+                exit(EXIT_FAILURE);
+        }
+        memmove(&pager->snapshots[i], &pager->snapshots[i + 1],
+                (pager->num_snapshots - i - 1) * sizeof(uint64_t));
+        pager->num_snapshots--;
+        pthread_mutex_unlock(&pager->snapshot_lock);
+}
+
+/** @brief Whether `page_num` has a frame, taken or loading. */
+static bool
+pager_cached(Pager* pager, uint32_t page_num) {
+        pthread_mutex_t* shard = pager_shard(pager, page_num);
+        pthread_mutex_lock(shard);
+        bool cached = pager_lookup(pager, page_num) != INVALID_PAGE_NUM;
+        pthread_mutex_unlock(shard);
+        return cached;
+}
+
+static void
+pager_submit_reads(Pager* pager, const uint32_t* page_nums, uint32_t count);
+
+void
+pager_read_ahead(Pager* pager, const uint32_t* page_nums, uint32_t count) {
+        pthread_mutex_lock(&pager->pool_lock);
+        if (pager->map) {
+                // The kernel pages the mapping in, ask it to start early.
+                for (uint32_t i = 0; i < count; i++) {
+                        off_t start = PAGE_OFFSET(page_nums[i]);
+                        if (start < pager->file_len && (size_t)start < pager->map_len)
+                                madvise(pager->map + start, PAGE_SIZE, MADV_WILLNEED);
+                }
+        } else if (pager->aio) {
+                pager_submit_reads(pager, page_nums, count);
+        }
+        pthread_mutex_unlock(&pager->pool_lock);
+}
+
+/** @brief Queue reads of the pages not cached yet, with `pool_lock` held. */
+static void
+pager_submit_reads(Pager* pager, const uint32_t* page_nums, uint32_t count) {
+        pager_reap(pager, false);
+
+        // Never let reads in flight hold more than a quarter of the pool.
+        PagerRead* read = NULL;
+        for (uint32_t i = 0; i < count && pager->reading < pager->num_frames / 4; i++) {
+                uint32_t page_num = page_nums[i];
+                if (PAGE_OFFSET(page_num + 1) > pager->file_len || pager_cached(pager, page_num) ||
+                    wal_has_page(pager->wal, page_num))
+                        continue;
+
+                bool extends = read && read->len < PAGER_READ_RUN &&
+                               read->offset + (off_t)read->len * PAGE_SIZE == PAGE_OFFSET(page_num);
+                if (!extends) {
+                        if (read)
+                                pager_submit_read(pager, read);
+                        if (!(read = pager_free_read(pager)))
+                                return;
+                        read->busy = true;
+                        read->len = 0;
+                        read->offset = PAGE_OFFSET(page_num);
+                }
+
+                uint32_t idx = pager_victim(pager);
+                Frame* frame = &pager->frames[idx];
+                pthread_mutex_t* shard = pager_shard(pager, page_num);
+                memset(frame->buffer, 0, PAGE_SIZE);
+                pthread_mutex_lock(shard);
+                frame->data = frame->buffer;
+                frame->page_num = page_num;
+                frame->pin_count = 1; // Held by the read until it is reaped
+                frame->referenced = true;
+                frame->dirty = false;
+                frame->loading = true;
+                pager_hash_insert(pager, idx);
+                pthread_mutex_unlock(shard);
+
+                read->frame_idxs[read->len++] = idx;
+                pager->reading++;
+                pager->stats.prefetched++;
+        }
+        if (read)
+                pager_submit_read(pager, read);
+}
+
+void
+pager_begin(Pager* pager) {
+        if (pager_writing(pager)) {
+                pager->txn_depth++;
+                return;
+        }
+        pthread_mutex_lock(&pager->writer);
+        __atomic_store_n(&pager->writer_thread, &pager_thread, __ATOMIC_RELAXED);
+        pager->txn_depth = 1;
+        pager->txn_num_pages = pager->num_pages;
+        pager->num_dirty = 0;
+}
+
+/*
+ * The copy is made here rather than when the writer fetches the page, so the pages a
+ * write only reads on its way down the tree cost nothing. A page served from the mapping
+ * is made private there first: once the commit is in the WAL the checkpointer may rewrite
+ * it in the file, while readers and then a version still read the old image in place.
+ */
+void*
+pager_mark_dirty(Pager* pager, uint32_t page_num) {
+        pthread_mutex_t* shard = pager_shard(pager, page_num);
+        pthread_mutex_lock(shard);
+        uint32_t idx = pager_lookup(pager, page_num);
+        bool pinned = idx != INVALID_PAGE_NUM && pager->frames[idx].pin_count > 0;
+        pthread_mutex_unlock(shard);
+        if (!pinned) {
+                printf("Tried to dirty page %d which is not pinned\n", page_num);
+                exit(EXIT_FAILURE);
+        }
+        if (!pager_writing(pager)) {
+                printf("Tried to dirty page %d outside of a transaction\n", page_num);
+                exit(EXIT_FAILURE);
+        }
+
+        Frame* frame = &pager->frames[idx];
+        if (frame->dirty)
+                return frame->shadow;
+
+        if (frame->data != frame->buffer)
+                pager_privatize(frame->data);
+        void* shadow = pager_take_page(pager);
+        memcpy(shadow, frame->data, PAGE_SIZE);
+        pthread_mutex_lock(shard);
+        frame->shadow = shadow;
+        frame->dirty = true;
+        pthread_mutex_unlock(shard);
+        pager->dirty_frames[pager->num_dirty++] = idx;
+        pager->stats.pages_dirtied++;
+        return shadow;
+}
+
+/**
+ * @brief Make a dirty frame's shadow its committed image, keeping the old one as a version
+ * that commit `seq` ended. Called with the frame's shard locked.
+ */
+static void
+pager_publish(Pager* pager, Frame* frame, uint64_t seq) {
+        PageVersion** bucket = &pager->versions[pager_hash(pager, frame->page_num)];
+        PageVersion* version = pager_take_version(pager);
+
+        // The image being replaced is the one the page's newest version ended at
+        version->start = 0;
+        for (PageVersion* newer = *bucket; newer; newer = newer->next) {
+                if (newer->page_num == frame->page_num) {
+                        version->start = newer->end;
+                        break;
+                }
+        }
+        version->page_num = frame->page_num;
+        version->end = seq;
+        version->data = frame->data;
+        version->mapped = frame->data != frame->buffer;
+        version->next = *bucket;
+        *bucket = version;
+        version->next_kept = pager->kept;
+        pager->kept = version;
+
+        // A version in the mapping leaves the frame its buffer, which the shadow replaces
+        if (version->mapped)
+                pager_give_page(pager, frame->buffer);
+        frame->buffer = frame->shadow;
+        frame->data = frame->shadow;
+        frame->shadow = NULL;
+        frame->dirty = false;
+        pager->stats.versions++;
+}
+
+/**
+ * @brief Free the versions no held snapshot reads, the ones covering none of them.
+ * A snapshot taken from now on is the newest commit and reads no version at all.
+ */
+static void
+pager_reclaim(Pager* pager) {
+        pthread_mutex_lock(&pager->snapshot_lock);
+        PageVersion** link = &pager->kept;
+        while (*link) {
+                PageVersion* version = *link;
+                uint32_t i = pager_snapshot_index(pager, version->start);
+                if (i < pager->num_snapshots && pager->snapshots[i] < version->end) {
+                        link = &version->next_kept;
+                        continue;
+                }
+
+                *link = version->next_kept;
+                // The page shows the file again before a load can find the version gone
+                if (version->mapped)
+                        pager_unprivatize(version->data);
+                pthread_mutex_t* shard = pager_shard(pager, version->page_num);
+                pthread_mutex_lock(shard);
+                PageVersion** entry = &pager->versions[pager_hash(pager, version->page_num)];
+                while (*entry != version) entry = &(*entry)->next;
+                *entry = version->next;
+                pthread_mutex_unlock(shard);
+                if (!version->mapped)
+                        pager_give_page(pager, version->data);
+                pager_give_version(pager, version);
+                pager->stats.reclaimed++;
+        }
+        pthread_mutex_unlock(&pager->snapshot_lock);
+}
+
+/** @brief Close the transaction once its pages are committed or dropped, taking back the shadows left. */
+static void
+pager_end_txn(Pager* pager) {
+        // A frame a rollback released may have been taken by another page since, `pool_lock` keeps it still
+        pthread_mutex_lock(&pager->pool_lock);
+        for (uint32_t i = 0; i < pager->num_dirty; i++) {
+                Frame* frame = &pager->frames[pager->dirty_frames[i]];
+                if (!frame->shadow)
+                        continue;
+                // Rolled back, a page made private in the mapping still matches the file
+                if (frame->data != frame->buffer)
+                        pager_unprivatize(frame->data);
+                pthread_mutex_t* shard = pager_shard(pager, frame->page_num);
+                pthread_mutex_lock(shard);
+                pager_give_page(pager, frame->shadow);
+                frame->shadow = NULL;
+                frame->dirty = false;
+                pthread_mutex_unlock(shard);
+        }
+        pthread_mutex_unlock(&pager->pool_lock);
+        pager->txn_depth = 0;
+        pager->num_dirty = 0;
+        __atomic_store_n(&pager->writer_thread, NULL, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&pager->writer);
+}
+
+/**
+ * A frame stays dirty, and so in the pool, until its page is in the WAL; a reader
+ * missing on it afterwards reads the new image from there. The shadows are published one
+ * page at a time before the commit count moves: until it does, snapshots are taken at the
+ * previous commit and read the versions of the pages already swapped.
+ */
+void
+pager_commit(Pager* pager) {
+        if (--pager->txn_depth > 0)
+                return;
+
+        for (uint32_t i = 0; i < pager->num_dirty; i++) {
+                Frame* frame = &pager->frames[pager->dirty_frames[i]];
+                pager->txn_page_nums[i] = frame->page_num;
+                pager->txn_pages[i] = frame->shadow;
+        }
+        wal_commit(pager->wal, pager->num_dirty, pager->txn_page_nums, pager->txn_pages, pager->num_pages);
+
+        if (pager->num_dirty > 0) {
+                uint64_t seq = pager->commit_seq + 1;
+                for (uint32_t i = 0; i < pager->num_dirty; i++) {
+                        Frame* frame = &pager->frames[pager->dirty_frames[i]];
+                        pthread_mutex_t* shard = pager_shard(pager, frame->page_num);
+                        pthread_mutex_lock(shard);
+                        pager_publish(pager, frame, seq);
+                        pthread_mutex_unlock(shard);
+                }
+                pthread_mutex_lock(&pager->snapshot_lock);
+                pager->commit_seq = seq;
+                pthread_mutex_unlock(&pager->snapshot_lock);
+        }
+        if (pager->kept)
+                pager_reclaim(pager);
+        pager_end_txn(pager);
+}
+
+/**
+ * Nothing the transaction changed is in a frame's committed image, dropping its shadows
+ * restores every page. Pages it added past the end of the file are released, so the
+ * next one to take their number loads it and extends the file again; only the writer
+ * loads those, and it may have fetched one without dirtying it, so the whole pool is checked.
+ */
+void
+pager_rollback(Pager* pager) {
+        if (!pager_writing(pager))
+                return;
+
+        pthread_mutex_lock(&pager->pool_lock);
+        for (uint32_t idx = 0; idx < pager->used_frames; idx++) {
+                Frame* frame = &pager->frames[idx];
+                if (frame->page_num == INVALID_PAGE_NUM || frame->page_num < pager->txn_num_pages)
+                        continue;
+                pthread_mutex_t* shard = pager_shard(pager, frame->page_num);
+                pthread_mutex_lock(shard);
+                pager_hash_remove(pager, idx);
+                frame->page_num = INVALID_PAGE_NUM;
+                frame->referenced = false;
+                pthread_mutex_unlock(shard);
+        }
+        pthread_mutex_unlock(&pager->pool_lock);
+        pager->num_pages = pager->txn_num_pages;
+        pager->stats.rollbacks++;
+        pager_end_txn(pager);
+}
+
+void
+free_pager(Pager* pager) {
+        // A transaction left open is abandoned, its pages never reach the WAL.
+        pager_rollback(pager);
+        while (pager->reading > 0) pager_reap(pager, true);
+        aio_close(pager->aio);
+
+        // Every cached page is already committed, closing the WAL checkpoints it.
+        wal_close(pager->wal);
+
+        if (pager->map)
+                munmap(pager->map, pager->map_len);
+        for (uint32_t i = 0; i < pager->num_old_maps; i++) munmap(pager->old_maps[i].addr, pager->old_maps[i].len);
+
+        int result = close(pager->fd);
+        if (result == -1) {
+                printf("Error closing db file.\n");
+                exit(EXIT_FAILURE);
+        }
+
+        while (pager->kept) {
+                PageVersion* version = pager->kept;
+                pager->kept = version->next_kept;
+                if (!version->mapped)
+                        free(version->data);
+                free(version);
+        }
+        while (pager->spare_pages) free(pager_take_page(pager));
+        while (pager->spare_versions) free(pager_take_version(pager));
+        for (uint32_t i = 0; i < pager->num_frames; i++) free(pager->frames[i].buffer);
+        for (uint32_t i = 0; i < PAGER_SHARDS; i++) pthread_mutex_destroy(&pager->shards[i]);
+        pthread_mutex_destroy(&pager->pool_lock);
+        pthread_cond_destroy(&pager->loaded);
+        pthread_mutex_destroy(&pager->snapshot_lock);
+        pthread_mutex_destroy(&pager->writer);
+
+        free(pager->snapshots);
+        free(pager->txn_pages);
+        free(pager->txn_page_nums);
+        free(pager->dirty_frames);
+        free(pager->versions);
+        free(pager->buckets);
+        free(pager->frames);
+        free(pager);
+}
+
+void
+pager_print_stats(Pager* pager) {
+        PagerStats* stats = &pager->stats;
+        uint64_t lookups = stats->hits + stats->misses;
+
+        printf("mode: %s\n", pager->mode == PAGER_MODE_MMAP ? "mmap" : "read");
+        printf("frames: %d/%d\n", pager->used_frames, pager->num_frames);
+        printf("pages: %d\n", pager->num_pages);
+        printf("hits: %" PRIu64 "\n", stats->hits);
+        printf("misses: %" PRIu64 "\n", stats->misses);
+        printf("hit ratio: %.2f%%\n", lookups ? 100.0 * stats->hits / lookups : 0.0);
+        printf("evictions: %" PRIu64 "\n", stats->evictions);
+        printf("reads: %" PRIu64 "\n", stats->reads);
+        printf("read ahead: %s, %" PRIu64 " pages in %" PRIu64 " reads, %" PRIu64 " waits\n",
+               aio_backend_name(pager->aio), stats->prefetched, stats->async_reads, stats->waits);
+        printf("pages dirtied: %" PRIu64 "\n", stats->pages_dirtied);
+        printf("rollbacks: %" PRIu64 "\n", stats->rollbacks);
+        printf("page versions: %" PRIu64 " made, %" PRIu64 " reclaimed\n", stats->versions, stats->reclaimed);
+        if (pager->mode == PAGER_MODE_MMAP) {
+                printf("pages mapped: %" PRIu64 "\n", stats->mapped);
+                printf("mapping: %zu bytes, %" PRIu64 " remaps\n", pager->map_len, stats->remaps);
+        }
+        wal_print_stats(pager->wal);
+}
@@ -20,7 +20,7 @@
 void repl_kill(char* msg, InputBuffer* buf);
 
 /** @brief Gracefully exits the REPL, cleaning up resources. */
-void repl_graceful_exit(InputBuffer* buf, Table* table);
+void repl_graceful_exit(InputBuffer* buf, Database* db);
 
 int
 repl_usage() {
@@ -41,11 +41,11 @@ repl_kill(char* msg, InputBuffer* buf) {
 }
 
 void
-repl_graceful_exit(InputBuffer* buf, Table* table) {
+repl_graceful_exit(InputBuffer* buf, Database* db) {
         if (buf)
                 inbuf_free(buf);
-        if (table)
-                free_table(table);
+        if (db)
+                db_close(db);
 
         replog("goodbye.");
         exit(EXIT_SUCCESS);
@@ -59,6 +59,9 @@ repl_err_lookup(CommandType type) {
                 case COMMAND_INSERT: return "COMMAND_INSERT";
                 case COMMAND_UPDATE: return "COMMAND_UPDATE";
                 case COMMAND_DELETE: return "COMMAND_DELETE";
+                case COMMAND_BEGIN: return "COMMAND_BEGIN";
+                case COMMAND_COMMIT: return "COMMAND_COMMIT";
+                case COMMAND_ROLLBACK: return "COMMAND_ROLLBACK";
                 case COMMAND_UNKNOWN: return "COMMAND_UNKNOWN";
                 case COMMAND_SYNTAX_ERR: return "COMMAND_SYNTAX_ERR";
                 case COMMAND_SIZING_ERR: return "COMMAND_SIZING_ERR";
@@ -66,16 +69,129 @@ repl_err_lookup(CommandType type) {
         }
 }
 
+/**
+ * @brief Map a failed prepare onto the command error the REPL reports.
+ */
+static CommandType
+repl_prepare_error(PrepareResult result) {
+        switch (result) {
+                case PREPARE_UNRECOGNIZED_STATEMENT: return COMMAND_UNKNOWN;
+                case PREPARE_STRING_TOO_LONG:
+                case PREPARE_MISSING_ARGUMENTS: return COMMAND_SIZING_ERR;
+                default: return COMMAND_SYNTAX_ERR;
+        }
+}
+
+/**
+ * @brief Bulk load `<file> [fill]` into an empty table.
+ * The file holds one `id,username,email` row per line, sorted by id; blank lines and
+ * lines starting with '#' are skipped. `fill` is the percentage of each node to fill.
+ */
+int
+repl_import(const char* args, Table* table) {
+        char path[1024];
+        unsigned fill = BULK_DEFAULT_FILL;
+        if (sscanf(args, "%1023s %u", path, &fill) < 1) {
+                printf("usage: .import <file> [fill]\n");
+                return METACMD_ERR;
+        }
+
+        FILE* file = fopen(path, "r");
+        if (!file) {
+                printf("Unable to open %s\n", path);
+                return METACMD_ERR;
+        }
+
+        BulkLoad* load = table_bulk_begin(table, fill);
+        if (!load) {
+                printf("Import requires an empty table\n");
+                fclose(file);
+                return METACMD_ERR;
+        }
+
+        char line[1024];
+        uint32_t line_num = 0;
+        while (fgets(line, sizeof(line), file)) {
+                line_num++;
+                if (line[0] == '\n' || line[0] == '\r' || line[0] == '#')
+                        continue;
+
+                char* rowid = strtok(line, ",\r\n");
+                char* username = strtok(NULL, ",\r\n");
+                char* email = strtok(NULL, ",\r\n");
+                const char* problem = NULL;
+                Row row;
+                if (rowid == NULL || username == NULL || email == NULL)
+                        problem = "expected id,username,email";
+                else if (!parse_id(rowid, &row.id))
+                        problem = "id must be a positive integer";
+                else if (strlen(username) > COL_SIZE_USERNAME || strlen(email) > COL_SIZE_EMAIL)
+                        problem = "username or email exceeds maximum length";
+
+                if (!problem) {
+                        strcpy(row.username, username);
+                        strcpy(row.email, email);
+                        if (!table_bulk_add(load, &row))
+                                problem = "ids must be strictly increasing";
+                }
+                if (problem) {
+                        printf("Import failed at %s:%u: %s\n", path, line_num, problem);
+                        table_bulk_abort(load);
+                        fclose(file);
+                        return METACMD_ERR;
+                }
+        }
+        fclose(file);
+
+        printf("Imported %" PRIu64 " rows\n", table_bulk_finish(load));
+        return METACMD_OK;
+}
+
+/** @brief Create a secondary index, `create <username|email>`. */
+int
+repl_index(const char* args, Table* table) {
+        char action[16];
+        char column[16];
+        if (sscanf(args, "%15s %15s", action, column) != 2 || strcmp(action, "create") != 0 ||
+            (strcmp(column, "username") != 0 && strcmp(column, "email") != 0)) {
+                printf("usage: .index create <username|email>\n");
+                return METACMD_ERR;
+        }
+
+        IndexColumn index_column = strcmp(column, "username") == 0 ? INDEX_USERNAME : INDEX_EMAIL;
+        if (!table_create_index(table, index_column)) {
+                printf("Index on %s already exists\n", column);
+                return METACMD_ERR;
+        }
+        printf("Created index on %s\n", column);
+        return METACMD_OK;
+}
+
+/** @brief Print the program a statement compiles to, without running it. */
 int
-metacmd(InputBuffer* buffer, Table* table) {
+repl_explain(const char* sql, Table* table) {
+        Statement* stmt;
+        PrepareResult result = stmt_prepare(table, sql, &stmt);
+        if (result != PREPARE_SUCCESS) {
+                printf("Cannot prepare '%s' [%s]\n", sql, repl_err_lookup(repl_prepare_error(result)));
+                return METACMD_ERR;
+        }
+        stmt_explain(stmt);
+        stmt_finalize(stmt);
+        return METACMD_OK;
+}
+
+int
+metacmd(InputBuffer* buffer, Database* db, ResultSink* sink) {
         if (!buffer || !buffer->data)
                 return METACMD_ERR;
 
+        Table* table = db->table;
         const char* command = buffer->data;
         replog("processing meta command: '%s'", command);
 
         if (IS_SAME_LIT(buffer->data, ".exit"))
-                repl_graceful_exit(buffer, table);
+                repl_graceful_exit(buffer, db);
 
         if (IS_SAME_LIT(command, ".help"))
                 return repl_usage();
@@ -85,77 +201,89 @@ metacmd(InputBuffer* buffer, Table* table) {
                 return METACMD_OK;
         }
 
-        return METACMD_UNKNOWN;
-}
+        if ((IS_SAME_LIT(command, ".import ") || IS_SAME_LIT(command, ".index ")) && pager_writing(table->pager)) {
+                printf("Commit or roll back the open transaction first\n");
+                return METACMD_OK;
+        }
 
-void
-repl_parse_insert(InputBuffer* buffer, Command* cmd) {
-        replog("START: '%s'", buffer->data);
-        cmd->type = COMMAND_INSERT;
-
-        char* kwarg = strtok(buffer->data, " ");
-        char* rowid = strtok(NULL, " ");
-        char* username = strtok(NULL, " ");
-        char* email = strtok(NULL, " ");
-
-        if (rowid == NULL || username == NULL || email == NULL) {
-                cmd->type = COMMAND_SIZING_ERR;
-                replog("insert command requires 3 arguments: rowid, username, email");
-                return;
+        if (IS_SAME_LIT(command, ".import ")) {
+                repl_import(command + sizeof(".import ") - 1, table);
+                return METACMD_OK;
         }
 
-        int id = atoi(rowid);
-        if (id < 0) {
-                cmd->type = COMMAND_SYNTAX_ERR;
-                replog("insert command requires a positive integer for id");
-                return;
+        if (IS_SAME_LIT(command, ".index ")) {
+                repl_index(command + sizeof(".index ") - 1, table);
+                return METACMD_OK;
         }
 
-        if (strlen(username) > COL_SIZE_USERNAME || strlen(email) > COL_SIZE_EMAIL) {
-                cmd->type = COMMAND_SIZING_ERR;
-                replog("username or email exceeds maximum length");
-                return;
+        if (IS_SAME_LIT(command, ".explain ")) {
+                repl_explain(command + sizeof(".explain ") - 1, table);
+                return METACMD_OK;
         }
 
-        cmd->row.id = id;
-        strcpy(cmd->row.username, username);
-        strcpy(cmd->row.email, email);
-}
+        if (IS_SAME_LIT(command, ".mode ")) {
+                SinkMode mode;
+                if (!sink_mode_parse(command + sizeof(".mode ") - 1, &mode)) {
+                        printf("usage: .mode <text|csv|binary>\n");
+                        return METACMD_OK;
+                }
+                sink->mode = mode;
+                return METACMD_OK;
+        }
 
-Command
-repl_parse_command(InputBuffer* buffer) {
-        Command cmd;
-        cmd.row.id = 0;
-        cmd.type = COMMAND_UNKNOWN;
-
-        if (IS_SAME(buffer->data, "insert", 6))
-                repl_parse_insert(buffer, &cmd);
-        else if (IS_SAME(buffer->data, "select", 6))
-                cmd.type = COMMAND_SELECT;
-        else if (IS_SAME(buffer->data, "update", 6))
-                cmd.type = COMMAND_UPDATE;
-        else if (IS_SAME(buffer->data, "delete", 6))
-                cmd.type = COMMAND_DELETE;
-        return cmd;
-}
+        if (IS_SAME_LIT(command, ".stats")) {
+                metrics_print(table);
+                return METACMD_OK;
+        }
 
-void
-repl_forward_command(Command* cmd) {
-        if (!cmd) {
-                replog("no command to forward");
-                return;
+        if (IS_SAME_LIT(command, ".pool")) {
+                pager_print_stats(table->pager);
+                return METACMD_OK;
         }
 
-        switch (cmd->type) {
-                case COMMAND_OK: replog("command OK"); break;
-                case COMMAND_SELECT: replog("command SELECT"); break;
-                case COMMAND_INSERT: replog("command INSERT"); break;
-                case COMMAND_UPDATE: replog("command UPDATE"); break;
-                case COMMAND_DELETE: replog("command DELETE"); break;
-                case COMMAND_UNKNOWN: replog("command UNKNOWN"); break;
-                case COMMAND_SYNTAX_ERR: replog("command SYNTAX ERROR"); break;
-                case COMMAND_SIZING_ERR: replog("command SIZING ERROR"); break;
-                default: replog("unknown command type: %d", cmd->type);
+        return METACMD_UNKNOWN;
+}
+
+/**
+ * @brief Parses the options following the database file into a pager configuration.
+ * Supported options: --pool-frames=<n>, --wal-sync=<full|normal>, --mmap, --aio=<uring|threads|off>,
+ * for logging --log=<dev|debug|info|warn|error|off> and --log-async, and for metrics
+ * --stats-file=<path> and --stats-interval=<seconds>.
+ */
+void
+repl_parse_args(int argc, char const** argv, PagerConfig* config) {
+        memset(config, 0, sizeof(PagerConfig));
+
+        for (int i = 2; i < argc; i++) {
+                if (IS_SAME_LIT(argv[i], "--pool-frames=")) {
+                        config->pool_frames = atoi(argv[i] + sizeof("--pool-frames=") - 1);
+                } else if (IS_SAME_LIT(argv[i], "--wal-sync=normal")) {
+                        config->wal_sync = WAL_SYNC_NORMAL;
+                } else if (IS_SAME_LIT(argv[i], "--wal-sync=full")) {
+                        config->wal_sync = WAL_SYNC_FULL;
+                } else if (IS_SAME_LIT(argv[i], "--mmap")) {
+                        config->mode = PAGER_MODE_MMAP;
+                } else if (IS_SAME_LIT(argv[i], "--aio=uring")) {
+                        config->aio = AIO_BACKEND_URING;
+                } else if (IS_SAME_LIT(argv[i], "--aio=threads")) {
+                        config->aio = AIO_BACKEND_THREADS;
+                } else if (IS_SAME_LIT(argv[i], "--aio=off")) {
+                        config->aio = AIO_BACKEND_OFF;
+                } else if (IS_SAME_LIT(argv[i], "--log=")) {
+                        LogLevel level;
+                        if (log_level_parse(argv[i] + sizeof("--log=") - 1, &level))
+                                log_set_level(level);
+                        else
+                                replog("ignoring unknown log level: '%s'", argv[i]);
+                } else if (IS_SAME_LIT(argv[i], "--log-async")) {
+                        log_async_start();
+                } else if (IS_SAME_LIT(argv[i], "--stats-file=")) {
+                        metrics_dump_start(argv[i] + sizeof("--stats-file=") - 1, metrics.dump_interval);
+                } else if (IS_SAME_LIT(argv[i], "--stats-interval=")) {
+                        metrics.dump_interval = atoi(argv[i] + sizeof("--stats-interval=") - 1);
+                } else {
+                        replog("ignoring unknown option: '%s'", argv[i]);
+                }
         }
 }
 
@@ -168,9 +296,12 @@ repl_loop(int argc, char const** argv) {
                 repl_kill("No database file specified", NULL);
         }
 
-        Table* table = new_table(argv[1]);
-        if (!table) {
-                perror("Failed to allocate memory for table");
+        PagerConfig config;
+        repl_parse_args(argc, argv, &config);
+
+        Database* db = db_open(argv[1], &config);
+        if (!db) {
+                perror("Failed to open database");
                 exit(EXIT_FAILURE);
         }
 
@@ -184,6 +315,13 @@ repl_loop(int argc, char const** argv) {
         if (!buffer)
                 repl_kill("Failed to create buffer", buffer);
 
+        /**
+         * Rows are formatted into the sink and written once the statement is done.
+         * It is static as its buffer is too large to keep on the stack.
+         */
+        static ResultSink sink;
+        sink_init(&sink, stdout, SINK_TEXT);
+
         info("Entering REPL loop. Type '.exit' to quit.\n");
 
         while (1) {
@@ -217,98 +355,26 @@ repl_loop(int argc, char const** argv) {
                  * Then continue to next iter., nothing to be done after a meta command.
                  */
                 if (buffer->data[0] == '.') {
-                        if (metacmd(buffer, table) != METACMD_OK)
+                        if (metacmd(buffer, db, &sink) != METACMD_OK)
                                 replog("unrecognized meta command: '%s'", buffer->data);
                         continue;
                 }
 
                 /**
-                 * Parse the command from the input buffer.
+                 * Compile the statement, or reuse it if it ran recently, then step it
+                 * and print the rows it returns.
                  */
-                Command cmd = repl_parse_command(buffer);
-                if (cmd.type >= COMMAND_UNKNOWN) {
-                        replog("command parse error [%s]", repl_err_lookup(cmd.type));
+                PrepareResult result;
+                Statement* stmt = db_statement(db, buffer->data, &result);
+                if (!stmt) {
+                        replog("command parse error [%s]", repl_err_lookup(repl_prepare_error(result)));
                         continue;
                 }
 
-                replog("handling command: %d", cmd.type);
-                exec_command(&cmd, table);
+                replog("handling command: %d", stmt->type);
+                DbResult run = db_run(stmt, sink_callback, &sink);
+                sink_flush(&sink);
+                if (run == DB_TXN_ROLLED_BACK)
+                        printf("Transaction rolled back: it outgrew the buffer pool\n");
         }
 }
-
-// Statement statement;
-// PrepareResult prepare_result = prepare_statement(buffer, &statement);
-// if (prepare_result == PREPARE_SUCCESS) {
-//         switch (statement.type) {
-//                 case STATEMENT_INSERT: printf("Prepared INSERT statement.\n"); break;
-//                 case STATEMENT_SELECT: printf("Prepared SELECT statement.\n"); break;
-//                 default: repl_kill("Unknown statement type", buffer); break;
-//         }
-// } else {
-//         if (prepare_result == PREPARE_SYNTAX_ERROR) {
-//                 printf("Syntax error in statement\n");
-//         } else if (prepare_result == PREPARE_NEGATIVE_ID) {
-//                 printf("Negative ID is not allowed\n");
-//         } else if (prepare_result == PREPARE_STRING_TOO_LONG) {
-//                 printf("Username or email exceeds maximum length\n");
-//         } else {
-//                 printf("Unrecognized statement\n");
-//         }
-//         continue;
-// }
-// int statement_result = execute_statement(&statement, table);
-// if (statement_result == EXECUTE_SUCCESS) {
-//         printf("Executed statement successfully.\n");
-// } else if (statement_result == EXECUTE_DUPLICATE_KEY) {
-//         printf("Duplicate key error during execution\n");
-// } else if (statement_result == EXECUTE_TABLE_FULL) {
-//         printf("Table is full, cannot insert new row\n");
-// } else {
-//         printf("Unknown execution error\n");
-// }
-// int
-// prepare_insert(InputBuffer* buffer, Statement* statement) {
-//         if (!buffer || !buffer->data) {
-//                 error("Buffer is NULL or empty");
-//                 return PREPARE_SYNTAX_ERROR;
-//         }
-//         if (!statement) {
-//                 error("Statement is NULL");
-//                 return PREPARE_SYNTAX_ERROR;
-//         }
-//         char* keyword = strtok(buffer->data, " ");
-//         char* id_str = strtok(NULL, " ");
-//         char* username = strtok(NULL, " ");
-//         char* email = strtok(NULL, " ");
-//         if (!keyword || !id_str || !username || !email) {
-//                 error("Invalid INSERT statement format. Expected: insert <id> <username> <email>");
-//                 return PREPARE_SYNTAX_ERROR;
-//         }
-//         int id = atoi(id_str);
-//         if (id < 0) {
-//                 error("Invalid ID. ID must be a positive integer.");
-//                 return PREPARE_NEGATIVE_ID;
-//         }
-//         if (strlen(username) > COLUMN_USERNAME_SIZE || strlen(email) > COLUMN_EMAIL_SIZE) {
-//                 error("Username or email exceeds maximum length.");
-//                 return PREPARE_STRING_TOO_LONG;
-//         }
-// statement->type = STATEMENT_INSERT;
-// statement->row_to_insert.id = id;
-// strncpy(statement->row_to_insert.username, username, COLUMN_USERNAME_SIZE);
-// statement->row_to_insert.username[COLUMN_USERNAME_SIZE] = '\0'; // Ensure null-termination
-// strncpy(statement->row_to_insert.email, email, COLUMN_EMAIL_SIZE);
-// statement->row_to_insert.email[COLUMN_EMAIL_SIZE] = '\0'; // Ensure null
-//         return PREPARE_SUCCESS;
-// }
-// int
-// prepare_statement(InputBuffer* buffer, Statement* statement) {
-// if (IS_SAME(buffer->data, "insert", 6)) {
-//         return prepare_insert(buffer, statement);
-// }
-// if (IS_SAME(buffer->data, "select", 6)) {
-//         statement->type = STATEMENT_SELECT;
-//         return PREPARE_SUCCESS;
-// }
-// return PREPARE_UNRECOGNIZED_STATEMENT;
-// }
\ No newline at end of file
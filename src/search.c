@@ -0,0 +1,95 @@
+/*
+ * Every descent runs through here once per node. The intrinsics only pay off when they
+ * are inlined into registers, so the file is optimized even in the default -g build.
+ */
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC optimize("O2")
+#endif
+
+#include "search.h"
+
+#if defined(__x86_64__) && !defined(NO_SIMD)
+#define SEARCH_HAVE_X86 1
+#include <immintrin.h>
+#endif
+
+typedef uint32_t (*KeyScan)(const uint32_t* keys, uint32_t l, uint32_t r, uint32_t key);
+
+/** Resolved once at load time, see keys_search_init() */
+static KeyScan key_scan;
+static const char* key_scan_isa;
+
+/** @brief First key in [l, r) that is at least `key`, or `r`. */
+static uint32_t
+key_scan_scalar(const uint32_t* keys, uint32_t l, uint32_t r, uint32_t key) {
+        while (l < r && keys[l] < key) l++;
+        return l;
+}
+
+#ifdef SEARCH_HAVE_X86
+/*
+ * The vector scans count the keys below `key` a block at a time. The keys are sorted, so
+ * the first block where some key is not below it holds the answer. SSE2 and AVX2 only
+ * compare signed lanes; flipping the sign bit of both sides orders unsigned keys the same.
+ */
+static uint32_t
+key_scan_sse2(const uint32_t* keys, uint32_t l, uint32_t r, uint32_t key) {
+        const __m128i bias = _mm_set1_epi32(INT32_MIN);
+        const __m128i target = _mm_xor_si128(_mm_set1_epi32(key), bias);
+        for (; l + 4 <= r; l += 4) {
+                __m128i block = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(keys + l)), bias);
+                int below = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(target, block)));
+                if (below != 0xf)
+                        return l + __builtin_popcount(below);
+        }
+        return key_scan_scalar(keys, l, r, key);
+}
+
+__attribute__((target("avx2"))) static uint32_t
+key_scan_avx2(const uint32_t* keys, uint32_t l, uint32_t r, uint32_t key) {
+        const __m256i bias = _mm256_set1_epi32(INT32_MIN);
+        const __m256i target = _mm256_xor_si256(_mm256_set1_epi32(key), bias);
+        for (; l + 8 <= r; l += 8) {
+                __m256i block = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(keys + l)), bias);
+                int below = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(target, block)));
+                if (below != 0xff)
+                        return l + __builtin_popcount(below);
+        }
+        return key_scan_sse2(keys, l, r, key);
+}
+#endif // SEARCH_HAVE_X86
+
+/** @brief Pick the widest scan the CPU supports before any thread searches a node. */
+__attribute__((constructor)) static void
+keys_search_init(void) {
+        key_scan = key_scan_scalar;
+        key_scan_isa = "scalar";
+#ifdef SEARCH_HAVE_X86
+        __builtin_cpu_init();
+        key_scan = key_scan_sse2;
+        key_scan_isa = "sse2";
+        if (__builtin_cpu_supports("avx2")) {
+                key_scan = key_scan_avx2;
+                key_scan_isa = "avx2";
+        }
+#endif
+}
+
+uint32_t
+keys_lower_bound(const uint32_t* keys, uint32_t num_keys, uint32_t key) {
+        uint32_t l = 0;
+        uint32_t r = num_keys;
+        while (r - l > SEARCH_SCAN_KEYS) {
+                uint32_t m = l + (r - l) / 2;
+                if (keys[m] < key)
+                        l = m + 1;
+                else
+                        r = m;
+        }
+        return key_scan(keys, l, r, key);
+}
+
+const char*
+keys_search_isa(void) {
+        return key_scan_isa;
+}
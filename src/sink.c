@@ -0,0 +1,121 @@
+/**
+ * Result sinks, the formatting of returned rows without stdio in the per-row path.
+ */
+
+#include "sink.h"
+
+#include <string.h>
+
+void
+sink_init(ResultSink* sink, FILE* out, SinkMode mode) {
+        sink->out = out;
+        sink->mode = mode;
+        sink->len = 0;
+        sink->rows = 0;
+}
+
+void
+sink_flush(ResultSink* sink) {
+        if (sink->len == 0)
+                return;
+        fwrite(sink->buf, 1, sink->len, sink->out);
+        fflush(sink->out);
+        sink->len = 0;
+}
+
+/** @brief Decimal digits of `value`, written backwards from the end of a scratch buffer. */
+static char*
+sink_uint(char* p, uint32_t value) {
+        char digits[10];
+        char* d = digits + sizeof(digits);
+        do {
+                *--d = (char)('0' + value % 10);
+                value /= 10;
+        } while (value);
+        size_t n = digits + sizeof(digits) - d;
+        memcpy(p, d, n);
+        return p + n;
+}
+
+static char*
+sink_text(char* p, const char* text, size_t len) {
+        memcpy(p, text, len);
+        return p + len;
+}
+
+/** @brief A CSV field, quoted only when it holds a separator, quote or line break. */
+static char*
+sink_csv_field(char* p, const char* text, size_t len) {
+        if (strcspn(text, ",\"\r\n") == len)
+                return sink_text(p, text, len);
+
+        *p++ = '"';
+        for (size_t i = 0; i < len; i++) {
+                if (text[i] == '"')
+                        *p++ = '"';
+                *p++ = text[i];
+        }
+        *p++ = '"';
+        return p;
+}
+
+void
+sink_row(ResultSink* sink, const Row* row) {
+        if (sink->len + SINK_ROW_MAX > SINK_BUFFER_SIZE)
+                sink_flush(sink);
+
+        size_t username_len = strnlen(row->username, COL_SIZE_USERNAME);
+        size_t email_len = strnlen(row->email, COL_SIZE_EMAIL);
+        char* start = sink->buf + sink->len;
+        char* p = start;
+        switch (sink->mode) {
+                case SINK_TEXT:
+                        *p++ = '(';
+                        p = sink_uint(p, row->id);
+                        p = sink_text(p, ", ", 2);
+                        p = sink_text(p, row->username, username_len);
+                        p = sink_text(p, ", ", 2);
+                        p = sink_text(p, row->email, email_len);
+                        p = sink_text(p, ")\n", 2);
+                        break;
+                case SINK_CSV:
+                        p = sink_uint(p, row->id);
+                        *p++ = ',';
+                        p = sink_csv_field(p, row->username, username_len);
+                        *p++ = ',';
+                        p = sink_csv_field(p, row->email, email_len);
+                        *p++ = '\n';
+                        break;
+                case SINK_BINARY: {
+                        uint32_t size = sizeof(uint32_t) + 2 + username_len + email_len;
+                        p = sink_text(p, (const char*)&size, sizeof(size));
+                        p = sink_text(p, (const char*)&row->id, sizeof(row->id));
+                        *p++ = (char)username_len;
+                        p = sink_text(p, row->username, username_len);
+                        *p++ = (char)email_len;
+                        p = sink_text(p, row->email, email_len);
+                        break;
+                }
+        }
+        sink->len += p - start;
+        sink->rows++;
+}
+
+bool
+sink_callback(const Row* row, void* arg) {
+        sink_row((ResultSink*)arg, row);
+        return true;
+}
+
+bool
+sink_mode_parse(const char* name, SinkMode* mode) {
+        if (strcmp(name, "text") == 0)
+                *mode = SINK_TEXT;
+        else if (strcmp(name, "csv") == 0)
+                *mode = SINK_CSV;
+        else if (strcmp(name, "binary") == 0)
+                *mode = SINK_BINARY;
+        else
+                return false;
+        return true;
+}
@@ -0,0 +1,690 @@
+/**
+ * Statement compiler and the virtual machine that runs its programs.
+ */
+
+#include "vm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "metrics.h"
+
+/** @brief Tokens of the statement being compiled and the program it grows into. */
+typedef struct {
+        Statement* stmt;
+        char** tokens;
+        uint32_t num_tokens;
+        uint32_t pos;
+        uint32_t max_ops; // Room in stmt->ops, sized from the token count
+} Compiler;
+
+static const char* op_names[] = {
+        [OP_INTEGER] = "Integer",         [OP_STRING] = "String",     [OP_VARIABLE] = "Variable",
+        [OP_MAKE_ROW] = "MakeRow",        [OP_INSERT] = "Insert",     [OP_UPDATE] = "Update",
+        [OP_DELETE] = "Delete",           [OP_TRANSACTION] = "Transaction", [OP_FILTER_ID] = "FilterId",
+        [OP_FILTER_TEXT] = "FilterText", [OP_LIMIT] = "Limit",       [OP_INDEX_SEEK] = "IndexSeek",
+        [OP_INDEX_NEXT] = "IndexNext",    [OP_SEEK] = "Seek",         [OP_CHECK] = "Check",
+        [OP_RESULT] = "Result",           [OP_NEXT] = "Next",         [OP_GOTO] = "Goto",
+        [OP_HALT] = "Halt",
+};
+
+/*
+ * Compiler
+ * A statement is split into tokens once, then each clause emits the instructions that
+ * load its values into registers followed by the ones that act on them.
+ */
+
+static char*
+compiler_next(Compiler* c) {
+        return c->pos < c->num_tokens ? c->tokens[c->pos++] : NULL;
+}
+
+static uint32_t
+emit(Compiler* c, OpCode code, uint32_t p1, uint32_t p2, uint32_t p3, const char* p4) {
+        Statement* stmt = c->stmt;
+        if (stmt->num_ops == c->max_ops) {
+                printf("Statement program overflow at %u instructions\n", c->max_ops);
+                exit(EXIT_FAILURE);
+        }
+        stmt->ops[stmt->num_ops] = (Op){.code = code, .p1 = p1, .p2 = p2, .p3 = p3, .p4 = p4};
+        return stmt->num_ops++;
+}
+
+/** @brief Point the jump of instruction `addr` at the next one emitted. */
+static void
+patch_here(Compiler* c, uint32_t addr) {
+        c->stmt->ops[addr].p2 = c->stmt->num_ops;
+}
+
+/** @brief Load `token` into a new register, a parameter when it is `?`. */
+static uint32_t
+compile_operand(Compiler* c, const char* token, OpCode literal, uint32_t integer) {
+        Statement* stmt = c->stmt;
+        uint32_t reg = stmt->num_regs++;
+        if (strcmp(token, "?") == 0)
+                emit(c, OP_VARIABLE, reg, 0, stmt->num_params++, NULL);
+        else
+                emit(c, literal, reg, 0, integer, literal == OP_STRING ? token : NULL);
+        return reg;
+}
+
+bool
+parse_id(const char* token, uint32_t* id) {
+        if (token == NULL || *token < '0' || *token > '9')
+                return false;
+
+        char* end;
+        unsigned long value = strtoul(token, &end, 10);
+        if (*end != '\0' || value > UINT32_MAX)
+                return false;
+        *id = value;
+        return true;
+}
+
+/** @brief Parse the id of a row to write, `?` leaving it to a parameter. */
+static PrepareResult
+compile_row_id(const char* token, const char* kwarg, uint32_t* id) {
+        *id = 0;
+        if (strcmp(token, "?") == 0 || parse_id(token, id))
+                return PREPARE_SUCCESS;
+        if (token[0] == '-' && parse_id(token + 1, id)) {
+                replog("%s command requires a positive integer for id", kwarg);
+                return PREPARE_NEGATIVE_ID;
+        }
+        replog("%s command requires an integer id, got '%s'", kwarg, token);
+        return PREPARE_SYNTAX_ERROR;
+}
+
+/**
+ * @brief Compile `<id> <username> <email>[, <id> <username> <email>]...` into rows.
+ * The commas between rows are optional; an update takes a single row.
+ */
+static PrepareResult
+compile_rows(Compiler* c, const char* kwarg) {
+        Statement* stmt = c->stmt;
+        stmt->rows = arena_alloc(&stmt->arena, (c->num_tokens / 3 + 1) * sizeof(Row));
+
+        char* rowid;
+        while ((rowid = compiler_next(c)) != NULL) {
+                char* username = compiler_next(c);
+                char* email = compiler_next(c);
+
+                if (username == NULL || email == NULL) {
+                        replog("%s command requires 3 arguments: rowid, username, email", kwarg);
+                        return PREPARE_MISSING_ARGUMENTS;
+                }
+
+                uint32_t id;
+                PrepareResult result = compile_row_id(rowid, kwarg, &id);
+                if (result != PREPARE_SUCCESS)
+                        return result;
+
+                if ((strcmp(username, "?") != 0 && strlen(username) > COL_SIZE_USERNAME) ||
+                    (strcmp(email, "?") != 0 && strlen(email) > COL_SIZE_EMAIL)) {
+                        replog("username or email exceeds maximum length");
+                        return PREPARE_STRING_TOO_LONG;
+                }
+
+                // The three registers of a row are consecutive
+                uint32_t first = compile_operand(c, rowid, OP_INTEGER, id);
+                compile_operand(c, username, OP_STRING, 0);
+                compile_operand(c, email, OP_STRING, 0);
+                emit(c, OP_MAKE_ROW, first, 0, stmt->num_rows++, NULL);
+        }
+
+        if (stmt->num_rows == 0) {
+                replog("%s command requires 3 arguments: rowid, username, email", kwarg);
+                return PREPARE_MISSING_ARGUMENTS;
+        }
+        if (stmt->type == COMMAND_UPDATE && stmt->num_rows > 1) {
+                replog("update command takes a single row");
+                return PREPARE_SYNTAX_ERROR;
+        }
+        emit(c, stmt->type == COMMAND_INSERT ? OP_INSERT : OP_UPDATE, 0, 0, stmt->num_rows, NULL);
+        return PREPARE_SUCCESS;
+}
+
+static PrepareResult
+compile_delete(Compiler* c) {
+        char* rowid = compiler_next(c);
+        if (rowid == NULL) {
+                replog("delete command requires 1 argument: rowid");
+                return PREPARE_MISSING_ARGUMENTS;
+        }
+
+        uint32_t id;
+        PrepareResult result = compile_row_id(rowid, "delete", &id);
+        if (result != PREPARE_SUCCESS)
+                return result;
+        emit(c, OP_DELETE, compile_operand(c, rowid, OP_INTEGER, id), 0, 0, NULL);
+        return PREPARE_SUCCESS;
+}
+
+/** @brief Load an id operand of a select, false unless it is a non-negative number or `?`. */
+static bool
+compile_id_operand(Compiler* c, const char* token, uint32_t* reg) {
+        uint32_t id = 0;
+        if (token == NULL || (strcmp(token, "?") != 0 && !parse_id(token, &id)))
+                return false;
+        *reg = compile_operand(c, token, OP_INTEGER, id);
+        return true;
+}
+
+/**
+ * @brief Compile one condition of a where clause from the tokens that follow.
+ * Conditions on the id narrow the filter's range, those on a column require an exact match.
+ */
+static bool
+compile_condition(Compiler* c) {
+        char* column = compiler_next(c);
+        char* op = compiler_next(c);
+        char* value = compiler_next(c);
+        if (column == NULL || op == NULL || value == NULL)
+                return false;
+
+        if (strcmp(column, "username") == 0 || strcmp(column, "email") == 0) {
+                IndexColumn index_column = column[0] == 'u' ? INDEX_USERNAME : INDEX_EMAIL;
+                size_t max_len = index_column == INDEX_USERNAME ? COL_SIZE_USERNAME : COL_SIZE_EMAIL;
+                if (strcmp(op, "=") != 0 || (strcmp(value, "?") != 0 && strlen(value) > max_len))
+                        return false;
+                emit(c, OP_FILTER_TEXT, compile_operand(c, value, OP_STRING, 0), 0, index_column, NULL);
+                return true;
+        }
+
+        uint32_t reg;
+        if (strcmp(column, "id") != 0 || !compile_id_operand(c, value, &reg))
+                return false;
+
+        FilterOp filter_op;
+        if (strcmp(op, "=") == 0) {
+                filter_op = FILTER_EQ;
+        } else if (strcmp(op, ">=") == 0) {
+                filter_op = FILTER_GE;
+        } else if (strcmp(op, "<=") == 0) {
+                filter_op = FILTER_LE;
+        } else if (strcmp(op, ">") == 0) {
+                filter_op = FILTER_GT;
+        } else if (strcmp(op, "<") == 0) {
+                filter_op = FILTER_LT;
+        } else if (strcmp(op, "between") == 0) {
+                char* and = compiler_next(c);
+                uint32_t max_reg;
+                if (and == NULL || strcmp(and, "and") != 0 || !compile_id_operand(c, compiler_next(c), &max_reg))
+                        return false;
+                emit(c, OP_FILTER_ID, max_reg, 0, FILTER_LE, NULL);
+                filter_op = FILTER_GE;
+        } else {
+                return false;
+        }
+        emit(c, OP_FILTER_ID, reg, 0, filter_op, NULL);
+        return true;
+}
+
+/**
+ * @brief Compile `select [where <condition> [and <condition>]...] [limit <n>]`.
+ * A condition is `id = k`, `id > k`, `id >= k`, `id < k`, `id <= k`, `id between a and b`,
+ * `username = s` or `email = s`. Whether an index answers the select is decided as it runs,
+ * so the program keeps both the index lookup and the scan.
+ */
+static PrepareResult
+compile_select(Compiler* c) {
+        char* token = compiler_next(c);
+        if (token && strcmp(token, "where") == 0) {
+                do {
+                        if (!compile_condition(c)) {
+                                replog("select condition must be 'id <op> <n>', 'id between <a> and <b>' or "
+                                       "'<username|email> = <value>'");
+                                return PREPARE_SYNTAX_ERROR;
+                        }
+                        token = compiler_next(c);
+                } while (token && strcmp(token, "and") == 0);
+        }
+
+        if (token && strcmp(token, "limit") == 0) {
+                uint32_t reg;
+                if (!compile_id_operand(c, compiler_next(c), &reg)) {
+                        replog("select limit requires a non-negative integer");
+                        return PREPARE_SYNTAX_ERROR;
+                }
+                emit(c, OP_LIMIT, reg, 0, 0, NULL);
+                token = compiler_next(c);
+        }
+
+        if (token) {
+                replog("unexpected '%s' in select", token);
+                return PREPARE_SYNTAX_ERROR;
+        }
+
+        uint32_t index_seek = emit(c, OP_INDEX_SEEK, 0, 0, 0, NULL);
+        uint32_t index_next = emit(c, OP_INDEX_NEXT, 0, 0, 0, NULL);
+        emit(c, OP_CHECK, 0, index_next, 0, NULL);
+        uint32_t index_result = emit(c, OP_RESULT, 0, 0, 0, NULL);
+        emit(c, OP_GOTO, 0, index_next, 0, NULL);
+
+        patch_here(c, index_seek);
+        uint32_t seek = emit(c, OP_SEEK, 0, 0, 0, NULL);
+        uint32_t check = emit(c, OP_CHECK, 0, 0, 0, NULL);
+        uint32_t result = emit(c, OP_RESULT, 0, 0, 0, NULL);
+        patch_here(c, check);
+        emit(c, OP_NEXT, 0, check, 0, NULL);
+
+        patch_here(c, index_next);
+        patch_here(c, index_result);
+        patch_here(c, seek);
+        patch_here(c, result);
+        return PREPARE_SUCCESS;
+}
+
+/** @brief Split the statement's copy of the text into tokens on `delims`. */
+static void
+compiler_tokenize(Compiler* c, char* text, const char* delims) {
+        uint32_t count = 0;
+        for (const char* s = text + strspn(text, delims); *s; s += strspn(s, delims)) {
+                s += strcspn(s, delims);
+                count++;
+        }
+
+        c->tokens = arena_alloc(&c->stmt->arena, (count + 1) * sizeof(char*));
+        c->num_tokens = 0;
+        c->pos = 0;
+        char* save;
+        for (char* token = strtok_r(text, delims, &save); token; token = strtok_r(NULL, delims, &save))
+                c->tokens[c->num_tokens++] = token;
+}
+
+/** @brief Whether `sql` starts with the word `keyword`, ending at a space or the end of the text. */
+static bool
+statement_starts_with(const char* sql, const char* keyword) {
+        size_t len = strlen(keyword);
+        return strncmp(sql, keyword, len) == 0 && (sql[len] == ' ' || sql[len] == '\0');
+}
+
+/** @brief Statement kind from its first word; the words of a transaction stand alone. */
+static CommandType
+statement_type(const char* sql) {
+        if (statement_starts_with(sql, "insert"))
+                return COMMAND_INSERT;
+        if (statement_starts_with(sql, "select"))
+                return COMMAND_SELECT;
+        if (statement_starts_with(sql, "update"))
+                return COMMAND_UPDATE;
+        if (statement_starts_with(sql, "delete"))
+                return COMMAND_DELETE;
+        if (strcmp(sql, "begin") == 0)
+                return COMMAND_BEGIN;
+        if (strcmp(sql, "commit") == 0)
+                return COMMAND_COMMIT;
+        if (strcmp(sql, "rollback") == 0)
+                return COMMAND_ROLLBACK;
+        return COMMAND_UNKNOWN;
+}
+
+/** @brief Compile `sql`, of a known `type`, into `stmt`, whose arena is empty. */
+static PrepareResult
+stmt_compile(Statement* stmt, Table* table, CommandType type, const char* sql) {
+        stmt->table = table;
+        stmt->type = type;
+
+        size_t len = strlen(sql);
+        char* text = arena_alloc(&stmt->arena, len + 1);
+        memcpy(text, sql, len + 1);
+        stmt->sql = text;
+        char* copy = arena_alloc(&stmt->arena, len + 1);
+        memcpy(copy, sql, len + 1);
+
+        Compiler c = {.stmt = stmt};
+        bool rows = type == COMMAND_INSERT || type == COMMAND_UPDATE;
+        compiler_tokenize(&c, copy, rows ? " ," : " ");
+
+        // No clause emits more than two instructions per token, the select loop adds its own.
+        c.max_ops = 2 * c.num_tokens + 16;
+        stmt->ops = arena_alloc(&stmt->arena, c.max_ops * sizeof(Op));
+        stmt->regs = arena_alloc(&stmt->arena, (c.num_tokens + 1) * sizeof(Value));
+        stmt->params = arena_alloc(&stmt->arena, (c.num_tokens + 1) * sizeof(Param));
+
+        char* kwarg = compiler_next(&c);
+        PrepareResult result = PREPARE_SUCCESS;
+        switch (type) {
+                case COMMAND_INSERT:
+                case COMMAND_UPDATE: result = compile_rows(&c, kwarg); break;
+                case COMMAND_DELETE: result = compile_delete(&c); break;
+                case COMMAND_SELECT: result = compile_select(&c); break;
+                default: emit(&c, OP_TRANSACTION, 0, 0, type, NULL); break;
+        }
+        if (result != PREPARE_SUCCESS)
+                return result;
+
+        emit(&c, OP_HALT, 0, 0, 0, NULL);
+        memset(stmt->params, 0, stmt->num_params * sizeof(Param));
+        stmt_reset(stmt);
+        return PREPARE_SUCCESS;
+}
+
+PrepareResult
+stmt_prepare(Table* table, const char* sql, Statement** out) {
+        *out = NULL;
+        CommandType type = statement_type(sql);
+        if (type == COMMAND_UNKNOWN)
+                return PREPARE_UNRECOGNIZED_STATEMENT;
+
+        Statement* stmt = calloc(1, sizeof(Statement));
+        if (!stmt) {
+                printf("Failed to allocate a statement\n");
+                exit(EXIT_FAILURE);
+        }
+        arena_init(&stmt->arena, STMT_ARENA_CHUNK);
+        PrepareResult result = stmt_compile(stmt, table, type, sql);
+        if (result != PREPARE_SUCCESS) {
+                stmt_finalize(stmt);
+                return result;
+        }
+        *out = stmt;
+        return PREPARE_SUCCESS;
+}
+
+/*
+ * The arena is reset rather than freed and keeps its chunks, so a statement that fits in
+ * what the old one used allocates nothing.
+ */
+PrepareResult
+stmt_reprepare(Statement* stmt, Table* table, const char* sql) {
+        stmt_reset(stmt);
+        Arena arena = stmt->arena;
+        arena_reset(&arena);
+        memset(stmt, 0, sizeof(Statement));
+        stmt->arena = arena;
+        stmt->sql = "";
+
+        CommandType type = statement_type(sql);
+        if (type == COMMAND_UNKNOWN)
+                return PREPARE_UNRECOGNIZED_STATEMENT;
+        PrepareResult result = stmt_compile(stmt, table, type, sql);
+        if (result != PREPARE_SUCCESS)
+                stmt->sql = "";
+        return result;
+}
+
+bool
+stmt_bind_int(Statement* stmt, uint32_t index, int64_t value) {
+        if (index == 0 || index > stmt->num_params || value < 0 || value > UINT32_MAX)
+                return false;
+        Param* param = &stmt->params[index - 1];
+        param->bound = true;
+        param->value = (Value){.integer = value};
+        return true;
+}
+
+bool
+stmt_bind_text(Statement* stmt, uint32_t index, const char* text) {
+        size_t len = strlen(text);
+        if (index == 0 || index > stmt->num_params || len > COL_SIZE_EMAIL)
+                return false;
+        Param* param = &stmt->params[index - 1];
+        memcpy(param->text, text, len + 1);
+        param->bound = true;
+        param->value = (Value){.is_text = true, .text = param->text};
+        return true;
+}
+
+/** @brief Open the cursor on the latest commit unless the statement already reads one. */
+static void
+stmt_start_reading(Statement* stmt) {
+        if (!stmt->reading)
+                cursor_open(stmt->table, &stmt->cursor);
+        stmt->reading = true;
+}
+
+/** @brief Release the snapshot the statement reads at, if it holds one. */
+static void
+stmt_stop_reading(Statement* stmt) {
+        if (stmt->reading)
+                cursor_close(&stmt->cursor);
+        stmt->reading = false;
+}
+
+void
+stmt_reset(Statement* stmt) {
+        stmt_stop_reading(stmt);
+        stmt->pc = 0;
+        stmt->count = 0;
+        stmt->num_ids = 0;
+        stmt->next_id = 0;
+        filter_init(&stmt->filter);
+}
+
+void
+stmt_finalize(Statement* stmt) {
+        if (!stmt)
+                return;
+        stmt_stop_reading(stmt);
+        arena_free(&stmt->arena);
+        free(stmt);
+}
+
+const Row*
+stmt_row(Statement* stmt) {
+        return &stmt->row;
+}
+
+/*
+ * Virtual Machine
+ * Runs instructions from `pc` until one yields a row or the program halts. The first seek
+ * opens the cursor on a snapshot that it reads until the statement halts or is reset; it
+ * holds no pins between instructions, and a writer never waits on it.
+ */
+
+/** @brief Stop the statement: the next step reports that it is done. */
+static StepResult
+vm_error(Statement* stmt) {
+        stmt_stop_reading(stmt);
+        stmt->pc = stmt->num_ops - 1;
+        return STEP_ERROR;
+}
+
+/** @brief Stop the statement after a write that did not happen. */
+static StepResult
+vm_write_error(Statement* stmt, WriteResult result) {
+        vm_error(stmt);
+        return result == WRITE_TXN_ROLLED_BACK ? STEP_TXN_ROLLED_BACK : STEP_ERROR;
+}
+
+/** @brief Narrow the filter's id range to the ids `op value` admits. */
+static void
+vm_filter_id(Filter* filter, FilterOp op, uint32_t value) {
+        uint32_t min_id = 0;
+        uint32_t max_id = UINT32_MAX;
+        switch (op) {
+                case FILTER_EQ: min_id = max_id = value; break;
+                case FILTER_GE: min_id = value; break;
+                case FILTER_LE: max_id = value; break;
+                case FILTER_GT:
+                        min_id = value + 1;
+                        if (value == UINT32_MAX)
+                                min_id = UINT32_MAX, max_id = 0; // Empty range
+                        break;
+                case FILTER_LT:
+                        max_id = value - 1;
+                        if (value == 0)
+                                min_id = UINT32_MAX, max_id = 0; // Empty range
+                        break;
+        }
+
+        /* Conditions are and'ed, keep the intersection */
+        if (min_id > filter->min_id)
+                filter->min_id = min_id;
+        if (max_id < filter->max_id)
+                filter->max_id = max_id;
+}
+
+/** @brief Fill `row` from three consecutive registers, false if they do not make a row. */
+static bool
+vm_make_row(Statement* stmt, uint32_t first, Row* row) {
+        Value* id = &stmt->regs[first];
+        Value* username = &stmt->regs[first + 1];
+        Value* email = &stmt->regs[first + 2];
+        if (id->is_text || !username->is_text || !email->is_text) {
+                replog("rows take an integer id followed by a username and an email");
+                return false;
+        }
+        if (strlen(username->text) > COL_SIZE_USERNAME || strlen(email->text) > COL_SIZE_EMAIL) {
+                replog("username or email exceeds maximum length");
+                return false;
+        }
+        row->id = id->integer;
+        strcpy(row->username, username->text);
+        strcpy(row->email, email->text);
+        return true;
+}
+
+StepResult
+stmt_step(Statement* stmt) {
+        Table* table = stmt->table;
+        Filter* filter = &stmt->filter;
+        Cursor* cursor = &stmt->cursor;
+
+        for (;;) {
+                Op* op = &stmt->ops[stmt->pc];
+                Value* reg = &stmt->regs[op->p1];
+                switch (op->code) {
+                        case OP_INTEGER: *reg = (Value){.integer = op->p3}; break;
+                        case OP_STRING: *reg = (Value){.is_text = true, .text = op->p4}; break;
+                        case OP_VARIABLE: {
+                                Param* param = &stmt->params[op->p3];
+                                if (!param->bound) {
+                                        replog("parameter %u is not bound", op->p3 + 1);
+                                        return vm_error(stmt);
+                                }
+                                *reg = param->value;
+                                break;
+                        }
+                        case OP_MAKE_ROW:
+                                if (!vm_make_row(stmt, op->p1, &stmt->rows[op->p3]))
+                                        return vm_error(stmt);
+                                break;
+                        case OP_INSERT: {
+                                WriteResult result = table_insert_rows(table, stmt->rows, op->p3);
+                                if (result != WRITE_OK)
+                                        return vm_write_error(stmt, result);
+                                break;
+                        }
+                        case OP_UPDATE: {
+                                WriteResult result = table_update_row(table, &stmt->rows[0]);
+                                if (result != WRITE_OK)
+                                        return vm_write_error(stmt, result);
+                                break;
+                        }
+                        case OP_DELETE: {
+                                if (reg->is_text)
+                                        return vm_error(stmt);
+                                WriteResult result = table_delete_row(table, reg->integer);
+                                if (result != WRITE_OK)
+                                        return vm_write_error(stmt, result);
+                                break;
+                        }
+                        case OP_TRANSACTION: {
+                                bool ok = op->p3 == COMMAND_BEGIN    ? table_begin(table)
+                                          : op->p3 == COMMAND_COMMIT ? table_commit(table)
+                                                                     : table_rollback(table);
+                                if (!ok)
+                                        return vm_error(stmt);
+                                break;
+                        }
+                        case OP_FILTER_ID:
+                                if (reg->is_text) {
+                                        replog("id conditions take an integer");
+                                        return vm_error(stmt);
+                                }
+                                vm_filter_id(filter, op->p3, reg->integer);
+                                break;
+                        case OP_FILTER_TEXT: {
+                                bool username = op->p3 == INDEX_USERNAME;
+                                if (!reg->is_text) {
+                                        replog("%s conditions take text", username ? "username" : "email");
+                                        return vm_error(stmt);
+                                }
+                                if (strlen(reg->text) > (username ? COL_SIZE_USERNAME : COL_SIZE_EMAIL)) {
+                                        vm_filter_id(filter, FILTER_LT, 0); // No row can match
+                                        break;
+                                }
+                                strcpy(username ? filter->username : filter->email, reg->text);
+                                *(username ? &filter->match_username : &filter->match_email) = true;
+                                break;
+                        }
+                        case OP_LIMIT:
+                                if (reg->is_text) {
+                                        replog("select limit requires a non-negative integer");
+                                        return vm_error(stmt);
+                                }
+                                filter->limit = reg->integer;
+                                break;
+                        case OP_INDEX_SEEK:
+                                stmt_start_reading(stmt);
+                                stmt->next_id = 0;
+                                if (!table_index_lookup(cursor, filter, stmt->ids, &stmt->num_ids)) {
+                                        stmt->pc = op->p2;
+                                        continue;
+                                }
+                                break;
+                        case OP_INDEX_NEXT: {
+                                bool found = false;
+                                while (!found && stmt->next_id < stmt->num_ids) {
+                                        uint32_t id = stmt->ids[stmt->next_id++];
+                                        found = id >= filter->min_id && id <= filter->max_id &&
+                                                btree_find_exact(table, id, cursor);
+                                }
+                                if (!found || filter->limit == 0) {
+                                        stmt->pc = op->p2;
+                                        continue;
+                                }
+                                break;
+                        }
+                        case OP_SEEK:
+                                if (filter->min_id > filter->max_id || filter->limit == 0) {
+                                        stmt->pc = op->p2;
+                                        continue;
+                                }
+                                stmt_start_reading(stmt);
+                                table_seek(table, filter->min_id, filter->max_id, cursor);
+                                if (cursor->table_end) {
+                                        stmt->pc = op->p2;
+                                        continue;
+                                }
+                                break;
+                        case OP_CHECK:
+                                METRIC_INC(rows_scanned);
+                                if (!cursor_filter(cursor, filter, &stmt->row)) {
+                                        stmt->pc = op->p2;
+                                        continue;
+                                }
+                                break;
+                        case OP_RESULT:
+                                // The row is out; once the limit is reached the next step ends.
+                                stmt->count++;
+                                METRIC_INC(rows_returned);
+                                stmt->pc = stmt->count >= filter->limit ? op->p2 : stmt->pc + 1;
+                                return STEP_ROW;
+                        case OP_NEXT:
+                                cursor_advance(cursor);
+                                if (!cursor->table_end) {
+                                        stmt->pc = op->p2;
+                                        continue;
+                                }
+                                break;
+                        case OP_GOTO: stmt->pc = op->p2; continue;
+                        case OP_HALT: stmt_stop_reading(stmt); return STEP_DONE;
+                }
+                stmt->pc++;
+        }
+}
+
+void
+stmt_explain(Statement* stmt) {
+        printf("addr  opcode       p1    p2    p3    p4\n");
+        for (uint32_t i = 0; i < stmt->num_ops; i++) {
+                Op* op = &stmt->ops[i];
+                printf("%-5u %-12s %-5u %-5u %-5u %s\n", i, op_names[op->code], op->p1, op->p2, op->p3,
+                       op->p4 ? op->p4 : "");
+        }
+}
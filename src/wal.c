@@ -0,0 +1,542 @@
+#include "wal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "pager.h"
+
+#if defined(__APPLE__)
+#define fdatasync fsync
+#endif
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+#define WAL_FRAME_SIZE (WAL_FRAME_HEADER + PAGE_SIZE)
+
+/** Bytes of the frame header covered by the frame checksum */
+#define WAL_FRAME_CHECKED 16
+
+typedef struct {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t page_size;
+        uint32_t salt[2];
+        uint32_t reserved[3];
+} WalHeader;
+
+typedef struct WalFrameHeader {
+        uint32_t page_num;
+        uint32_t db_size; // Pages in the database after this commit, 0 unless commit frame
+        uint32_t salt[2];
+        uint32_t checksum; // Covers the previous frame checksum, this header and the page
+        uint32_t reserved;
+} WalFrameHeader;
+
+/** @brief FNV-1a, seeded so each frame checksum chains the previous one. */
+static uint32_t
+wal_checksum(uint32_t seed, const void* data, size_t len) {
+        const uint8_t* bytes = data;
+        uint32_t hash = seed;
+        for (size_t i = 0; i < len; i++) {
+                hash ^= bytes[i];
+                hash *= 16777619u;
+        }
+        return hash;
+}
+
+/**
+ * @brief pwritev() that retries interrupted and short writes.
+ * `iov` is consumed in place, at most IOV_MAX entries are handed to the kernel per call.
+ */
+static void
+wal_pwritev(int fd, struct iovec* iov, int iovcnt, off_t offset) {
+        while (iovcnt > 0) {
+                ssize_t bytes_written = pwritev(fd, iov, iovcnt < IOV_MAX ? iovcnt : IOV_MAX, offset);
+                if (bytes_written == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        printf("Error writing WAL: %d\n", errno);
+                        exit(EXIT_FAILURE);
+                }
+                offset += bytes_written;
+                while (iovcnt > 0 && (size_t)bytes_written >= iov->iov_len) {
+                        bytes_written -= iov->iov_len;
+                        iov++;
+                        iovcnt--;
+                }
+                if (iovcnt > 0) {
+                        iov->iov_base = (char*)iov->iov_base + bytes_written;
+                        iov->iov_len -= bytes_written;
+                }
+        }
+}
+
+static void
+wal_pwrite(int fd, const void* data, size_t len, off_t offset) {
+        while (len > 0) {
+                ssize_t bytes_written = pwrite(fd, data, len, offset);
+                if (bytes_written == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        printf("Error writing WAL: %d\n", errno);
+                        exit(EXIT_FAILURE);
+                }
+                data = (const char*)data + bytes_written;
+                len -= bytes_written;
+                offset += bytes_written;
+        }
+}
+
+static void
+wal_fdatasync(int fd) {
+        if (fdatasync(fd) == -1) {
+                printf("Error syncing WAL: %d\n", errno);
+                exit(EXIT_FAILURE);
+        }
+}
+
+/**
+ * @brief Truncate the log and start over with new salts.
+ * Frames left behind by an earlier generation no longer match the salts and are
+ * ignored by recovery even if the truncate does not reach the disk.
+ */
+static void
+wal_reset(Wal* wal) {
+        WalHeader header = {
+                .magic = WAL_MAGIC,
+                .version = WAL_VERSION,
+                .page_size = PAGE_SIZE,
+                .salt = {wal->salt[0] + 1, (uint32_t)time(NULL) ^ ((uint32_t)getpid() << 16)},
+        };
+
+        if (ftruncate(wal->fd, 0) == -1) {
+                printf("Error truncating WAL: %d\n", errno);
+                exit(EXIT_FAILURE);
+        }
+        wal_pwrite(wal->fd, &header, sizeof(header), 0);
+
+        wal->salt[0] = header.salt[0];
+        wal->salt[1] = header.salt[1];
+        wal->checksum = wal_checksum(2166136261u, &header, sizeof(header));
+        wal->written = WAL_HEADER_SIZE;
+        wal->synced = WAL_HEADER_SIZE;
+        wal->checkpointed = WAL_HEADER_SIZE;
+        if (wal->index)
+                memset(wal->index, 0, wal->index_len * sizeof(off_t));
+}
+
+typedef struct {
+        uint32_t page_num;
+        off_t offset;
+} WalFrameRef;
+
+static int
+wal_frame_ref_cmp(const void* a, const void* b) {
+        const WalFrameRef* x = a;
+        const WalFrameRef* y = b;
+        if (x->page_num != y->page_num)
+                return x->page_num < y->page_num ? -1 : 1;
+        return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+static void
+wal_flush_run(Wal* wal, struct iovec* iov, uint32_t len, uint32_t first_page) {
+        ssize_t expected = (ssize_t)len * PAGE_SIZE;
+        ssize_t bytes_written;
+        do {
+                bytes_written = pwritev(wal->db_fd, iov, len, (off_t)first_page * PAGE_SIZE);
+        } while (bytes_written == -1 && errno == EINTR);
+
+        if (bytes_written != expected) {
+                printf("Error writing: %d\n", errno);
+                exit(EXIT_FAILURE);
+        }
+}
+
+/**
+ * @brief Copy the frames in [start, end) into the database file.
+ * Only the newest frame of each page is written and runs of adjacent page numbers
+ * go out in a single pwritev(), so a page updated by many commits costs one write.
+ * Returns the number of distinct pages written, `writes` counts the pwritev() calls.
+ */
+static uint64_t
+wal_copy_frames(Wal* wal, off_t start, off_t end, uint64_t* writes) {
+        uint32_t num_frames = (end - start) / WAL_FRAME_SIZE;
+        if (num_frames == 0)
+                return 0;
+
+        WalFrameRef* refs = malloc(num_frames * sizeof(WalFrameRef));
+        char* buffer = malloc((size_t)WAL_CHECKPOINT_BATCH * WAL_FRAME_SIZE);
+
+        // Collect the frame headers, reading the log sequentially in batches.
+        for (uint32_t i = 0; i < num_frames; i += WAL_CHECKPOINT_BATCH) {
+                uint32_t batch = num_frames - i < WAL_CHECKPOINT_BATCH ? num_frames - i : WAL_CHECKPOINT_BATCH;
+                off_t offset = start + (off_t)i * WAL_FRAME_SIZE;
+                if (pread(wal->fd, buffer, (size_t)batch * WAL_FRAME_SIZE, offset) != (ssize_t)batch * WAL_FRAME_SIZE) {
+                        printf("Error reading WAL frame: %d\n", errno);
+                        exit(EXIT_FAILURE);
+                }
+                for (uint32_t j = 0; j < batch; j++) {
+                        WalFrameHeader* header = (WalFrameHeader*)(buffer + (size_t)j * WAL_FRAME_SIZE);
+                        refs[i + j].page_num = header->page_num;
+                        refs[i + j].offset = offset + (off_t)j * WAL_FRAME_SIZE;
+                }
+        }
+
+        // Sort by page and keep the newest frame of each.
+        qsort(refs, num_frames, sizeof(WalFrameRef), wal_frame_ref_cmp);
+        uint32_t num_pages = 0;
+        for (uint32_t i = 0; i < num_frames; i++) {
+                if (num_pages > 0 && refs[num_pages - 1].page_num == refs[i].page_num)
+                        num_pages--;
+                refs[num_pages++] = refs[i];
+        }
+
+        struct iovec iov[WAL_CHECKPOINT_BATCH];
+        uint32_t run_len = 0;
+        uint32_t run_start = 0;
+        for (uint32_t i = 0; i < num_pages; i++) {
+                if (run_len > 0 && (refs[i].page_num != run_start + run_len || run_len == WAL_CHECKPOINT_BATCH)) {
+                        wal_flush_run(wal, iov, run_len, run_start);
+                        (*writes)++;
+                        run_len = 0;
+                }
+                if (run_len == 0)
+                        run_start = refs[i].page_num;
+
+                char* page = buffer + (size_t)run_len * PAGE_SIZE;
+                if (pread(wal->fd, page, PAGE_SIZE, refs[i].offset + WAL_FRAME_HEADER) != PAGE_SIZE) {
+                        printf("Error reading WAL frame: %d\n", errno);
+                        exit(EXIT_FAILURE);
+                }
+                iov[run_len].iov_base = page;
+                iov[run_len].iov_len = PAGE_SIZE;
+                run_len++;
+        }
+        if (run_len > 0) {
+                wal_flush_run(wal, iov, run_len, run_start);
+                (*writes)++;
+        }
+
+        free(buffer);
+        free(refs);
+        return num_pages;
+}
+
+/**
+ * @brief Replay a log left behind by a crash into the database file.
+ * Frames are accepted while their salts and checksum chain are valid; only frames up
+ * to the last commit frame are applied, a torn trailing transaction is discarded.
+ */
+static void
+wal_recover(Wal* wal) {
+        struct stat st;
+        WalHeader header;
+
+        if (fstat(wal->fd, &st) == -1 || st.st_size < WAL_HEADER_SIZE)
+                return;
+        if (pread(wal->fd, &header, sizeof(header), 0) != sizeof(header))
+                return;
+        if (header.magic != WAL_MAGIC || header.page_size != PAGE_SIZE)
+                return;
+
+        char* frame = malloc(WAL_FRAME_SIZE);
+        uint32_t checksum = wal_checksum(2166136261u, &header, sizeof(header));
+        off_t last_commit = WAL_HEADER_SIZE;
+        off_t offset = WAL_HEADER_SIZE;
+
+        while (offset + WAL_FRAME_SIZE <= st.st_size) {
+                if (pread(wal->fd, frame, WAL_FRAME_SIZE, offset) != WAL_FRAME_SIZE)
+                        break;
+
+                WalFrameHeader* fh = (WalFrameHeader*)frame;
+                if (fh->salt[0] != header.salt[0] || fh->salt[1] != header.salt[1])
+                        break;
+
+                uint32_t expected = wal_checksum(checksum, fh, WAL_FRAME_CHECKED);
+                expected = wal_checksum(expected, frame + WAL_FRAME_HEADER, PAGE_SIZE);
+                if (fh->checksum != expected)
+                        break;
+
+                checksum = expected;
+                offset += WAL_FRAME_SIZE;
+                if (fh->db_size)
+                        last_commit = offset;
+        }
+        free(frame);
+
+        if (last_commit > WAL_HEADER_SIZE) {
+                uint64_t writes = 0;
+                uint64_t pages = wal_copy_frames(wal, WAL_HEADER_SIZE, last_commit, &writes);
+                wal_fdatasync(wal->db_fd);
+                info("Recovered %" PRIu64 " pages from %s", pages, wal->path);
+        }
+        wal->salt[0] = header.salt[0];
+}
+
+/** @brief Wait until the log is durable up to `target`. Called with the lock held. */
+static void
+wal_sync_locked(Wal* wal, off_t target) {
+        while (wal->synced < target) {
+                if (wal->syncing) {
+                        // Another committer is syncing, its fdatasync may cover this commit too.
+                        pthread_cond_wait(&wal->synced_cond, &wal->lock);
+                        continue;
+                }
+
+                // Become the leader and sync everything written so far in one call.
+                wal->syncing = true;
+                off_t end = wal->written;
+                pthread_mutex_unlock(&wal->lock);
+                wal_fdatasync(wal->fd);
+                pthread_mutex_lock(&wal->lock);
+
+                wal->syncing = false;
+                if (end > wal->synced)
+                        wal->synced = end;
+                wal->stats.syncs++;
+                pthread_cond_broadcast(&wal->synced_cond);
+        }
+}
+
+static void*
+wal_checkpointer(void* arg) {
+        Wal* wal = arg;
+
+        pthread_mutex_lock(&wal->lock);
+        while (!wal->stop) {
+                struct timespec deadline;
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_nsec += WAL_CHECKPOINT_INTERVAL * 1000000L;
+                deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+                deadline.tv_nsec %= 1000000000L;
+                pthread_cond_timedwait(&wal->wake_cond, &wal->lock, &deadline);
+                if (wal->stop)
+                        break;
+
+                // Commits in NORMAL mode wait for this sync instead of issuing their own.
+                if (wal->synced < wal->written)
+                        wal_sync_locked(wal, wal->written);
+
+                if (wal->synced - wal->checkpointed >= (off_t)WAL_CHECKPOINT_FRAMES * WAL_FRAME_SIZE) {
+                        pthread_mutex_unlock(&wal->lock);
+                        wal_checkpoint(wal);
+                        pthread_mutex_lock(&wal->lock);
+                }
+        }
+        pthread_mutex_unlock(&wal->lock);
+        return NULL;
+}
+
+Wal*
+wal_open(const char* db_filename, int db_fd, WalSyncMode sync_mode) {
+        Wal* wal = calloc(1, sizeof(Wal));
+        wal->path = malloc(strlen(db_filename) + sizeof(WAL_SUFFIX));
+        sprintf(wal->path, "%s%s", db_filename, WAL_SUFFIX);
+
+        wal->fd = open(wal->path, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+        if (wal->fd == -1) {
+                printf("Unable to open WAL file\n");
+                exit(EXIT_FAILURE);
+        }
+        wal->db_fd = db_fd;
+        wal->sync_mode = sync_mode;
+
+        wal_recover(wal);
+        wal_reset(wal);
+        wal_fdatasync(wal->fd);
+
+        pthread_mutex_init(&wal->lock, NULL);
+        pthread_cond_init(&wal->synced_cond, NULL);
+        pthread_cond_init(&wal->wake_cond, NULL);
+        if (pthread_create(&wal->checkpointer, NULL, wal_checkpointer, wal) != 0) {
+                printf("Unable to start WAL checkpointer\n");
+                exit(EXIT_FAILURE);
+        }
+        return wal;
+}
+
+void
+wal_close(Wal* wal) {
+        pthread_mutex_lock(&wal->lock);
+        wal->stop = true;
+        pthread_cond_signal(&wal->wake_cond);
+        pthread_mutex_unlock(&wal->lock);
+        pthread_join(wal->checkpointer, NULL);
+
+        // Everything is copied into the database file, the log is no longer needed.
+        pthread_mutex_lock(&wal->lock);
+        wal_sync_locked(wal, wal->written);
+        pthread_mutex_unlock(&wal->lock);
+        wal_checkpoint(wal);
+
+        close(wal->fd);
+        unlink(wal->path);
+
+        pthread_cond_destroy(&wal->wake_cond);
+        pthread_cond_destroy(&wal->synced_cond);
+        pthread_mutex_destroy(&wal->lock);
+        free(wal->index);
+        free(wal->headers);
+        free(wal->iov);
+        free(wal->path);
+        free(wal);
+}
+
+void
+wal_commit(Wal* wal, uint32_t num_frames, const uint32_t* page_nums, void* const* pages, uint32_t db_size) {
+        if (num_frames == 0)
+                return;
+
+        size_t len = (size_t)num_frames * WAL_FRAME_SIZE;
+        pthread_mutex_lock(&wal->lock);
+
+        // Frames are gathered straight from the pool pages, only the headers are built here,
+        // in scratch arrays that only grow so a steady stream of commits allocates nothing.
+        if (num_frames > wal->scratch_len) {
+                free(wal->headers);
+                free(wal->iov);
+                wal->headers = malloc(num_frames * sizeof(WalFrameHeader));
+                wal->iov = malloc(2 * (size_t)num_frames * sizeof(struct iovec));
+                if (!wal->headers || !wal->iov) {
+                        printf("Failed to allocate %u WAL frame headers\n", num_frames);
+                        exit(EXIT_FAILURE);
+                }
+                wal->scratch_len = num_frames;
+        }
+        WalFrameHeader* headers = wal->headers;
+        struct iovec* iov = wal->iov;
+
+        // Restart the log once every frame has reached the database file.
+        if (!wal->checkpointing && !wal->syncing && wal->written > WAL_HEADER_SIZE &&
+            wal->checkpointed == wal->written)
+                wal_reset(wal);
+
+        uint32_t checksum = wal->checksum;
+        for (uint32_t i = 0; i < num_frames; i++) {
+                WalFrameHeader header = {
+                        .page_num = page_nums[i],
+                        .db_size = (i == num_frames - 1) ? db_size : 0,
+                        .salt = {wal->salt[0], wal->salt[1]},
+                };
+                checksum = wal_checksum(checksum, &header, WAL_FRAME_CHECKED);
+                checksum = wal_checksum(checksum, pages[i], PAGE_SIZE);
+                header.checksum = checksum;
+
+                headers[i] = header;
+                iov[2 * i].iov_base = &headers[i];
+                iov[2 * i].iov_len = WAL_FRAME_HEADER;
+                iov[2 * i + 1].iov_base = pages[i];
+                iov[2 * i + 1].iov_len = PAGE_SIZE;
+        }
+
+        off_t offset = wal->written;
+        wal_pwritev(wal->fd, iov, 2 * num_frames, offset);
+        wal->checksum = checksum;
+        wal->written = offset + len;
+        wal->stats.commits++;
+        wal->stats.frames += num_frames;
+
+        for (uint32_t i = 0; i < num_frames; i++) {
+                uint32_t page_num = page_nums[i];
+                if (page_num >= wal->index_len) {
+                        uint32_t new_len = wal->index_len ? wal->index_len : 64;
+                        while (new_len <= page_num) new_len *= 2;
+                        wal->index = realloc(wal->index, new_len * sizeof(off_t));
+                        memset(wal->index + wal->index_len, 0, (new_len - wal->index_len) * sizeof(off_t));
+                        wal->index_len = new_len;
+                }
+                wal->index[page_num] = offset + (off_t)i * WAL_FRAME_SIZE;
+        }
+
+        if (wal->sync_mode == WAL_SYNC_FULL)
+                wal_sync_locked(wal, wal->written);
+        if (wal->written - wal->checkpointed >= (off_t)WAL_CHECKPOINT_FRAMES * WAL_FRAME_SIZE)
+                pthread_cond_signal(&wal->wake_cond);
+
+        pthread_mutex_unlock(&wal->lock);
+}
+
+bool
+wal_has_page(Wal* wal, uint32_t page_num) {
+        pthread_mutex_lock(&wal->lock);
+        bool found = page_num < wal->index_len && wal->index[page_num] != 0;
+        pthread_mutex_unlock(&wal->lock);
+        return found;
+}
+
+/**
+ * The lock is held through the read: a commit may grow the index, or restart the log
+ * and write other pages over the frame.
+ */
+bool
+wal_read_page(Wal* wal, uint32_t page_num, void* buffer) {
+        pthread_mutex_lock(&wal->lock);
+        if (page_num >= wal->index_len || wal->index[page_num] == 0) {
+                pthread_mutex_unlock(&wal->lock);
+                return false;
+        }
+
+        if (pread(wal->fd, buffer, PAGE_SIZE, wal->index[page_num] + WAL_FRAME_HEADER) != PAGE_SIZE) {
+                printf("Error reading WAL frame: %d\n", errno);
+                exit(EXIT_FAILURE);
+        }
+        pthread_mutex_unlock(&wal->lock);
+        return true;
+}
+
+void
+wal_checkpoint(Wal* wal) {
+        pthread_mutex_lock(&wal->lock);
+        if (wal->checkpointing || wal->checkpointed >= wal->synced) {
+                pthread_mutex_unlock(&wal->lock);
+                return;
+        }
+        wal->checkpointing = true;
+        off_t start = wal->checkpointed;
+        off_t end = wal->synced;
+        pthread_mutex_unlock(&wal->lock);
+
+        // Only durable frames are copied, the log stays the source of truth for the rest.
+        uint64_t writes = 0;
+        uint64_t pages = wal_copy_frames(wal, start, end, &writes);
+        wal_fdatasync(wal->db_fd);
+
+        pthread_mutex_lock(&wal->lock);
+        wal->checkpointed = end;
+        wal->checkpointing = false;
+        wal->stats.checkpoints++;
+        wal->stats.frames_checkpointed += (end - start) / WAL_FRAME_SIZE;
+        wal->stats.pages_checkpointed += pages;
+        wal->stats.checkpoint_writes += writes;
+        pthread_mutex_unlock(&wal->lock);
+}
+
+void
+wal_print_stats(Wal* wal) {
+        pthread_mutex_lock(&wal->lock);
+        WalStats stats = wal->stats;
+        off_t pending = wal->written - wal->checkpointed;
+        pthread_mutex_unlock(&wal->lock);
+
+        printf("wal commits: %" PRIu64 "\n", stats.commits);
+        printf("wal frames: %" PRIu64 "\n", stats.frames);
+        printf("wal syncs: %" PRIu64 "\n", stats.syncs);
+        printf("wal checkpoints: %" PRIu64 "\n", stats.checkpoints);
+        printf("wal frames checkpointed: %" PRIu64 "\n", stats.frames_checkpointed);
+        printf("wal pages checkpointed: %" PRIu64 "\n", stats.pages_checkpointed);
+        printf("wal checkpoint writes: %" PRIu64 "\n", stats.checkpoint_writes);
+        printf("wal frames pending: %" PRIu64 "\n", (uint64_t)(pending / WAL_FRAME_SIZE));
+}